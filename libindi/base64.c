@@ -36,11 +36,43 @@
 
 #include <ctype.h>
 #include <stdint.h>
+#include <string.h>
 #include "base64.h"
 #include "base64_luts.h"
 #include <stdio.h>
 
-/* convert inlen raw bytes at in to base64 string (NUL-terminated) at out. 
+/* SIMD paths: SSSE3 and AVX2 on x86 chosen at run time from cpuid, NEON on
+ * aarch64 where it is always present. every path falls back to the table
+ * driven scalar code for whatever is left over.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BASE64_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+static void dec64quads(unsigned char *out, const char *in, size_t nq);
+static unsigned char *dec64run(unsigned char *out, const char *in, size_t nq);
+static size_t enc64simd(unsigned char *out, const unsigned char *in, size_t inlen);
+static int simdLevel(void);
+
+static volatile int simdmax = -1; /* most simdLevel() may return, -1 for no limit */
+
+#ifdef BASE64_X86
+static size_t enc64ssse3(unsigned char *out, const unsigned char *in, size_t inlen);
+static size_t enc64avx2(unsigned char *out, const unsigned char *in, size_t inlen);
+static size_t dec64ssse3(unsigned char *out, const char *in, size_t nq);
+static size_t dec64avx2(unsigned char *out, const char *in, size_t nq);
+#endif
+#ifdef BASE64_NEON
+static size_t enc64neon(unsigned char *out, const unsigned char *in, size_t inlen);
+static size_t dec64neon(unsigned char *out, const char *in, size_t nq);
+#endif
+
+/* convert inlen raw bytes at in to base64 string (NUL-terminated) at out.
  * out size should be at least 4*inlen/3 + 4.
  * return length of out (sans trailing NUL).
  */
@@ -48,20 +80,26 @@ int to64frombits(unsigned char *out, const unsigned char *in, int inlen)
 {
     uint16_t *b64lut = (uint16_t *)base64lut;
     int dlen         = ((inlen + 2) / 3) * 4; /* 4/3, rounded up */
-    uint16_t *wbuf   = (uint16_t *)out;
+    size_t done;
+
+    /* bulk of it 12 or more bytes at a time, rest below */
+    done = inlen > 0 ? enc64simd(out, in, inlen) : 0;
+    out += done / 3 * 4;
+    in += done;
+    inlen -= done;
 
     for (; inlen > 2; inlen -= 3)
     {
         uint32_t n = in[0] << 16 | in[1] << 8 | in[2];
 
-        wbuf[0] = b64lut[n >> 12];
-        wbuf[1] = b64lut[n & 0x00000fff];
+        /* out need not be aligned */
+        memcpy(out, &b64lut[n >> 12], 2);
+        memcpy(out + 2, &b64lut[n & 0x00000fff], 2);
 
-        wbuf += 2;
+        out += 4;
         in += 3;
     }
 
-    out = (unsigned char *)wbuf;
     if (inlen > 0)
     {
         unsigned char fragment;
@@ -83,81 +121,443 @@ int to64frombits(unsigned char *out, const unsigned char *in, int inlen)
  */
 int from64tobits(char *out, const char *in)
 {
-    char *cp = (char *)in;
-    while (*cp != 0)
-        cp += 4;
-    return from64tobits_fast(out, in, cp - in);
+    return from64tobits_fast(out, in, strlen(in));
 }
 
+/* convert inlen chars of base64 at in to raw bytes at out, return count.
+ * newlines may appear anywhere, such as the 72 column lines written by
+ * IDSetBLOB. in is decoded a line at a time so the inner loops never look
+ * for them; a quad split across lines is carried over in q.
+ */
 int from64tobits_fast(char *out, const char *in, int inlen)
 {
-    int outlen = 0;
-    uint8_t b1, b2, b3;
-    uint16_t s1, s2;
-    uint32_t n32;
-    int j;
-    int n         = (inlen / 4) - 1;
-    uint16_t *inp = (uint16_t *)in;
-
-    for (j = 0; j < n; j++)
+    unsigned char *op = (unsigned char *)out;
+    const char *end   = in + inlen;
+    uint16_t qw[2];
+    char *q = (char *)qw;
+    int nq  = 0;
+
+    /* trailing white space and padding carry no bits */
+    while (end > in && (end[-1] == '=' || end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' '))
+        end--;
+
+    while (in < end)
     {
-        if (in[0] == '\n')
-            in++;
-        inp = (uint16_t *)in;
+        const char *nl = memchr(in, '\n', end - in);
+        const char *le = nl ? nl : end;
+        size_t n;
 
-        s1 = rbase64lut[inp[0]];
-        s2 = rbase64lut[inp[1]];
+        if (le > in && le[-1] == '\r')
+            le--;
 
-        n32 = s1;
-        n32 <<= 10;
-        n32 |= s2 >> 2;
+        /* finish a quad begun on the previous line */
+        while (nq > 0 && in < le)
+        {
+            q[nq++] = *in++;
+            if (nq == 4)
+            {
+                dec64quads(op, q, 1);
+                op += 3;
+                nq = 0;
+            }
+        }
+
+        n  = (le - in) / 4;
+        op = dec64run(op, in, n);
+        in += 4 * n;
+        while (in < le)
+            q[nq++] = *in++;
+
+        in = nl ? nl + 1 : end;
+    }
 
-        b3 = (n32 & 0x00ff);
-        n32 >>= 8;
-        b2 = (n32 & 0x00ff);
-        n32 >>= 8;
-        b1 = (n32 & 0x00ff);
+    /* 2 or 3 chars left are 1 or 2 bytes, 'A' is 0 */
+    if (nq > 1)
+    {
+        unsigned char b[3];
+        int i;
+
+        for (i = nq; i < 4; i++)
+            q[i] = 'A';
+        dec64quads(b, q, 1);
+        for (i = 0; i < nq - 1; i++)
+            *op++ = b[i];
+    }
 
-        out[0] = b1;
-        out[1] = b2;
-        out[2] = b3;
+    return (op - (unsigned char *)out);
+}
+
+/* decode nq complete quads at in to 3*nq bytes at out using rbase64lut */
+static void dec64quads(unsigned char *out, const char *in, size_t nq)
+{
+    for (; nq > 0; nq--)
+    {
+        uint16_t inp[2];
+        uint32_t n32;
+
+        memcpy(inp, in, 4); /* in need not be aligned */
+        n32 = rbase64lut[inp[0]];
+        n32 <<= 10;
+        n32 |= rbase64lut[inp[1]] >> 2;
+
+        out[0] = (n32 >> 16) & 0xff;
+        out[1] = (n32 >> 8) & 0xff;
+        out[2] = n32 & 0xff;
 
         in += 4;
         out += 3;
     }
-    outlen = (inlen / 4 - 1) * 3;
-    if (in[0] == '\n')
-        in++;
-    inp = (uint16_t *)in;
-
-    s1 = rbase64lut[inp[0]];
-    s2 = rbase64lut[inp[1]];
-
-    n32 = s1;
-    n32 <<= 10;
-    n32 |= s2 >> 2;
-
-    b3 = (n32 & 0x00ff);
-    n32 >>= 8;
-    b2 = (n32 & 0x00ff);
-    n32 >>= 8;
-    b1 = (n32 & 0x00ff);
-
-    *out++ = b1;
-    outlen++;
-    if ((inp[1] & 0x00FF) != 0x003D)
+}
+
+/* decode nq complete quads with no newlines at in to out, return end of out.
+ * the SIMD paths stop early at anything that is not base64, leaving it to
+ * dec64quads().
+ */
+static unsigned char *dec64run(unsigned char *out, const char *in, size_t nq)
+{
+    size_t done = 0;
+
+#if defined(BASE64_X86)
+    switch (simdLevel())
+    {
+        case 2:
+            done = dec64avx2(out, in, nq);
+            if (done < nq)
+                done += dec64ssse3(out + 3 * done, in + 4 * done, nq - done);
+            break;
+        case 1:
+            done = dec64ssse3(out, in, nq);
+            break;
+    }
+#elif defined(BASE64_NEON)
+    if (simdLevel() > 0)
+        done = dec64neon(out, in, nq);
+#endif
+
+    dec64quads(out + 3 * done, in + 4 * done, nq - done);
+    return (out + 3 * nq);
+}
+
+/* encode what the best SIMD path can of inlen bytes at in to out.
+ * return count of input bytes consumed, always a multiple of 3.
+ */
+static size_t enc64simd(unsigned char *out, const unsigned char *in, size_t inlen)
+{
+    size_t done = 0;
+
+#if defined(BASE64_X86)
+    switch (simdLevel())
+    {
+        case 2:
+            done = enc64avx2(out, in, inlen);
+            done += enc64ssse3(out + done / 3 * 4, in + done, inlen - done);
+            break;
+        case 1:
+            done = enc64ssse3(out, in, inlen);
+            break;
+    }
+#elif defined(BASE64_NEON)
+    if (simdLevel() > 0)
+        done = enc64neon(out, in, inlen);
+#else
+    (void)out;
+    (void)in;
+    (void)inlen;
+#endif
+
+    return (done);
+}
+
+/* limit the SIMD paths to level max, or none if 0, or lift the limit if < 0.
+ * return the level now in effect.
+ */
+int base64SIMDLevel(int max)
+{
+    simdmax = max;
+    return (simdLevel());
+}
+
+/* return 2 if the cpu has AVX2, 1 if SSSE3 or NEON, else 0, but no more
+ * than simdmax. the first callers may race to fill in level, harmlessly.
+ */
+static int simdLevel(void)
+{
+    static volatile int level = -1;
+    int max = simdmax;
+
+    if (level < 0)
     {
-        *out++ = b2;
-        outlen++;
-        if ((inp[1] & 0xFF00) != 0x3D00)
+#if defined(BASE64_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = 2;
+        else if (__builtin_cpu_supports("ssse3"))
+            level = 1;
+        else
+            level = 0;
+#elif defined(BASE64_NEON)
+        level = 1;
+#else
+        level = 0;
+#endif
+    }
+
+    return (max >= 0 && max < level ? max : level);
+}
+
+#ifdef BASE64_X86
+
+/* the encoders split each 3 bytes into 4 6 bit indices with multiplies, then
+ * map index ranges A-Z a-z 0-9 + / to ASCII by adding a per range offset.
+ */
+__attribute__((target("ssse3"))) static size_t enc64ssse3(unsigned char *out, const unsigned char *in,
+                                                           size_t inlen)
+{
+    const __m128i shuf  = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done;
+
+    /* each 16 byte load uses only 12 */
+    for (done = 0; inlen - done >= 16; done += 12)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+        __m128i t0, t1, r;
+
+        v  = _mm_shuffle_epi8(v, shuf);
+        t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        v  = _mm_or_si128(t0, t1);
+
+        r = _mm_subs_epu8(v, _mm_set1_epi8(51));
+        r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), v), _mm_set1_epi8(13)));
+        r = _mm_add_epi8(v, _mm_shuffle_epi8(shift, r));
+
+        _mm_storeu_si128((__m128i *)out, r);
+        out += 16;
+    }
+
+    return (done);
+}
+
+__attribute__((target("avx2"))) static size_t enc64avx2(unsigned char *out, const unsigned char *in, size_t inlen)
+{
+    const __m256i shuf  = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4,
+                                           7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done;
+
+    /* 12 bytes into each lane, the second load ends 28 bytes in */
+    for (done = 0; inlen - done >= 28; done += 24)
+    {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + done))),
+            _mm_loadu_si128((const __m128i *)(in + done + 12)), 1);
+        __m256i t0, t1, r;
+
+        v  = _mm256_shuffle_epi8(v, shuf);
+        t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        v  = _mm256_or_si256(t0, t1);
+
+        r = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), v), _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(v, _mm256_shuffle_epi8(shift, r));
+
+        _mm256_storeu_si256((__m256i *)out, r);
+        out += 32;
+    }
+
+    return (done);
+}
+
+/* the decoders classify each char by its high and low nibbles: lut_lo and
+ * lut_hi share a bit only for chars outside the alphabet, which stops the
+ * loop. the rest are mapped to 6 bits by adding a per range offset, then
+ * packed 4 to 3 with multiply-adds.
+ */
+__attribute__((target("ssse3"))) static size_t dec64ssse3(unsigned char *out, const char *in, size_t nq)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                         0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f  = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t done;
+
+    for (done = 0; nq - done >= 4; done += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * done));
+        __m128i hi_nib, lo, hi, roll;
+        uint32_t w;
+
+        hi_nib = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+        lo     = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, mask_2f));
+        hi     = _mm_shuffle_epi8(lut_hi, hi_nib);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+            break;
+        roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi_nib));
+        v    = _mm_add_epi8(v, roll);
+
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, pack);
+
+        /* store just the 12 good bytes */
+        _mm_storel_epi64((__m128i *)out, v);
+        w = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(out + 8, &w, 4);
+        out += 12;
+    }
+
+    return (done);
+}
+
+__attribute__((target("avx2"))) static size_t dec64avx2(unsigned char *out, const char *in, size_t nq)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                            0x1b, 0x1b, 0x1b, 0x1a, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4,
+                                              -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f  = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4,
+                                          10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t done;
+
+    for (done = 0; nq - done >= 8; done += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + 4 * done));
+        __m256i hi_nib, lo, hi, roll;
+
+        hi_nib = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+        lo     = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask_2f));
+        hi     = _mm256_shuffle_epi8(lut_hi, hi_nib);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+        roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f), hi_nib));
+        v    = _mm256_add_epi8(v, roll);
+
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+
+        /* 12 bytes in each lane, close them up and store the 24 */
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(out + 16), _mm256_extracti128_si256(v, 1));
+        out += 24;
+    }
+
+    return (done);
+}
+
+#endif /* BASE64_X86 */
+
+#ifdef BASE64_NEON
+
+/* base64 char to 6 bits, 0xff if not in the alphabet */
+static const uint8_t neon_rlut[128] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 62,   0xff, 0xff, 0xff, 63,
+    52,   53,   54,   55,   56,   57,   58,   59,   60,   61,   0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0,    1,    2,    3,    4,    5,    6,    7,    8,    9,    10,   11,   12,   13,   14,
+    15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25,   0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+    41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51,   0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* vld3/vst4 do the 3 to 4 interleaving, a 64 byte table lookup the digits */
+static size_t enc64neon(unsigned char *out, const unsigned char *in, size_t inlen)
+{
+    const uint8_t *digits = (const uint8_t *)base64digits;
+    const uint8x16_t m6   = vdupq_n_u8(0x3f);
+    uint8x16x4_t lut;
+    size_t done;
+
+    lut.val[0] = vld1q_u8(digits);
+    lut.val[1] = vld1q_u8(digits + 16);
+    lut.val[2] = vld1q_u8(digits + 32);
+    lut.val[3] = vld1q_u8(digits + 48);
+
+    for (done = 0; inlen - done >= 48; done += 48)
+    {
+        uint8x16x3_t s = vld3q_u8(in + done);
+        uint8x16x4_t d;
+
+        d.val[0] = vshrq_n_u8(s.val[0], 2);
+        d.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(s.val[0], 4), vshrq_n_u8(s.val[1], 4)), m6);
+        d.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(s.val[1], 2), vshrq_n_u8(s.val[2], 6)), m6);
+        d.val[3] = vandq_u8(s.val[2], m6);
+
+        d.val[0] = vqtbl4q_u8(lut, d.val[0]);
+        d.val[1] = vqtbl4q_u8(lut, d.val[1]);
+        d.val[2] = vqtbl4q_u8(lut, d.val[2]);
+        d.val[3] = vqtbl4q_u8(lut, d.val[3]);
+
+        vst4q_u8(out, d);
+        out += 64;
+    }
+
+    return (done);
+}
+
+/* 16 quads at a time through two 64 byte halves of neon_rlut. lookups out of
+ * range give 0 so or-ing the halves covers 0..127, and any char with bit 7
+ * set in itself or its value stops the loop.
+ */
+static size_t dec64neon(unsigned char *out, const char *in, size_t nq)
+{
+    const uint8x16_t c64 = vdupq_n_u8(64);
+    uint8x16x4_t lut0, lut1;
+    size_t done;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        lut0.val[i] = vld1q_u8(neon_rlut + 16 * i);
+        lut1.val[i] = vld1q_u8(neon_rlut + 64 + 16 * i);
+    }
+
+    for (done = 0; nq - done >= 16; done += 16)
+    {
+        uint8x16x4_t s = vld4q_u8((const uint8_t *)in + 4 * done);
+        uint8x16_t bad = vdupq_n_u8(0);
+        uint8x16x3_t d;
+
+        for (i = 0; i < 4; i++)
         {
-            *out++ = b3;
-            outlen++;
+            uint8x16_t c = s.val[i];
+            uint8x16_t v = vorrq_u8(vqtbl4q_u8(lut0, c), vqtbl4q_u8(lut1, vsubq_u8(c, c64)));
+
+            bad      = vorrq_u8(bad, vorrq_u8(v, c));
+            s.val[i] = v;
         }
+        if (vmaxvq_u8(bad) & 0x80)
+            break;
+
+        d.val[0] = vorrq_u8(vshlq_n_u8(s.val[0], 2), vshrq_n_u8(s.val[1], 4));
+        d.val[1] = vorrq_u8(vshlq_n_u8(s.val[1], 4), vshrq_n_u8(s.val[2], 2));
+        d.val[2] = vorrq_u8(vshlq_n_u8(s.val[2], 6), s.val[3]);
+
+        vst3q_u8(out, d);
+        out += 48;
     }
-    return outlen;
+
+    return (done);
 }
 
+#endif /* BASE64_NEON */
+
 #ifdef BASE64_PROGRAM
 /* standalone program that converts to/from base64.
  * cc -o base64 -DBASE64_PROGRAM base64.c
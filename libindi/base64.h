@@ -49,8 +49,21 @@ extern int to64frombits(unsigned char *out, const unsigned char *in, int inlen);
  */
 
 extern int from64tobits(char *out, const char *in);
+
+/** \brief Convert base64 to bytes array, ignoring newlines.
+    \param out output buffer in bytes. The buffer size must be at least (3 * inlen / 4) bytes long.
+    \param in input base64 buffer, which may be split into lines as IDSetBLOB writes them.
+    \param inlen base64 buffer length, including any newlines.
+    \return number of bytes written to out.
+ */
 extern int from64tobits_fast(char *out, const char *in, int inlen);
 
+/** \brief Limit the SIMD code the functions above may use, so each path can be tested.
+    \param max 0 for none, 1 for SSSE3 or NEON, 2 for AVX2 too, or -1 for the best the cpu has.
+    \return the level now in use, which is never more than the cpu supports.
+ */
+extern int base64SIMDLevel(int max);
+
 /*@}*/
 
 #ifdef __cplusplus
@@ -3,3 +3,9 @@
 
 /* Define INDI Data Dir */
 #cmakedefine DATA_INSTALL_DIR "@DATA_INSTALL_DIR@"
+
+/* Define if the epoll(7) interface is available */
+#cmakedefine HAVE_SYS_EPOLL_H 1
+
+/* Define if memfd_create(2) is available */
+#cmakedefine HAVE_MEMFD_CREATE 1
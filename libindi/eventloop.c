@@ -21,7 +21,7 @@
 /* suite of functions to implement an event driven program.
  *
  * callbacks may be registered that are triggered when a file descriptor
- *   will not block when read;
+ *   will not block when read; all that are ready are called each time around;
  *
  * timers may be registered that will run no sooner than a specified delay from
  *   the moment they were registered;
@@ -29,10 +29,25 @@
  * work procedures may be registered that are called when there is nothing
  *   else to do;
  *
+ * functions may be posted from any thread to be called from the loop, and
+ *   functions may be handed to worker threads to be called there, then
+ *   another called from the loop when they are done. nothing else here is
+ *   thread safe, so this is how other threads must get the loop to act.
+ *
  #define MAIN_TEST for a stand-alone test program.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for ppoll */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,12 +55,18 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #include "eventloop.h"
 
 /* info about one registered callback.
  * the malloced array cback is never shrunk, entries are reused. new id's are
  * the index of first unused slot in array (and thus reused like unix' open(2)).
+ * pollfd[] is ready for poll(2) as is: pollfd[0] is the wake fd for posts,
+ * then pollfd[i+1] is for cback[i]. the fd of an unused entry is -1, which
+ * poll ignores.
  */
 typedef struct
 {
@@ -54,26 +75,33 @@ typedef struct
     void *ud;   /* user's data handle */
     CBF *fp;    /* callback function */
 } CB;
-static CB *cback;    /* malloced list of callbacks */
-static int ncback;   /* n entries in cback[] */
-static int ncbinuse; /* n entries in cback[] marked in_use */
-static int lastcb;   /* cback index of last cb called */
+static CB *cback;               /* malloced list of callbacks */
+static struct pollfd *pollfd;   /* malloced poll list, see above */
+static int ncback;              /* n entries in cback[], one more in pollfd[] */
+static int ncbinuse;            /* n entries in cback[] marked in_use */
 
 /* info about one registered timer function.
- * the entries are kept sorted by decreasing time from epoch, ie,
- *   the next entry to fire is at the end of the array.
+ * the entries are kept as a binary heap ordered by trigger time, then by seq
+ *   so equal times run in the order added. the next entry to fire is always
+ *   timef[0]. times are from the monotonic clock so setting the system time
+ *   does not disturb them.
+ * the ids handed out wrap around after INT_MAX timers, so they are not used
+ *   for ordering; seq is 64 bits and never wraps in practice.
  */
 typedef struct
 {
-    double tgo; /* trigger time, ms from epoch */
-    void *ud;   /* user's data handle */
-    TCF *fp;    /* timer function */
-    int tid;    /* unique id for this timer */
+    double tgo;             /* trigger time, ms on the monotonic clock */
+    void *ud;               /* user's data handle */
+    TCF *fp;                /* timer function */
+    int tid;                /* unique id for this timer */
+    unsigned long long seq; /* order in which timers were added */
 } TF;
-static TF *timef;  /* malloced list of timer functions */
-static int ntimef; /* n entries in ntimef[] */
-static int tid;    /* source of unique timer ids */
-#define EPOCHDT(tp) /* ms from epoch to timeval *tp */ (((tp)->tv_usec) / 1000.0 + ((tp)->tv_sec) * 1000.0)
+static TF *timef;              /* malloced heap of timer functions */
+static int ntimef;             /* n entries in timef[] */
+static int mtimef;             /* n entries room in timef[] */
+static int tid;                /* source of unique timer ids */
+static int tidwrapped;         /* set once tid has wrapped around */
+static unsigned long long seq; /* source of timer order */
 
 /* info about one registered work procedure.
  * the malloced array wproc is never shrunk, entries are reused. new id's are
@@ -89,12 +117,51 @@ static WP *wproc;    /* malloced list of work procedures */
 static int nwproc;   /* n entries in wproc[] */
 static int nwpinuse; /* n entries in wproc[] marked in-use */
 static int lastwp;   /* wproc index of last workproc called*/
+static int wpskip;   /* n loops in a row work procs were skipped for io */
+#define WPMAXSKIP 10 /* run a work proc at least this often regardless */
+
+/* info about one function posted to run from the loop, or handed to a worker.
+ * posts[] is the queue for the loop, guarded by postmutex. posting to it
+ *   while empty makes wakefd readable, so the loop wakes to run them all.
+ * jobs[] is the queue for the workers, guarded by jobmutex. workers are
+ *   started as needed up to maxworkers, then wait on jobcond for more.
+ */
+typedef struct
+{
+    TCF *fp;     /* function to call */
+    TCF *donefp; /* for a job, function to post when fp returns, if any */
+    void *ud;    /* user's data handle */
+} PF;
+static PF *posts;     /* malloced queue of posted functions */
+static int nposts;    /* n entries in posts[] */
+static int mposts;    /* n entries room in posts[] */
+static pthread_mutex_t postmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t wakeonce   = PTHREAD_ONCE_INIT;
+static int wakefd[2] = { -1, -1 }; /* read and write ends, one eventfd on linux */
+static PF *jobs;      /* malloced queue of jobs for workers */
+static int njobs;     /* n entries in jobs[] */
+static int mjobs;     /* n entries room in jobs[] */
+static int nworkers;  /* n worker threads started */
+static int nidle;     /* n of them waiting for a job */
+static int maxworkers = 2; /* most worker threads to start, see setWorkers() */
+static pthread_mutex_t jobmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond   = PTHREAD_COND_INITIALIZER;
 
 static void runWorkProc(void);
-static void callCallback(fd_set *rfdp);
+static void callCallbacks(void);
 static void checkTimer();
 static void oneLoop(void);
 static void deferTO(void *p);
+static double nowms(void);
+static int tfBefore(TF *a, TF *b);
+static int tidInUse(int id);
+static void tfUp(int i);
+static void tfDown(int i);
+static void tfRemove(int i);
+static void initWake(void);
+static void runPosts(void);
+static void *worker(void *p);
+static int addPF(PF **pfp, int *np, int *mp, TCF *fp, TCF *donefp, void *ud);
 
 /* inf loop to dispatch callbacks, work procs and timers as necessary.
  * never returns.
@@ -165,16 +232,20 @@ int addCallback(int fd, CBF *fp, void *ud)
             break;
     if (cp == &cback[ncback])
     {
-        cback = cback ? (CB *)realloc(cback, (ncback + 1) * sizeof(CB)) : (CB *)malloc(sizeof(CB));
-        cp    = &cback[ncback++];
+        cback  = cback ? (CB *)realloc(cback, (ncback + 1) * sizeof(CB)) : (CB *)malloc(sizeof(CB));
+        pollfd = (struct pollfd *)realloc(pollfd, (ncback + 2) * sizeof(struct pollfd));
+        cp     = &cback[ncback++];
     }
 
-    /* init new entry */
+    /* init new entry, and forget anything poll said about the old */
     cp->in_use = 1;
     cp->fp     = fp;
     cp->ud     = ud;
     cp->fd     = fd;
     ncbinuse++;
+    pollfd[cp - cback + 1].fd      = fd;
+    pollfd[cp - cback + 1].events  = POLLIN;
+    pollfd[cp - cback + 1].revents = 0;
 
     /* id is index into array */
     return (cp - cback);
@@ -197,39 +268,47 @@ void rmCallback(int cid)
     /* mark for reuse */
     cp->in_use = 0;
     ncbinuse--;
+    pollfd[cid + 1].fd      = -1;
+    pollfd[cid + 1].revents = 0;
 }
 
 /* register a new timer function, fp, to be called with ud as arg after ms
- * milliseconds. add to list in order of decreasing time from epoch, ie,
- * last entry runs soonest. return id for use with rmTimer().
+ * milliseconds. add to the heap, so the soonest is always first.
+ * return id for use with rmTimer().
  */
 int addTimer(int ms, TCF *fp, void *ud)
 {
-    struct timeval t;
     TF *tp;
 
-    /* get time now */
-    gettimeofday(&t, NULL);
+    /* next id, always > 0. once they wrap skip any still in use */
+    do
+    {
+        if (tid == INT_MAX)
+        {
+            tid        = 0;
+            tidwrapped = 1;
+        }
+        tid++;
+    } while (tidwrapped && tidInUse(tid));
 
-    /* add one entry */
-    timef = timef ? (TF *)realloc(timef, (ntimef + 1) * sizeof(TF)) : (TF *)malloc(sizeof(TF));
-    tp    = &timef[ntimef++];
+    /* add one entry, growing by doubling */
+    if (ntimef == mtimef)
+    {
+        mtimef = mtimef ? 2 * mtimef : 16;
+        timef  = (TF *)realloc(timef, mtimef * sizeof(TF));
+    }
+    tp = &timef[ntimef++];
 
     /* init new entry */
     tp->ud  = ud;
     tp->fp  = fp;
-    tp->tgo = EPOCHDT(&t) + ms;
+    tp->tgo = nowms() + ms;
+    tp->tid = tid;
+    tp->seq = ++seq;
 
-    /* insert maintaining sort */
-    for (; tp > timef && tp[0].tgo > tp[-1].tgo; tp--)
-    {
-        TF tmptf = tp[-1];
-        tp[-1]   = tp[0];
-        tp[0]    = tmptf;
-    }
-
-    /* store and return new unique id */
-    return (tp->tid = ++tid);
+    /* move up to its place, return new unique id */
+    tfUp(ntimef - 1);
+    return (tid);
 }
 
 /* remove the timer with the given id, as returned from addTimer().
@@ -237,28 +316,72 @@ int addTimer(int ms, TCF *fp, void *ud)
  */
 void rmTimer(int timer_id)
 {
-    TF *tp;
+    int i;
 
-    /* find it */
-    for (tp = timef; tp < &timef[ntimef]; tp++)
-        if (tp->tid == timer_id)
-            break;
-    if (tp == &timef[ntimef])
-        return;
+    /* find it, there are seldom more than a few */
+    for (i = 0; i < ntimef; i++)
+    {
+        if (timef[i].tid == timer_id)
+        {
+            tfRemove(i);
+            return;
+        }
+    }
+}
+
+/* arrange for fp to be called with ud from the loop as soon as it can.
+ * posts run in the order made. this, and postWorker(), may be called from any
+ * thread.
+ */
+void postLoop(TCF *fp, void *ud)
+{
+    int first;
 
-    /* bubble it out */
-    for (++tp; tp < &timef[ntimef]; tp++)
-        tp[-1] = tp[0];
+    pthread_once(&wakeonce, initWake);
 
-    /* shrink list */
-    ntimef--;
-    if (ntimef == 0)
+    pthread_mutex_lock(&postmutex);
+    first = addPF(&posts, &nposts, &mposts, fp, NULL, ud) == 1;
+    pthread_mutex_unlock(&postmutex);
+
+    /* wake the loop unless it is already due to run the others */
+    if (first)
     {
-        free(timef);
-        timef = NULL;
-        return;
+        uint64_t one = 1;
+        if (write(wakefd[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("postLoop");
     }
-    timef = (TF *)realloc(timef, ntimef * sizeof(TF));
+}
+
+/* arrange for fp to be called with ud by a worker thread, and then, if donefp
+ * is not NULL, for donefp to be called with ud from the loop. jobs are taken
+ * in the order given, but with more than one worker may finish in any order.
+ */
+void postWorker(TCF *fp, TCF *donefp, void *ud)
+{
+    pthread_t t;
+
+    pthread_mutex_lock(&jobmutex);
+    addPF(&jobs, &njobs, &mjobs, fp, donefp, ud);
+    if (nidle == 0 && nworkers < maxworkers)
+    {
+        if (pthread_create(&t, NULL, worker, NULL) == 0)
+        {
+            pthread_detach(t);
+            nworkers++;
+        }
+        else if (nworkers == 0)
+            perror("postWorker");
+    }
+    pthread_cond_signal(&jobcond);
+    pthread_mutex_unlock(&jobmutex);
+}
+
+/* set the most worker threads postWorker() may start, at least 1 */
+void setWorkers(int n)
+{
+    pthread_mutex_lock(&jobmutex);
+    maxworkers = n > 1 ? n : 1;
+    pthread_mutex_unlock(&jobmutex);
 }
 
 /* add a new work procedure, fp, to be called with ud when nothing else to do.
@@ -327,116 +450,121 @@ static void runWorkProc()
     (*wp->fp)(wp->ud);
 }
 
-/* run next callback whose fd is listed as ready to go in rfdp */
-static void callCallback(fd_set *rfdp)
+/* run every callback whose fd poll found ready to go.
+ * N.B. callbacks may add or remove callbacks, so look afresh each time and
+ *   clear revents before the call.
+ */
+static void callCallbacks()
 {
-    CB *cp;
+    int i;
 
-    /* skip if list is empty */
-    if (!ncbinuse)
-        return;
-
-    /* find next */
-    do
+    for (i = 0; i < ncback; i++)
     {
-        lastcb = (lastcb + 1) % ncback;
-        cp     = &cback[lastcb];
-    } while (!cp->in_use || !FD_ISSET(cp->fd, rfdp));
-
-    /* run */
-    (*cp->fp)(cp->fd, cp->ud);
+        int revents = pollfd[i + 1].revents;
+
+        pollfd[i + 1].revents = 0;
+        if (!cback[i].in_use)
+            continue;
+        if (revents & POLLNVAL)
+            fprintf(stderr, "poll: fd %d is not open\n", cback[i].fd);
+        else if (revents)
+            (*cback[i].fp)(cback[i].fd, cback[i].ud);
+    }
 }
 
-/* run the next timer callback whose time has come, if any. all we have to do
- * is is check the last entry in timef[] because it is sorted in decreasing
- * order of time from epoch to run, ie, last entry runs soonest.
+/* run every timer callback whose time has come, soonest first. all we have to
+ * do is check timef[0] because it is the heap top.
+ * timers added by the callbacks wait for the next pass, even if already due,
+ * so one that keeps adding itself can not lock out everything else.
  */
 static void checkTimer()
 {
-    struct timeval now;
     double tgonow;
-    TF *tp;
+    unsigned long long lastseq;
+    TF tf;
 
     /* skip if list is empty */
     if (!ntimef)
         return;
 
-    gettimeofday(&now, NULL);
-    tgonow = EPOCHDT(&now);
-    tp     = &timef[ntimef - 1];
-    if (tp->tgo <= tgonow)
+    tgonow  = nowms();
+    lastseq = seq;
+    while (ntimef > 0 && timef[0].tgo <= tgonow && timef[0].seq <= lastseq)
     {
-        ntimef--; /* pop then call */
-        (*tp->fp)(tp->ud);
+        tf = timef[0]; /* pop then call */
+        tfRemove(0);
+        (*tf.fp)(tf.ud);
     }
 }
 
 /* check fd's from each active callback.
- * if any ready, call their callbacks else call each registered work procedure.
+ * call the callbacks of all that are ready, and any timers due. if none were
+ * ready, or have been for a while, call the next registered work procedure.
  */
 static void oneLoop()
 {
-    struct timeval tv, *tvp;
-    fd_set rfd;
-    CB *cp;
-    int maxfd, ns;
-
-    /* build list of callback file descriptors to check */
-    FD_ZERO(&rfd);
-    maxfd = -1;
-    for (cp = cback; cp < &cback[ncback]; cp++)
-    {
-        if (cp->in_use)
-        {
-            FD_SET(cp->fd, &rfd);
-            if (cp->fd > maxfd)
-                maxfd = cp->fd;
-        }
-    }
+    double late;
+    int ns;
 
-    /* determine timeout:
+    /* determine timeout, in ms:
 	 * if there are work procs
 	 *   set delay = 0
 	 * else if there is at least one timer func
 	 *   set delay = time until soonest timer func expires
 	 * else
-	 *   set delay = forever
+	 *   set delay = forever, -1
 	 */
     if (nwpinuse > 0)
-    {
-        tvp         = &tv;
-        tvp->tv_sec = tvp->tv_usec = 0;
-    }
+        late = 0;
     else if (ntimef > 0)
     {
-        struct timeval now;
-        double late;
-        gettimeofday(&now, NULL);
-        late = timef[ntimef - 1].tgo - EPOCHDT(&now); /* ms late */
+        late = timef[0].tgo - nowms(); /* ms late */
         if (late < 0)
             late = 0;
-        late /= 1000.0; /* secs late */
-        tvp          = &tv;
-        tvp->tv_sec  = (long)floor(late);
-        tvp->tv_usec = (long)floor((late - tvp->tv_sec) * 1000000.0);
     }
     else
-        tvp = NULL;
+        late = -1;
+
+    /* always watch for posts */
+    pthread_once(&wakeonce, initWake);
+    if (!pollfd)
+        pollfd = (struct pollfd *)malloc(sizeof(struct pollfd));
+    pollfd[0].fd      = wakefd[0];
+    pollfd[0].events  = POLLIN;
+    pollfd[0].revents = 0;
+
+    /* check file descriptors, timeout depending on pending work.
+     * ppoll can wait less than a ms, poll rounds up so as not to wake early.
+     */
+#if defined(__linux__)
+    {
+        struct timespec ts;
 
-    /* check file descriptors, timeout depending on pending work */
-    ns = select(maxfd + 1, &rfd, NULL, NULL, tvp);
+        ts.tv_sec  = (time_t)floor(late / 1000.0);
+        ts.tv_nsec = (long)floor((late - ts.tv_sec * 1000.0) * 1000000.0);
+        ns         = ppoll(pollfd, ncback + 1, late < 0 ? NULL : &ts, NULL);
+    }
+#else
+    ns = poll(pollfd, ncback + 1, late < 0 ? -1 : (int)ceil(late));
+#endif
     if (ns < 0)
     {
-        perror("select");
+        if (errno != EINTR)
+            perror("poll");
         return;
     }
 
     /* dispatch */
     checkTimer();
-    if (ns == 0)
+    if (pollfd[0].revents)
+        runPosts();
+    if (ns > 0)
+        callCallbacks();
+    if (ns == 0 || ++wpskip >= WPMAXSKIP)
+    {
+        wpskip = 0;
         runWorkProc();
-    else
-        callCallback(&rfd);
+    }
 }
 
 /* timer callback used to implement deferLoop().
@@ -447,6 +575,168 @@ static void deferTO(void *p)
     *(int *)p = 1;
 }
 
+/* make the fd with which posts wake the loop, once, from whichever thread is
+ * first. a nonblocking eventfd on linux, else a nonblocking pipe.
+ */
+static void initWake()
+{
+#if defined(__linux__)
+    wakefd[0] = wakefd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd[0] < 0)
+        perror("eventfd");
+#else
+    if (pipe(wakefd) < 0)
+        perror("pipe");
+    else
+    {
+        fcntl(wakefd[0], F_SETFL, fcntl(wakefd[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wakefd[1], F_SETFL, fcntl(wakefd[1], F_GETFL) | O_NONBLOCK);
+        fcntl(wakefd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wakefd[1], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+}
+
+/* called from the loop when wakefd is readable to run all that are posted.
+ * N.B. drain wakefd before taking the queue, so any post made after that
+ *   wakes us again.
+ */
+static void runPosts()
+{
+    char buf[64];
+    PF *run;
+    int i, n;
+
+    while (read(wakefd[0], buf, sizeof(buf)) > 0)
+        continue;
+
+    pthread_mutex_lock(&postmutex);
+    run    = posts;
+    n      = nposts;
+    posts  = NULL;
+    nposts = mposts = 0;
+    pthread_mutex_unlock(&postmutex);
+
+    for (i = 0; i < n; i++)
+        (*run[i].fp)(run[i].ud);
+    free(run);
+}
+
+/* body of each worker thread: run jobs as they come, forever */
+static void *worker(void *p)
+{
+    PF job;
+
+    (void)p;
+    while (1)
+    {
+        pthread_mutex_lock(&jobmutex);
+        while (njobs == 0)
+        {
+            nidle++;
+            pthread_cond_wait(&jobcond, &jobmutex);
+            nidle--;
+        }
+        job = jobs[0];
+        memmove(&jobs[0], &jobs[1], --njobs * sizeof(PF));
+        pthread_mutex_unlock(&jobmutex);
+
+        (*job.fp)(job.ud);
+        if (job.donefp)
+            postLoop(job.donefp, job.ud);
+    }
+
+    return (NULL);
+}
+
+/* append one PF to the malloced queue at *pfp with *np entries and room for
+ * *mp, growing by doubling. return new number of entries.
+ * N.B. caller holds the lock guarding it.
+ */
+static int addPF(PF **pfp, int *np, int *mp, TCF *fp, TCF *donefp, void *ud)
+{
+    PF *pf;
+
+    if (*np == *mp)
+    {
+        *mp  = *mp ? 2 * *mp : 16;
+        *pfp = (PF *)realloc(*pfp, *mp * sizeof(PF));
+    }
+    pf         = &(*pfp)[(*np)++];
+    pf->fp     = fp;
+    pf->donefp = donefp;
+    pf->ud     = ud;
+    return (*np);
+}
+
+/* return ms now on the monotonic clock, which never jumps */
+static double nowms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+/* return 1 if timer a is to run before b, else 0 */
+static int tfBefore(TF *a, TF *b)
+{
+    return (a->tgo < b->tgo || (a->tgo == b->tgo && a->seq < b->seq));
+}
+
+/* return 1 if a timer already has the given id, else 0 */
+static int tidInUse(int id)
+{
+    int i;
+
+    for (i = 0; i < ntimef; i++)
+        if (timef[i].tid == id)
+            return (1);
+    return (0);
+}
+
+/* move timef[i] up the heap until its parent runs before it */
+static void tfUp(int i)
+{
+    TF tf = timef[i];
+
+    while (i > 0 && tfBefore(&tf, &timef[(i - 1) / 2]))
+    {
+        timef[i] = timef[(i - 1) / 2];
+        i        = (i - 1) / 2;
+    }
+    timef[i] = tf;
+}
+
+/* move timef[i] down the heap until it runs before both its children */
+static void tfDown(int i)
+{
+    TF tf = timef[i];
+    int c;
+
+    while ((c = 2 * i + 1) < ntimef)
+    {
+        if (c + 1 < ntimef && tfBefore(&timef[c + 1], &timef[c]))
+            c++;
+        if (!tfBefore(&timef[c], &tf))
+            break;
+        timef[i] = timef[c];
+        i        = c;
+    }
+    timef[i] = tf;
+}
+
+/* remove timef[i] from the heap by moving the last entry into its place */
+static void tfRemove(int i)
+{
+    if (i != --ntimef)
+    {
+        timef[i] = timef[ntimef];
+        tfUp(i);
+        tfDown(i);
+    }
+}
+
 #if defined(MAIN_TEST)
 /* make a small stand-alone test program.
  */
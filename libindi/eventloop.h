@@ -55,7 +55,7 @@ extern "C" {
 */
 extern void eventLoop();
 
-/** Register a new callback, \e fp, to be called with \e ud as argument when \e fd is ready.
+/** Register a new callback, \e fp, to be called with \e ud as argument when \e fd is ready. Each time around the loop, the callbacks of all ready file descriptors are called.
 *
 * \param fd file descriptor.
 * \param fp a pointer to the callback function.
@@ -70,7 +70,7 @@ extern int addCallback(int fd, CBF *fp, void *ud);
 */
 extern void rmCallback(int cid);
 
-/** Add a new work procedure, fp, to be called with ud when nothing else to do.
+/** Add a new work procedure, fp, to be called with ud when nothing else to do, or every few loops regardless if file descriptors are always ready.
 *
 * \param fp a pointer to the work procedure callback function.
 * \param ud a pointer to be passed to the callback function when called.
@@ -84,7 +84,7 @@ extern int addWorkProc(WPF *fp, void *ud);
 */
 extern void rmWorkProc(int wid);
 
-/** Register a new timer function, \e fp, to be called with \e ud as argument after \e ms. Add to list in order of decreasing time from epoch, ie, last entry runs soonest. The timer will only invoke the callback function \b once. You need to call addTimer again if you want to repeat the process.
+/** Register a new timer function, \e fp, to be called with \e ud as argument after \e ms, as measured by the monotonic clock so changes to the system time do not affect it. Timers due at the same time run in the order added. The timer will only invoke the callback function \b once. You need to call addTimer again if you want to repeat the process.
 *
 * \param ms timer period in milliseconds.
 * \param fp a pointer to the callback function.
@@ -99,6 +99,27 @@ extern int addTimer(int ms, TCF *fp, void *ud);
 */
 extern void rmTimer(int tid);
 
+/** Arrange for \e fp to be called with \e ud as argument from the event loop as soon as it can, in the order posted. Unlike every other eventloop function this may be called from any thread, so it is how other threads must have the loop act for them, eg to add a timer or set a property.
+*
+* \param fp a pointer to the function to call.
+* \param ud a pointer to be passed to the function when called.
+*/
+extern void postLoop(TCF *fp, void *ud);
+
+/** Arrange for \e fp to be called with \e ud as argument on a worker thread, and then, if \e donefp is not NULL, for \e donefp to be called with \e ud from the event loop. This suits blocking work such as reading out hardware, which can then hand its results to the loop in \e donefp. Worker threads are started as needed, see setWorkers(). May be called from any thread.
+*
+* \param fp a pointer to the function to call on a worker thread.
+* \param donefp a pointer to the function to call from the loop after \e fp returns, or NULL.
+* \param ud a pointer to be passed to both functions when called.
+*/
+extern void postWorker(TCF *fp, TCF *donefp, void *ud);
+
+/** Set the most worker threads postWorker() may start, at least 1. The default is 2.
+*
+* \param n the number of worker threads.
+*/
+extern void setWorkers(int n);
+
 /* utility functions */
 extern int deferLoop(int maxms, int *flagp);
 extern int deferLoop0(int maxms, int *flagp);
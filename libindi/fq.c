@@ -114,6 +114,20 @@ void *peekiFQ(FQ *q, int i)
     return (q->nq > 0 ? q->q[q->head - q->nq + i] : NULL);
 }
 
+/* replace ith element from head of the given FQ with e.
+ * return the element replaced, or NULL if i is not on the q.
+ */
+void *setiFQ(FQ *q, int i, void *e)
+{
+    void *old;
+
+    if (i < 0 || i >= q->nq)
+        return (NULL);
+    old                       = q->q[q->head - q->nq + i];
+    q->q[q->head - q->nq + i] = e;
+    return (old);
+}
+
 /* return the number of elements in the given FQ */
 int nFQ(FQ *q)
 {
@@ -235,6 +235,17 @@ extern void IDSetBLOB(const IBLOBVectorProperty *b, const char *msg, ...)
 #endif
     ;
 
+/** \brief Hold back the IDSetText(), IDSetNumber(), IDSetSwitch() and IDSetLight() messages of the calling thread.
+
+    The messages are sent together, with a single flush, by the matching IDBatchEnd(), or sooner if they grow large.
+    Other ID functions send whatever the thread holds first, so Clients always see messages in order.
+    Calls may nest; each IDBatchBegin() must be paired with an IDBatchEnd() on the same thread.
+*/
+extern void IDBatchBegin(void);
+
+/** \brief Send the messages held since the matching IDBatchBegin(). */
+extern void IDBatchEnd(void);
+
 /*@}*/
 
 /**
@@ -350,7 +361,7 @@ extern void IERmCallback(int callbackid);
 
 /** \brief Register a new timer function, \e fp, to be called with \e ud as argument after \e ms.
 
- Add to list in order of decreasing time from epoch, ie, last entry runs soonest. The timer will only invoke the callback function \b once. You need to call addTimer again if you want to repeat the process.
+ The delay is measured by the monotonic clock, so changes to the system time do not affect it. The timer will only invoke the callback function \b once. You need to call addTimer again if you want to repeat the process.
 *
 * \param millisecs timer period in milliseconds.
 * \param fp a pointer to the callback function.
@@ -379,6 +390,33 @@ extern int IEAddWorkProc(IE_WPF *fp, void *userpointer);
 */
 extern void IERmWorkProc(int workprocid);
 
+/* functions for other threads to have the event loop act for them */
+
+/** \brief Arrange for \e fp to be called with \e userpointer as argument from the event loop as soon as it can.
+
+ The IE functions that add or remove callbacks, timers and work procedures are not thread safe, so threads a driver starts must use this to have the event loop do such things for them. The ID functions that send to the client may be called from any thread as they are, and so may this.
+*
+* \param fp a pointer to the function to call.
+* \param userpointer a pointer to be passed to the function when called.
+*/
+extern void IEPostLoop(IE_TCF *fp, void *userpointer);
+
+/** \brief Arrange for \e fp to be called with \e userpointer as argument on a worker thread, then \e donefp, if not NULL, from the event loop.
+
+ Suits blocking work such as reading out or compressing a frame, whose results \e donefp can then send. May be called from any thread.
+*
+* \param fp a pointer to the function to call on a worker thread.
+* \param donefp a pointer to the function to call from the event loop after \e fp returns, or NULL.
+* \param userpointer a pointer to be passed to both functions when called.
+*/
+extern void IEPostWorker(IE_TCF *fp, IE_TCF *donefp, void *userpointer);
+
+/** \brief Set the most worker threads IEPostWorker() may start, at least 1. The default is 2.
+*
+* \param n the number of worker threads.
+*/
+extern void IESetWorkers(int n);
+
 /* wait in-line for a flag to set, presumably by another event function */
 
 extern int IEDeferLoop(int maxms, int *flagp);
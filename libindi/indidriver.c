@@ -20,6 +20,11 @@
 
 #endif
 
+#include "config.h"
+#if defined(HAVE_MEMFD_CREATE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for memfd_create */
+#endif
+
 #include "indidriver.h"
 
 #include "base64.h"
@@ -29,6 +34,7 @@
 #include "locale_compat.h"
 
 #include <errno.h>
+#include <locale.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -37,6 +43,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#endif
 
 pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -53,18 +66,135 @@ enum
     INDI_UNKNOWN
 };
 
-/* Return index of property property if already cached, -1 otherwise */
-int isPropDefined(const char *property_name, const char *device_name)
+/* propCache is indexed by an open addressed hash of device and property name
+ * so dispatch() need not scan it for every new*Vector. each slot holds a
+ * propCache index, or -1 if empty. the table is kept at most half full.
+ * propCache and propHash only change with stdout_mutex held.
+ */
+static int *propHash;  /* propCache index per slot, -1 if empty */
+static int nPropHash;  /* slots in propHash, always a power of 2 */
+static int mPropCache; /* entries malloced in propCache */
+
+/* FNV-1a hash of device and property name */
+static unsigned int hashDN(const char *dev, const char *name)
 {
-    int i = 0;
+    unsigned int h = 2166136261u;
+
+    while (*dev)
+        h = (h ^ (unsigned char)*dev++) * 16777619u;
+    h *= 16777619u;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+
+    return (h);
+}
 
+/* enter propCache[i] in propHash */
+static void hashProp(int i)
+{
+    unsigned int s = hashDN(propCache[i].devName, propCache[i].propName) & (nPropHash - 1);
+
+    while (propHash[s] >= 0)
+        s = (s + 1) & (nPropHash - 1);
+    propHash[s] = i;
+}
+
+/* rebuild propHash from scratch for the current propCache */
+static void rehashProps(void)
+{
+    int size = 64, i;
+
+    while (size < 2 * nPropCache)
+        size *= 2;
+    if (size != nPropHash)
+    {
+        free(propHash);
+        propHash  = (int *)malloc(size * sizeof(int));
+        nPropHash = size;
+    }
+
+    memset(propHash, -1, nPropHash * sizeof(int));
     for (i = 0; i < nPropCache; i++)
+        hashProp(i);
+}
+
+/* Return index of property property if already cached, -1 otherwise.
+ * call with stdout_mutex held, the index is only good until it is released.
+ */
+int isPropDefined(const char *property_name, const char *device_name)
+{
+    unsigned int s;
+    int i;
+
+    if (!propHash)
+        return -1;
+
+    for (s = hashDN(device_name, property_name) & (nPropHash - 1); (i = propHash[s]) >= 0; s = (s + 1) & (nPropHash - 1))
         if (!strcmp(property_name, propCache[i].propName) && !strcmp(device_name, propCache[i].devName))
             return i;
 
     return -1;
 }
 
+/* add a property to propCache to insure proper sanity check */
+static void addPropCache(const char *name, const char *dev, IPerm perm, const void *ptr, int type)
+{
+    ROSC *SC;
+
+    if (nPropCache == mPropCache)
+    {
+        mPropCache = mPropCache ? 2 * mPropCache : 32;
+        propCache  = (ROSC *)realloc(propCache, mPropCache * sizeof(ROSC));
+    }
+
+    SC = &propCache[nPropCache++];
+    strcpy(SC->propName, name);
+    strcpy(SC->devName, dev);
+    SC->perm = perm;
+    SC->ptr  = ptr;
+    SC->type = type;
+
+    if (2 * nPropCache > nPropHash)
+        rehashProps();
+    else
+        hashProp(nPropCache - 1);
+}
+
+/* copy the propCache entry of property name on device dev to *sc.
+ * return 0 if found, else -1. takes stdout_mutex, so must be called without it.
+ */
+static int findPropCache(const char *name, const char *dev, ROSC *sc)
+{
+    int i;
+
+    pthread_mutex_lock(&stdout_mutex);
+    i = isPropDefined(name, dev);
+    if (i >= 0)
+        *sc = propCache[i];
+    pthread_mutex_unlock(&stdout_mutex);
+
+    return (i < 0 ? -1 : 0);
+}
+
+/* forget property name on device dev, or all of dev's properties if !name */
+static void rmPropCache(const char *dev, const char *name)
+{
+    int i, n = 0;
+
+    if (!dev)
+        return;
+
+    for (i = 0; i < nPropCache; i++)
+        if (strcmp(dev, propCache[i].devName) || (name && strcmp(name, propCache[i].propName)))
+            propCache[n++] = propCache[i];
+
+    if (n < nPropCache)
+    {
+        nPropCache = n;
+        rehashProps();
+    }
+}
+
 /* output a string expanding special characters into xml/html escape sequences */
 /* N.B. You must free the returned buffer after use! */
 char *escapeXML(const char *s, unsigned int MAX_BUF_SIZE)
@@ -106,12 +236,222 @@ char *escapeXML(const char *s, unsigned int MAX_BUF_SIZE)
     return buf;
 }
 
+/* IDSet*() format each message into a buffer private to the calling thread,
+ * then hand it to stdout with a single fwrite under stdout_mutex, so threads
+ * only contend for the write itself. the thread formats in a C LC_NUMERIC
+ * locale of its own, rather than switching the locale of the whole process
+ * with indi_locale_C_numeric_push() for every message. between
+ * IDBatchBegin() and IDBatchEnd() the messages collect in the buffer and go
+ * out together, with one flush.
+ */
+typedef struct
+{
+    char *s;   /* malloced message text */
+    int sl;    /* text length, sans trailing \0 */
+    int sm;    /* total malloced bytes */
+    int batch; /* IDBatchBegin() depth */
+} MsgBuf;
+
+/* a batch is written early once it holds this many bytes */
+#define MAXBATCH 65536
+
+static pthread_key_t msgkey;
+static pthread_once_t msgonce = PTHREAD_ONCE_INIT;
+static locale_t cnumeric; /* LC_NUMERIC "C", for uselocale() */
+
+/* thread exit: send anything still batched and free the buffer */
+static void freeMsgBuf(void *p)
+{
+    MsgBuf *mb = (MsgBuf *)p;
+
+    if (mb->sl > 0)
+    {
+        pthread_mutex_lock(&stdout_mutex);
+        fwrite(mb->s, 1, mb->sl, stdout);
+        fflush(stdout);
+        pthread_mutex_unlock(&stdout_mutex);
+    }
+
+    free(mb->s);
+    free(mb);
+}
+
+static void initMsgKey(void)
+{
+    pthread_key_create(&msgkey, freeMsgBuf);
+    cnumeric = newlocale(LC_NUMERIC_MASK, "C", duplocale(LC_GLOBAL_LOCALE));
+}
+
+/* return the calling thread's MsgBuf, creating it the first time.
+ * the caller formats into it within uselocale(cnumeric).
+ */
+static MsgBuf *msgBuf(void)
+{
+    MsgBuf *mb;
+
+    pthread_once(&msgonce, initMsgKey);
+    mb = (MsgBuf *)pthread_getspecific(msgkey);
+    if (!mb)
+    {
+        mb = (MsgBuf *)calloc(1, sizeof(MsgBuf));
+        pthread_setspecific(msgkey, mb);
+    }
+
+    return (mb);
+}
+
+/* insure room in mb for n more bytes and a \0 */
+static void growMsgBuf(MsgBuf *mb, int n)
+{
+    if (mb->sl + n + 1 > mb->sm)
+    {
+        int newsm = mb->sm ? mb->sm : 1024;
+
+        while (mb->sl + n + 1 > newsm)
+            newsm *= 2;
+        mb->s  = (char *)realloc(mb->s, newsm);
+        mb->sm = newsm;
+    }
+}
+
+/* append printf-style text to mb */
+static void addFmt(MsgBuf *mb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    growMsgBuf(mb, 256);
+    va_start(ap, fmt);
+    n = vsnprintf(mb->s + mb->sl, mb->sm - mb->sl, fmt, ap);
+    va_end(ap);
+
+    if (n >= mb->sm - mb->sl)
+    {
+        growMsgBuf(mb, n);
+        va_start(ap, fmt);
+        vsnprintf(mb->s + mb->sl, mb->sm - mb->sl, fmt, ap);
+        va_end(ap);
+    }
+
+    mb->sl += n;
+}
+
+/* append the message attribute for fmt, if any, escaped for xml */
+static void addMessage(MsgBuf *mb, const char *fmt, va_list ap)
+{
+    char message[MAXINDIMESSAGE];
+    char *mp, *s;
+
+    if (!fmt)
+        return;
+
+    vsnprintf(message, MAXINDIMESSAGE, fmt, ap);
+    growMsgBuf(mb, 6 * strlen(message) + 16);
+
+    mp = mb->s + mb->sl;
+    mp += sprintf(mp, "  message='");
+    for (s = message; *s; s++)
+    {
+        switch (*s)
+        {
+            case '&':
+                mp += sprintf(mp, "&amp;");
+                break;
+            case '\'':
+                mp += sprintf(mp, "&apos;");
+                break;
+            case '"':
+                mp += sprintf(mp, "&quot;");
+                break;
+            case '<':
+                mp += sprintf(mp, "&lt;");
+                break;
+            case '>':
+                mp += sprintf(mp, "&gt;");
+                break;
+            default:
+                *mp++ = *s;
+                break;
+        }
+    }
+    mp += sprintf(mp, "'\n");
+
+    mb->sl = mp - mb->s;
+}
+
+/* start a set*Vector message in mb with the attributes they all share.
+ * timeout is only sent if hastimeout, lights have none.
+ */
+static void addSetHeader(MsgBuf *mb, const char *tag, const char *dev, const char *name, IPState s, int hastimeout,
+                         double timeout, const char *fmt, va_list ap)
+{
+    char ts[32];
+    struct tm tm;
+    time_t t;
+
+    time(&t);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", gmtime_r(&t, &tm));
+
+    addFmt(mb, "<?xml version='1.0'?>\n<%s\n  device='%s'\n  name='%s'\n  state='%s'\n", tag, dev, name,
+           pstateStr(s));
+    if (hastimeout)
+        addFmt(mb, "  timeout='%g'\n", timeout);
+    addFmt(mb, "  timestamp='%s'\n", ts);
+    addMessage(mb, fmt, ap);
+    addFmt(mb, ">\n");
+}
+
+/* write mb to stdout and flush, unless it is collecting a batch with room */
+static void sendMsgBuf(MsgBuf *mb)
+{
+    if (mb->batch > 0 && mb->sl < MAXBATCH)
+        return;
+
+    pthread_mutex_lock(&stdout_mutex);
+    fwrite(mb->s, 1, mb->sl, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&stdout_mutex);
+
+    mb->sl = 0;
+}
+
+/* lock stdout for a message written directly with printf. anything the
+ * calling thread has batched goes first so clients see messages in order.
+ */
+static void lockStdout(void)
+{
+    MsgBuf *mb;
+
+    pthread_once(&msgonce, initMsgKey);
+    mb = (MsgBuf *)pthread_getspecific(msgkey);
+
+    pthread_mutex_lock(&stdout_mutex);
+    if (mb && mb->sl > 0)
+    {
+        fwrite(mb->s, 1, mb->sl, stdout);
+        mb->sl = 0;
+    }
+}
+
+void IDBatchBegin(void)
+{
+    msgBuf()->batch++;
+}
+
+void IDBatchEnd(void)
+{
+    MsgBuf *mb = msgBuf();
+
+    if (mb->batch > 0 && --mb->batch == 0 && mb->sl > 0)
+        sendMsgBuf(mb);
+}
+
 /* tell Client to delete the property with given name on given device, or
  * entire device if !name
  */
 void IDDelete(const char *dev, const char *name, const char *fmt, ...)
 {
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     printf("<delProperty\n  device='%s'\n", dev);
@@ -131,6 +471,8 @@ void IDDelete(const char *dev, const char *name, const char *fmt, ...)
     printf("/>\n");
     fflush(stdout);
 
+    rmPropCache(dev, name);
+
     pthread_mutex_unlock(&stdout_mutex);
 }
 
@@ -139,7 +481,7 @@ void IDDelete(const char *dev, const char *name, const char *fmt, ...)
  */
 void IDSnoopDevice(const char *snooped_device, const char *snooped_property)
 {
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
     xmlv1();
     if (snooped_property && snooped_property[0])
         printf("<getProperties version='%g' device='%s' name='%s'/>\n", INDIV, snooped_device, snooped_property);
@@ -171,7 +513,7 @@ void IDSnoopBLOBs(const char *snooped_device, const char *snooped_property, BLOB
             return;
     }
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
     xmlv1();
     if (snooped_property && snooped_property[0])
         printf("<enableBLOB device='%s' name='%s'>%s</enableBLOB>\n", snooped_device, snooped_property, how);
@@ -213,6 +555,21 @@ void IERmWorkProc(int workprocid)
     rmWorkProc(workprocid);
 }
 
+void IEPostLoop(IE_TCF *fp, void *p)
+{
+    postLoop((TCF *)fp, p);
+}
+
+void IEPostWorker(IE_TCF *fp, IE_TCF *donefp, void *p)
+{
+    postWorker((TCF *)fp, (TCF *)donefp, p);
+}
+
+void IESetWorkers(int n)
+{
+    setWorkers(n);
+}
+
 int IEDeferLoop(int maxms, int *flagp)
 {
     return (deferLoop(maxms, flagp));
@@ -223,6 +580,37 @@ int IEDeferLoop0(int maxms, int *flagp)
     return (deferLoop0(maxms, flagp));
 }
 
+/* clients send elements in the order they were defined, so try the i'th
+ * element before scanning the whole vector for names[i].
+ */
+static ISwitch *findSwitchAt(ISwitchVectorProperty *svp, char *names[], int i)
+{
+    if (i < svp->nsp && !strcmp(svp->sp[i].name, names[i]))
+        return (&svp->sp[i]);
+    return (IUFindSwitch(svp, names[i]));
+}
+
+static INumber *findNumberAt(INumberVectorProperty *nvp, char *names[], int i)
+{
+    if (i < nvp->nnp && !strcmp(nvp->np[i].name, names[i]))
+        return (&nvp->np[i]);
+    return (IUFindNumber(nvp, names[i]));
+}
+
+static IText *findTextAt(ITextVectorProperty *tvp, char *names[], int i)
+{
+    if (i < tvp->ntp && !strcmp(tvp->tp[i].name, names[i]))
+        return (&tvp->tp[i]);
+    return (IUFindText(tvp, names[i]));
+}
+
+static IBLOB *findBLOBAt(IBLOBVectorProperty *bvp, char *names[], int i)
+{
+    if (i < bvp->nbp && !strcmp(bvp->bp[i].name, names[i]))
+        return (&bvp->bp[i]);
+    return (IUFindBLOB(bvp, names[i]));
+}
+
 /* Update property switches in accord with states and names. */
 int IUUpdateSwitch(ISwitchVectorProperty *svp, ISState *states, char *names[], int n)
 {
@@ -242,7 +630,7 @@ int IUUpdateSwitch(ISwitchVectorProperty *svp, ISState *states, char *names[], i
 
     for (i = 0; i < n; i++)
     {
-        sp = IUFindSwitch(svp, names[i]);
+        sp = findSwitchAt(svp, names, i);
 
         if (!sp)
         {
@@ -288,7 +676,7 @@ int IUUpdateNumber(INumberVectorProperty *nvp, double values[], char *names[], i
 
     for (i = 0; i < n; i++)
     {
-        np = IUFindNumber(nvp, names[i]);
+        np = findNumberAt(nvp, names, i);
         if (!np)
         {
             nvp->s = IPS_IDLE;
@@ -308,7 +696,7 @@ int IUUpdateNumber(INumberVectorProperty *nvp, double values[], char *names[], i
     /* First loop checks for error, second loop set all values atomically*/
     for (i = 0; i < n; i++)
     {
-        np        = IUFindNumber(nvp, names[i]);
+        np        = findNumberAt(nvp, names, i);
         np->value = values[i];
     }
 
@@ -324,7 +712,7 @@ int IUUpdateText(ITextVectorProperty *tvp, char *texts[], char *names[], int n)
 
     for (i = 0; i < n; i++)
     {
-        tp = IUFindText(tvp, names[i]);
+        tp = findTextAt(tvp, names, i);
         if (!tp)
         {
             tvp->s = IPS_IDLE;
@@ -336,7 +724,7 @@ int IUUpdateText(ITextVectorProperty *tvp, char *texts[], char *names[], int n)
     /* First loop checks for error, second loop set all values atomically*/
     for (i = 0; i < n; i++)
     {
-        tp = IUFindText(tvp, names[i]);
+        tp = findTextAt(tvp, names, i);
         IUSaveText(tp, texts[i]);
     }
 
@@ -353,7 +741,7 @@ int IUUpdateBLOB(IBLOBVectorProperty *bvp, int sizes[], int blobsizes[], char *b
 
     for (i = 0; i < n; i++)
     {
-        bp = IUFindBLOB(bvp, names[i]);
+        bp = findBLOBAt(bvp, names, i);
         if (!bp)
         {
             bvp->s = IPS_IDLE;
@@ -365,7 +753,7 @@ int IUUpdateBLOB(IBLOBVectorProperty *bvp, int sizes[], int blobsizes[], char *b
     /* First loop checks for error, second loop set all values atomically*/
     for (i = 0; i < n; i++)
     {
-        bp = IUFindBLOB(bvp, names[i]);
+        bp = findBLOBAt(bvp, names, i);
         IUSaveBLOB(bp, sizes[i], blobsizes[i], blobs[i], formats[i]);
     }
 
@@ -893,7 +1281,7 @@ int dispatch(XMLEle *root, char msg[])
 {
     char *rtag = tagXMLEle(root);
     XMLEle *ep;
-    int n, i = 0;
+    int n;
 
     if (verbose)
         prXMLEle(stderr, root, 0);
@@ -925,30 +1313,29 @@ int dispatch(XMLEle *root, char msg[])
 
         if (name && dev)
         {
-            int index = isPropDefined(valuXMLAtt(name), valuXMLAtt(dev));
-            if (index < 0)
+            ROSC prop;
+            if (findPropCache(valuXMLAtt(name), valuXMLAtt(dev), &prop) < 0)
                 return 0;
 
-            ROSC *prop = propCache + index;
-            switch (prop->type)
+            switch (prop.type)
             {
                 case INDI_NUMBER:
-                    IDSetNumber((INumberVectorProperty *)(prop->ptr), NULL);
+                    IDSetNumber((INumberVectorProperty *)(prop.ptr), NULL);
                     return 0;
                     break;
 
                 case INDI_SWITCH:
-                    IDSetSwitch((ISwitchVectorProperty *)(prop->ptr), NULL);
+                    IDSetSwitch((ISwitchVectorProperty *)(prop.ptr), NULL);
                     return 0;
                     break;
 
                 case INDI_TEXT:
-                    IDSetText((ITextVectorProperty *)(prop->ptr), NULL);
+                    IDSetText((ITextVectorProperty *)(prop.ptr), NULL);
                     return 0;
                     break;
 
                 case INDI_BLOB:
-                    IDSetBLOB((IBLOBVectorProperty *)(prop->ptr), NULL);
+                    IDSetBLOB((IBLOBVectorProperty *)(prop.ptr), NULL);
                     return 0;
                     break;
                 default:
@@ -978,25 +1365,18 @@ int dispatch(XMLEle *root, char msg[])
     if (crackDN(root, &dev, &name, msg) < 0)
         return (-1);
 
-    if (isPropDefined(name, dev) < 0)
+    ROSC prop;
+    if (findPropCache(name, dev, &prop) < 0)
     {
         snprintf(msg, MAXRBUF, "Property %s is not defined in %s.", name, dev);
         return -1;
     }
 
     /* ensure property is not RO */
-    for (i = 0; i < nPropCache; i++)
+    if (prop.perm == IP_RO)
     {
-        if (!strcmp(propCache[i].propName, name) && !strcmp(propCache[i].devName, dev))
-        {
-            if (propCache[i].perm == IP_RO)
-            {
-                snprintf(msg, MAXRBUF, "Cannot set read-only property %s", name);
-                return -1;
-            }
-            else
-                break;
-        }
+        snprintf(msg, MAXRBUF, "Cannot set read-only property %s", name);
+        return -1;
     }
 
     /* check tag in surmised decreasing order of likelyhood */
@@ -1315,7 +1695,7 @@ void IUSaveDefaultConfig(const char *source_config, const char *dest_config, con
 /* send client a message for a specific device or at large if !dev */
 void IDMessage(const char *dev, const char *fmt, ...)
 {
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     printf("<message\n");
@@ -1493,9 +1873,8 @@ void IUSaveConfigBLOB(FILE *fp, const IBLOBVectorProperty *bvp)
 void IDDefText(const ITextVectorProperty *tvp, const char *fmt, ...)
 {
     int i;
-    ROSC *SC;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
@@ -1533,18 +1912,7 @@ void IDDefText(const ITextVectorProperty *tvp, const char *fmt, ...)
     printf("</defTextVector>\n");
 
     if (isPropDefined(tvp->name, tvp->device) < 0)
-    {
-        /* Add this property to insure proper sanity check */
-        propCache =
-            propCache ? (ROSC *)realloc(propCache, sizeof(ROSC) * (nPropCache + 1)) : (ROSC *)malloc(sizeof(ROSC));
-        SC = &propCache[nPropCache++];
-
-        strcpy(SC->propName, tvp->name);
-        strcpy(SC->devName, tvp->device);
-        SC->perm = tvp->p;
-        SC->ptr  = tvp;
-        SC->type = INDI_TEXT;
-    }
+        addPropCache(tvp->name, tvp->device, tvp->p, tvp, INDI_TEXT);
 
     indi_locale_C_numeric_pop(orig);
     fflush(stdout);
@@ -1556,9 +1924,8 @@ void IDDefText(const ITextVectorProperty *tvp, const char *fmt, ...)
 void IDDefNumber(const INumberVectorProperty *n, const char *fmt, ...)
 {
     int i;
-    ROSC *SC;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
@@ -1603,18 +1970,7 @@ void IDDefNumber(const INumberVectorProperty *n, const char *fmt, ...)
     printf("</defNumberVector>\n");
 
     if (isPropDefined(n->name, n->device) < 0)
-    {
-        /* Add this property to insure proper sanity check */
-        propCache =
-            propCache ? (ROSC *)realloc(propCache, sizeof(ROSC) * (nPropCache + 1)) : (ROSC *)malloc(sizeof(ROSC));
-        SC = &propCache[nPropCache++];
-
-        strcpy(SC->propName, n->name);
-        strcpy(SC->devName, n->device);
-        SC->perm = n->p;
-        SC->ptr  = n;
-        SC->type = INDI_NUMBER;
-    }
+        addPropCache(n->name, n->device, n->p, n, INDI_NUMBER);
 
     indi_locale_C_numeric_pop(orig);
     fflush(stdout);
@@ -1627,9 +1983,8 @@ void IDDefSwitch(const ISwitchVectorProperty *s, const char *fmt, ...)
 
 {
     int i;
-    ROSC *SC;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
@@ -1668,18 +2023,7 @@ void IDDefSwitch(const ISwitchVectorProperty *s, const char *fmt, ...)
     printf("</defSwitchVector>\n");
 
     if (isPropDefined(s->name, s->device) < 0)
-    {
-        /* Add this property to insure proper sanity check */
-        propCache =
-            propCache ? (ROSC *)realloc(propCache, sizeof(ROSC) * (nPropCache + 1)) : (ROSC *)malloc(sizeof(ROSC));
-        SC = &propCache[nPropCache++];
-
-        strcpy(SC->propName, s->name);
-        strcpy(SC->devName, s->device);
-        SC->perm = s->p;
-        SC->ptr  = s;
-        SC->type = INDI_SWITCH;
-    }
+        addPropCache(s->name, s->device, s->p, s, INDI_SWITCH);
 
     indi_locale_C_numeric_pop(orig);
     fflush(stdout);
@@ -1692,7 +2036,7 @@ void IDDefLight(const ILightVectorProperty *lvp, const char *fmt, ...)
 {
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     printf("<defLightVector\n");
@@ -1734,9 +2078,8 @@ void IDDefLight(const ILightVectorProperty *lvp, const char *fmt, ...)
 void IDDefBLOB(const IBLOBVectorProperty *b, const char *fmt, ...)
 {
     int i;
-    ROSC *SC;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
 
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
@@ -1773,18 +2116,7 @@ void IDDefBLOB(const IBLOBVectorProperty *b, const char *fmt, ...)
     printf("</defBLOBVector>\n");
 
     if (isPropDefined(b->name, b->device) < 0)
-    {
-        /* Add this property to insure proper sanity check */
-        propCache =
-            propCache ? (ROSC *)realloc(propCache, sizeof(ROSC) * (nPropCache + 1)) : (ROSC *)malloc(sizeof(ROSC));
-        SC = &propCache[nPropCache++];
-
-        strcpy(SC->propName, b->name);
-        strcpy(SC->devName, b->device);
-        SC->perm = b->p;
-        SC->ptr  = b;
-        SC->type = INDI_BLOB;
-    }
+        addPropCache(b->name, b->device, b->p, b, INDI_BLOB);
 
     indi_locale_C_numeric_pop(orig);
     fflush(stdout);
@@ -1795,174 +2127,232 @@ void IDDefBLOB(const IBLOBVectorProperty *b, const char *fmt, ...)
 /* tell client to update an existing text vector property */
 void IDSetText(const ITextVectorProperty *tvp, const char *fmt, ...)
 {
+    MsgBuf *mb = msgBuf();
+    locale_t orig;
+    va_list ap;
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
-
-    xmlv1();
-    locale_char_t *orig = indi_locale_C_numeric_push();
-    printf("<setTextVector\n");
-    printf("  device='%s'\n", tvp->device);
-    printf("  name='%s'\n", tvp->name);
-    printf("  state='%s'\n", pstateStr(tvp->s));
-    printf("  timeout='%g'\n", tvp->timeout);
-    printf("  timestamp='%s'\n", timestamp());
-    if (fmt)
-    {
-        va_list ap;
-        va_start(ap, fmt);
-        char message[MAXINDIMESSAGE];
-        printf("  message='");
-        vsnprintf(message, MAXINDIMESSAGE, fmt, ap);
-        printf("%s'\n", escapeXML(message, MAXINDIMESSAGE));
-        va_end(ap);
-    }
-    printf(">\n");
+    orig = uselocale(cnumeric);
+    va_start(ap, fmt);
+    addSetHeader(mb, "setTextVector", tvp->device, tvp->name, tvp->s, 1, tvp->timeout, fmt, ap);
+    va_end(ap);
 
     for (i = 0; i < tvp->ntp; i++)
     {
         IText *tp = &tvp->tp[i];
-        printf("  <oneText name='%s'>\n", tp->name);
-        printf("      %s\n", tp->text ? tp->text : "");
-        printf("  </oneText>\n");
+        addFmt(mb, "  <oneText name='%s'>\n      %s\n  </oneText>\n", tp->name, tp->text ? tp->text : "");
     }
 
-    printf("</setTextVector>\n");
-    indi_locale_C_numeric_pop(orig);
-    fflush(stdout);
-
-    pthread_mutex_unlock(&stdout_mutex);
+    addFmt(mb, "</setTextVector>\n");
+    uselocale(orig);
+    sendMsgBuf(mb);
 }
 
 /* tell client to update an existing numeric vector property */
 void IDSetNumber(const INumberVectorProperty *nvp, const char *fmt, ...)
 {
+    MsgBuf *mb = msgBuf();
+    locale_t orig;
+    va_list ap;
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
-
-    xmlv1();
-    locale_char_t *orig = indi_locale_C_numeric_push();
-    printf("<setNumberVector\n");
-    printf("  device='%s'\n", nvp->device);
-    printf("  name='%s'\n", nvp->name);
-    printf("  state='%s'\n", pstateStr(nvp->s));
-    printf("  timeout='%g'\n", nvp->timeout);
-    printf("  timestamp='%s'\n", timestamp());
-    if (fmt)
-    {
-        va_list ap;
-        va_start(ap, fmt);
-        char message[MAXINDIMESSAGE];
-        printf("  message='");
-        vsnprintf(message, MAXINDIMESSAGE, fmt, ap);
-        printf("%s'\n", escapeXML(message, MAXINDIMESSAGE));
-        va_end(ap);
-    }
-    printf(">\n");
+    orig = uselocale(cnumeric);
+    va_start(ap, fmt);
+    addSetHeader(mb, "setNumberVector", nvp->device, nvp->name, nvp->s, 1, nvp->timeout, fmt, ap);
+    va_end(ap);
 
     for (i = 0; i < nvp->nnp; i++)
     {
         INumber *np = &nvp->np[i];
-        printf("  <oneNumber name='%s'>\n", np->name);
-        printf("      %.20g\n", np->value);
-        printf("  </oneNumber>\n");
+        addFmt(mb, "  <oneNumber name='%s'>\n      %.20g\n  </oneNumber>\n", np->name, np->value);
     }
 
-    printf("</setNumberVector>\n");
-    indi_locale_C_numeric_pop(orig);
-    fflush(stdout);
-
-    pthread_mutex_unlock(&stdout_mutex);
+    addFmt(mb, "</setNumberVector>\n");
+    uselocale(orig);
+    sendMsgBuf(mb);
 }
 
 /* tell client to update an existing switch vector property */
 void IDSetSwitch(const ISwitchVectorProperty *svp, const char *fmt, ...)
 {
+    MsgBuf *mb = msgBuf();
+    locale_t orig;
+    va_list ap;
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
-
-    xmlv1();
-    locale_char_t *orig = indi_locale_C_numeric_push();
-    printf("<setSwitchVector\n");
-    printf("  device='%s'\n", svp->device);
-    printf("  name='%s'\n", svp->name);
-    printf("  state='%s'\n", pstateStr(svp->s));
-    printf("  timeout='%g'\n", svp->timeout);
-    printf("  timestamp='%s'\n", timestamp());
-    if (fmt)
-    {
-        va_list ap;
-        va_start(ap, fmt);
-        char message[MAXINDIMESSAGE];
-        printf("  message='");
-        vsnprintf(message, MAXINDIMESSAGE, fmt, ap);
-        printf("%s'\n", escapeXML(message, MAXINDIMESSAGE));
-        va_end(ap);
-    }
-    printf(">\n");
+    orig = uselocale(cnumeric);
+    va_start(ap, fmt);
+    addSetHeader(mb, "setSwitchVector", svp->device, svp->name, svp->s, 1, svp->timeout, fmt, ap);
+    va_end(ap);
 
     for (i = 0; i < svp->nsp; i++)
     {
         ISwitch *sp = &svp->sp[i];
-        printf("  <oneSwitch name='%s'>\n", sp->name);
-        printf("      %s\n", sstateStr(sp->s));
-        printf("  </oneSwitch>\n");
+        addFmt(mb, "  <oneSwitch name='%s'>\n      %s\n  </oneSwitch>\n", sp->name, sstateStr(sp->s));
     }
 
-    printf("</setSwitchVector>\n");
-    indi_locale_C_numeric_pop(orig);
-    fflush(stdout);
-
-    pthread_mutex_unlock(&stdout_mutex);
+    addFmt(mb, "</setSwitchVector>\n");
+    uselocale(orig);
+    sendMsgBuf(mb);
 }
 
 /* tell client to update an existing lights vector property */
 void IDSetLight(const ILightVectorProperty *lvp, const char *fmt, ...)
 {
+    MsgBuf *mb = msgBuf();
+    locale_t orig;
+    va_list ap;
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
+    orig = uselocale(cnumeric);
+    va_start(ap, fmt);
+    addSetHeader(mb, "setLightVector", lvp->device, lvp->name, lvp->s, 0, 0, fmt, ap);
+    va_end(ap);
 
-    xmlv1();
-    printf("<setLightVector\n");
-    printf("  device='%s'\n", lvp->device);
-    printf("  name='%s'\n", lvp->name);
-    printf("  state='%s'\n", pstateStr(lvp->s));
-    printf("  timestamp='%s'\n", timestamp());
-    if (fmt)
+    for (i = 0; i < lvp->nlp; i++)
     {
-        va_list ap;
-        va_start(ap, fmt);
-        char message[MAXINDIMESSAGE];
-        printf("  message='");
-        vsnprintf(message, MAXINDIMESSAGE, fmt, ap);
-        printf("%s'\n", escapeXML(message, MAXINDIMESSAGE));
-        va_end(ap);
+        ILight *lp = &lvp->lp[i];
+        addFmt(mb, "  <oneLight name='%s'>\n      %s\n  </oneLight>\n", lp->name, pstateStr(lp->s));
     }
-    printf(">\n");
 
-    for (i = 0; i < lvp->nlp; i++)
+    addFmt(mb, "</setLightVector>\n");
+    uselocale(orig);
+    sendMsgBuf(mb);
+}
+
+/* tell client to update an existing BLOB vector property */
+#ifdef HAVE_MEMFD_CREATE
+/* return 1 if indiserver takes BLOBs through shared memory, ie it said so in
+ * INDISHMBLOBS and our stdout is a socket that can carry the fds.
+ */
+static int shmBLOBs(void)
+{
+    static int shm = -1;
+
+    if (shm < 0)
     {
-        ILight *lp = &lvp->lp[i];
-        printf("  <oneLight name='%s'>\n", lp->name);
-        printf("      %s\n", pstateStr(lp->s));
-        printf("  </oneLight>\n");
+        struct stat st;
+        shm = getenv("INDISHMBLOBS") && fstat(1, &st) == 0 && S_ISSOCK(st.st_mode);
     }
 
-    printf("</setLightVector>\n");
-    fflush(stdout);
+    return shm;
+}
 
-    pthread_mutex_unlock(&stdout_mutex);
+/* copy each non-empty BLOB in bvp to its own memfd and pass them all to
+ * indiserver on stdout along with a newline, ahead of the message that uses
+ * them. call with stdout_mutex held.
+ * return 0 if ok else -1 to send them base64 encoded as usual.
+ */
+static int sendShmBLOBs(const IBLOBVectorProperty *bvp)
+{
+    int fds[32];
+    int i, nfds = 0, ret = -1;
+
+    for (i = 0; i < bvp->nbp; i++)
+    {
+        IBLOB *bp        = &bvp->bp[i];
+        const char *blob = (const char *)bp->blob;
+        int left         = bp->bloblen;
+
+        if (bp->size == 0)
+            continue;
+        if (nfds == 32 || (fds[nfds] = memfd_create("indiblob", MFD_CLOEXEC)) < 0)
+            goto done;
+        nfds++;
+
+        while (left > 0)
+        {
+            ssize_t nw = write(fds[nfds - 1], blob, left);
+            if (nw <= 0)
+                goto done;
+            blob += nw;
+            left -= nw;
+        }
+    }
+
+    if (nfds > 0)
+    {
+        char nl = '\n';
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmp;
+        union
+        {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(fds))];
+        } cbuf;
+
+        /* anything already printed must arrive first */
+        fflush(stdout);
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base       = &nl;
+        iov.iov_len        = 1;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = cbuf.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmp                = CMSG_FIRSTHDR(&msg);
+        cmp->cmsg_level    = SOL_SOCKET;
+        cmp->cmsg_type     = SCM_RIGHTS;
+        cmp->cmsg_len      = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmp), fds, nfds * sizeof(int));
+
+        if (sendmsg(1, &msg, 0) == 1)
+            ret = 0;
+    }
+
+done:
+    for (i = 0; i < nfds; i++)
+        close(fds[i]);
+    return ret;
+}
+#endif
+
+/* lines of base64 encoded per block in writeBLOB64(), 72 chars and a newline
+ * each. a block of 64KB stays in cache between encoding and writing.
+ */
+#define B64LINES 896
+
+/* write len bytes at blob to fp in base64, 72 chars to a line, the last one
+ * ending with a newline too. the lines are encoded in place in a static block
+ * which goes out in one fwrite when full, so there is no copy of the whole
+ * encoding. call with stdout_mutex held.
+ */
+static void writeBLOB64(FILE *fp, const void *blob, int len)
+{
+    static unsigned char buf[B64LINES * 73];
+    const unsigned char *in = blob;
+    unsigned char *out      = buf;
+
+    while (len > 0)
+    {
+        int n = len > 54 ? 54 : len;
+
+        /* to64frombits's trailing NUL lands where the newline goes */
+        out += to64frombits(out, in, n);
+        *out++ = '\n';
+        in += n;
+        len -= n;
+
+        if (out == buf + sizeof(buf) || len == 0)
+        {
+            fwrite(buf, 1, out - buf, fp);
+            out = buf;
+        }
+    }
 }
 
-/* tell client to update an existing BLOB vector property */
 void IDSetBLOB(const IBLOBVectorProperty *bvp, const char *fmt, ...)
 {
-    int i;
+    int i, shm = 0;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
+
+#ifdef HAVE_MEMFD_CREATE
+    if (shmBLOBs())
+        shm = sendShmBLOBs(bvp) == 0;
+#endif
 
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
@@ -1986,8 +2376,6 @@ void IDSetBLOB(const IBLOBVectorProperty *bvp, const char *fmt, ...)
     for (i = 0; i < bvp->nbp; i++)
     {
         IBLOB *bp = &bvp->bp[i];
-        unsigned char *encblob;
-        int l;
 
         printf("  <oneBLOB\n");
         printf("    name='%s'\n", bp->name);
@@ -1999,29 +2387,17 @@ void IDSetBLOB(const IBLOBVectorProperty *bvp, const char *fmt, ...)
             printf("    enclen='0'\n");
             printf("    format='%s'>\n", bp->format);
         }
+        else if (shm)
+        {
+            // Content was passed ahead in shared memory
+            printf("    format='%s'\n", bp->format);
+            printf("    attached='true'>\n");
+        }
         else
         {
-            encblob = malloc(4 * bp->bloblen / 3 + 4);
-            l       = to64frombits(encblob, bp->blob, bp->bloblen);
-            printf("    enclen='%d'\n", l);
+            printf("    enclen='%d'\n", (bp->bloblen + 2) / 3 * 4);
             printf("    format='%s'>\n", bp->format);
-            size_t written = 0;
-
-            while ((int)written < l)
-            {
-                size_t towrite = ((l - written) > 72) ? 72 : l - written;
-                size_t wr      = fwrite(encblob + written, 1, towrite, stdout);
-
-                if (wr > 0)
-                    written += wr;
-                if ((written % 72) == 0)
-                    fputc('\n', stdout);
-            }
-
-            if ((written % 72) != 0)
-                fputc('\n', stdout);
-
-            free(encblob);
+            writeBLOB64(stdout, bp->blob, bp->bloblen);
         }
 
         printf("  </oneBLOB>\n");
@@ -2039,7 +2415,7 @@ void IUUpdateMinMax(const INumberVectorProperty *nvp)
 {
     int i;
 
-    pthread_mutex_lock(&stdout_mutex);
+    lockStdout();
     xmlv1();
     locale_char_t *orig = indi_locale_C_numeric_push();
     printf("<setNumberVector\n");
@@ -92,6 +92,7 @@ int main(int ac, char *av[])
 
     /* init */
     clixml = newLilXML();
+    useArenaLilXML(clixml, 1);
     addCallback(0, clientMsgCB, NULL);
 
     /* service client */
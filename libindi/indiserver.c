@@ -26,6 +26,11 @@
  * Outbound messages are limited to Devices and Properties seen inbound.
  *   Messages to Devices on sockets always include Device so the chained
  *   indiserver will only pass back info from that Device.
+ * All Devices at the same remote host:port share one connection, so each
+ *   message from there crosses the link once however many Devices and Clients
+ *   want it. enableBLOB from Clients is not passed on, instead the connection
+ *   asks for BLOBs while any Client or snooping Driver wants them from any of
+ *   its Devices and each Client is filtered here as usual.
  * All newXXX() received from one Client are echoed to all other Clients who
  *   have shown an interest in the same Device and property.
  *
@@ -41,17 +46,67 @@
  * one client or device, they are queued and only removed after the last
  * consumer is finished. XMLEle are converted to linear strings before being
  * sent to optimize write system calls and avoid blocking to slow clients.
+ * Each write gathers as many queued messages as fit in MAXWSIZ with writev.
  * Clients that get more than maxqsiz bytes behind are shut down.
+ * Each fd is registered once in iowatch[] when it is opened and removed when
+ * it is closed. Where available epoll is used to wait so the cost of each
+ * wakeup depends only on the number of fds that are ready, else we fall back
+ * to select. Interest in writing is only enabled while a queue is non-empty.
+ * With -t each driver is read and parsed by its own thread, which hands each
+ * complete message to the main thread through a lock-free queue so a large
+ * BLOB being parsed does not hold up traffic from other drivers.
+ * setBLOBVector from drivers are not parsed in full: the raw bytes are
+ * collected as Msg content as they arrive and only the elements and attributes
+ * are parsed for routing, so the base64 payload is never copied into a DOM nor
+ * printed back out again. While one is being collected reads go straight onto
+ * its end, doubling in size up to MAXBLOBRD, and driver output pipes are
+ * enlarged to DVRPIPESZ so each wakeup can take more than the default.
+ * Each client has a queue for each class of message, see MsgClass. Writes
+ * finish any message already begun then drain the queues in class order, so
+ * controls are not held up behind images. Once a client falls more than
+ * maxstreamsiz behind in stream BLOBs only the latest unsent frame of each
+ * property is kept for it.
+ * With -c a set*Vector queued to a client replaces in place an unsent one for
+ * the same property carrying the same elements, provided no other kind of
+ * message is queued after it.
+ * With -s local drivers may pass BLOBs as raw bytes in a memfd whose fd comes
+ * over a socket standing in for their stdout, announced by a oneBLOB with
+ * attached='true' and no content. These are only base64 encoded once the
+ * message is queued to a client or driver that wants it.
+ * A client may send getProperties with blobs='binary' to have each oneBLOB
+ * sent to it as attached='true' len='N' with no content, the N raw bytes of
+ * each following the setBLOBVector end tag in order. This copy of a message
+ * is built once from the shared memory BLOBs or by decoding the base64 and is
+ * shared by all such clients. Others, and all drivers, still get base64.
+ * With -g the latest def*Vector of each property, with the values of later
+ * set*Vector merged in, is kept so getProperties from clients are answered
+ * from memory. Drivers are only asked for devices not yet seen, so a storm of
+ * reconnecting clients does not make each driver send all its properties again.
+ * Driver stderr and the -l device logs are written by a logging thread. Lines
+ * are handed to it through a bounded queue, and are dropped and counted rather
+ * than wait if it falls behind, so a chatty driver or a slow disk does not
+ * hold up routing. Log files stay open and are flushed once per batch.
+ * With -M traffic and queue counters are served in the Prometheus text format
+ * to any HTTP request on the given port. They are plain counters kept by the
+ * main thread, except the parse time histogram which reader threads also add
+ * to atomically.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for F_SETPIPE_SZ */
+#endif
+
 #include "config.h"
 
+#include "base64.h"
 #include "fq.h"
 #include "indiapi.h"
 #include "indidevapi.h"
 #include "lilxml.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <netdb.h>
@@ -64,35 +119,98 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #define INDIPORT      7624    /* default TCP/IP port to listen */
 #define REMOTEDVR     (-1234) /* invalid PID to flag remote drivers */
 #define MAXSBUF       512
 #define MAXRBUF       49152 /* max read buffering here */
 #define MAXWSIZ       49152 /* max bytes/write */
+#define MAXIOV        64    /* max messages gathered per write */
 #define DEFMAXQSIZ    128   /* default max q behind, MB */
 #define DEFMAXSSIZ    5     /* default max stream behind, MB */
 #define DEFMAXRESTART 10    /* default max restarts */
+#define MAXEVENTS     64    /* max fds serviced per epoll wakeup */
+#define BLOBTAG       "<setBLOBVector"   /* start of a message passed raw */
+#define BLOBETAG      "</setBLOBVector>" /* and its end */
+#define MAXSHMFDS     32    /* max BLOB fds accepted per driver read */
+#define B64LINE       72    /* base64 chars per line of encoded shared BLOBs */
+#define BINBLOBS      "binary" /* getProperties blobs value to get binary BLOBs */
+#define NPARSEBKT     6     /* finite buckets of parse time histogram, see parsebkt[] */
+#define MAXBLOBRD     (4 * 1024 * 1024) /* max read while collecting a raw BLOB */
+#define DVRPIPESZ     (1024 * 1024) /* size asked for driver output pipes */
+#define NLOGQ         4096  /* max lines waiting for the logging thread */
+#define MAXLOGQ       (4 * 1024 * 1024) /* max bytes waiting for the logging thread */
+#define MAXMETRICSCL  8     /* max metrics connections at once */
 
 #ifdef OSX_EMBEDED_MODE
 #define LOGNAME  "/Users/%s/Library/Logs/indiserver.log"
 #define FIFONAME "/tmp/indiserverFIFO"
 #endif
 
-/* associate a usage count with queuded client or device message */
+/* one BLOB passed by a local driver through shared memory */
 typedef struct
 {
-    int count;         /* number of consumers left */
-    unsigned long cl;  /* content length */
-    char *cp;          /* content: buf or malloced */
-    char buf[MAXWSIZ]; /* local buf for most messages */
+    void *addr; /* mmaped content, NULL if empty */
+    size_t len; /* bytes at addr */
+} ShmBLOB;
+
+/* associate a usage count with queuded client or device message */
+typedef struct _Msg
+{
+    int count;                /* number of consumers left */
+    unsigned long cl;         /* content length */
+    char *cp;                 /* content: buf or malloced */
+    char dev[MAXINDIDEVICE];  /* device, if needed to coalesce */
+    char name[MAXINDINAME];   /* property name, if needed to coalesce */
+    unsigned long elset;      /* hash of element names, to coalesce only like updates */
+    int nel;                  /* n elements hashed into elset */
+    ShmBLOB *shm;             /* BLOBs to encode when content is set */
+    int nshm;                 /* n entries in shm[] */
+    struct _Msg *bin;         /* copy with binary BLOBs, counts one use */
+    char buf[MAXWSIZ];        /* local buf for most messages */
 } Msg;
 
+/* classes of Msg queued to clients, sent in this order of priority */
+typedef enum
+{
+    MQ_CTRL = 0, /* all but setBLOBVector */
+    MQ_BLOB,     /* setBLOBVector of still images */
+    MQ_STREAM,   /* setBLOBVector with a stream format */
+    NMQ
+} MsgClass;
+
+/* traffic counters of one client or driver, for -M */
+typedef struct
+{
+    unsigned long long nrbytes; /* bytes read */
+    unsigned long long nrmsgs;  /* messages read */
+    unsigned long long nwbytes; /* bytes written */
+    unsigned long long nwmsgs;  /* messages written */
+    unsigned long long ndrops;  /* stream BLOBs dropped, clients only */
+} Traffic;
+
+/* why a client or driver was shut down */
+typedef enum
+{
+    SD_READ = 0, /* read error or EOF */
+    SD_XML,      /* bad XML */
+    SD_QUEUE,    /* fell too far behind */
+    SD_WRITE,    /* write error */
+    SD_STOP,     /* stopped from the FIFO */
+    NSD
+} ShutWhy;
+
 /* device + property name */
 typedef struct
 {
@@ -124,12 +242,61 @@ typedef struct
     int allprops;       /* saw getProperties w/o device */
     BLOBHandling blob;  /* when to send setBLOBs */
     int s;              /* socket for this client */
+    int binblobs;       /* wants setBLOBVector with binary BLOBs */
     LilXML *lp;         /* XML parsing context */
-    FQ *msgq;           /* Msg queue */
+    FQ *msgq[NMQ];      /* Msg queue for each MsgClass */
+    unsigned long qsize[NMQ]; /* bytes of all Msgs in each msgq */
+    int curq;           /* msgq[] whose first Msg is being sent, if nsent */
     unsigned int nsent; /* bytes of current Msg sent so far */
+    unsigned int rstamp; /* routestamp when last added to routecl[] */
+    int rslot;          /* index into routecl[] as of rstamp */
+    Traffic tr;         /* counters for -M */
+    unsigned long seq;  /* names this client in metrics, unlike s never reused */
 } ClInfo;
 static ClInfo *clinfo; /*  malloced pool of clients */
 static int nclinfo;    /* n total (not active) */
+static unsigned long clseq; /* seq of the latest client */
+
+/* index of client props by dev/name, chained in route[] by routeHash().
+ * entries are added with each props[] entry and removed on shutdown.
+ */
+#define NROUTE 1024 /* n hash buckets, power of 2 */
+typedef struct _Route
+{
+    struct _Route *next; /* next in same bucket */
+    int cli;             /* index into clinfo[] */
+    int pi;              /* index into clinfo[cli].props[] */
+} Route;
+static Route *route[NROUTE];
+
+/* clients found by routeClients() for one message */
+typedef struct
+{
+    int cli; /* index into clinfo[] */
+    int pi;  /* index of prop matching dev/name exactly, else -1 */
+} RouteCl;
+static RouteCl *routecl;        /* malloced array, one per clinfo[] */
+static int nroutecl;            /* n entries in use */
+static unsigned int routestamp; /* bumped for each routing pass */
+
+/* a setBLOBVector from a driver being collected raw, see parseDvrChunk() */
+typedef struct
+{
+    char *buf;                  /* malloced message so far, if inblob */
+    size_t len;                 /* bytes in buf */
+    size_t size;                /* bytes malloced for buf */
+    int inblob;                 /* set while collecting a setBLOBVector */
+    char hold[sizeof(BLOBTAG)]; /* tail of last chunk that may begin BLOBTAG */
+    int nhold;                  /* bytes in hold[] */
+    size_t rdsize;              /* size of the last read into buf, see dvrReadBuf() */
+} RawBLOB;
+
+/* one complete message found by parseDvrChunk() */
+typedef struct
+{
+    XMLEle *root; /* message, NULL marks end of list */
+    Msg *mp;      /* root as content if passed through raw, else NULL */
+} DvrMsg;
 
 /* info for each connected driver */
 typedef struct
@@ -141,6 +308,9 @@ typedef struct
     char envPrefix[MAXSBUF];
     char host[MAXSBUF];
     int port;
+    char **updev;       /* devices asked of a remote server, kept over restarts */
+    int nupdev;         /* n entries in updev[] */
+    BLOBHandling ublob; /* BLOB mode last asked of a remote server */
     //char dev[MAXINDIDEVICE];		/* device served by this driver */
     char **dev;         /* device served by this driver */
     int ndev;           /* number of devices served by this driver */
@@ -152,22 +322,173 @@ typedef struct
     int wfd;            /* write pipe fd */
     int efd;            /* stderr from driver, if local */
     int restarts;       /* times process has been restarted */
-    LilXML *lp;         /* XML parsing context */
+    unsigned int gen;   /* unique id of this start, see dvrgen */
+    LilXML *lp;         /* XML parsing context, unless dvrthreads */
+    RawBLOB *rb;        /* raw BLOB collection, unless dvrthreads */
+    FQ *fdq;            /* BLOB fds received with -s, unless dvrthreads */
     FQ *msgq;           /* Msg queue */
+    unsigned long qsize; /* bytes of all Msgs in msgq */
     unsigned int nsent; /* bytes of current Msg sent so far */
+    Traffic tr;         /* counters for -M, since first started */
+    int npcache;        /* entries in pcache[] from this driver, with -g */
 } DvrInfo;
 static DvrInfo *dvrinfo; /* malloced array of drivers */
 static int ndvrinfo;     /* n total */
 
+/* last values of each property defined by a driver, with -g. each is kept as
+ * its def*Vector with the values of later set*Vector merged in, chained in
+ * pcache[] by routeHash() and in order of definition from pchead.
+ */
+typedef struct _PCache
+{
+    struct _PCache *next;   /* next in same bucket */
+    struct _PCache *lnext;  /* next in definition order */
+    struct _PCache *lprev;  /* previous in definition order */
+    char dev[MAXINDIDEVICE];
+    char name[MAXINDINAME];
+    int dvi;                /* index into dvrinfo[] of its driver */
+    XMLEle *def;            /* def*Vector with the latest values */
+    Msg *mp;                /* def as content once wanted, else NULL */
+} PCache;
+static PCache *pcache[NROUTE];
+static PCache *pchead, *pctail;
+static unsigned long long pchits; /* getProperties answered from pcache */
+
+/* state of one driver reader thread, see dvrReader() */
+typedef struct
+{
+    int rfd;                /* read pipe or socket, owned by the thread */
+    int dvi;                /* index into dvrinfo[] */
+    unsigned int gen;       /* dvrinfo[dvi].gen when started */
+    LilXML *lp;             /* XML parsing context */
+    RawBLOB *rb;            /* raw BLOB collection */
+    FQ *fdq;                /* BLOB fds received with -s, else NULL */
+    struct _DvrEvent *endev; /* malloced up front to report end of input */
+    char name[MAXINDINAME]; /* driver name for diags */
+} DvrReader;
+
+/* one message passed from a driver reader thread to the main thread */
+typedef struct _DvrEvent
+{
+    struct _DvrEvent *next; /* next in dvrevq */
+    int dvi;                /* index into dvrinfo[] */
+    unsigned int gen;       /* dvrinfo[dvi].gen when read */
+    XMLEle *root;           /* message, or NULL at end of input */
+    Msg *mp;                /* root as content */
+    size_t nread;           /* bytes read since the previous event */
+    ShutWhy why;            /* reason for end of input */
+} DvrEvent;
+
+/* lock-free multi-producer single-consumer queue of DvrEvents, after Vyukov.
+ * reader threads push at head, the main thread pops at tail. a byte is
+ * written to the pipe on the first push after the main thread last drained it.
+ */
+static struct
+{
+    DvrEvent *head; /* last pushed */
+    DvrEvent *tail; /* next to pop */
+    DvrEvent stub;  /* keeps the list from ever being empty */
+    int wakeup;     /* set while a byte is unread in the pipe */
+    int rfd, wfd;   /* pipe to wake the main thread */
+} dvrevq;
+static int dvrthreads;      /* read each driver in its own thread */
+static int coalesce;        /* replace unsent set*Vector to clients */
+static int shmblobs;        /* offer shared memory BLOBs to local drivers */
+static int propcache;       /* answer getProperties from pcache */
+static unsigned int dvrgen; /* last DvrInfo.gen assigned */
+
+/* what a watched fd is used for */
+typedef enum
+{
+    IO_NONE = 0, /* not watched */
+    IO_FIFO,     /* fifo.fd */
+    IO_LISTEN,   /* lsocket */
+    IO_CLIENT,   /* clinfo[idx].s */
+    IO_DRIVER,   /* dvrinfo[idx].rfd and/or dvrinfo[idx].wfd */
+    IO_DRVERR,   /* dvrinfo[idx].efd */
+    IO_DVREVENT, /* dvrevq.rfd */
+    IO_MLISTEN,  /* msocket */
+    IO_METRICS   /* connection to msocket */
+} IOKind;
+
+#define IO_RD 1 /* want to read */
+#define IO_WR 2 /* want to write */
+
+/* persistent registration of each fd we service */
+typedef struct
+{
+    IOKind kind; /* what this fd is used for */
+    int idx;     /* index into clinfo[] or dvrinfo[] */
+    int events;  /* IO_RD and/or IO_WR now wanted */
+} IOWatch;
+static IOWatch *iowatch; /* malloced array indexed by fd */
+static int niowatch;     /* n entries in iowatch[] */
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1; /* epoll instance for all of iowatch[] */
+#endif
+
 static char *me;                                       /* our name */
 static int port = INDIPORT;                            /* public INDI port */
 static int verbose;                                    /* chattiness */
 static int lsocket;                                    /* listen socket */
 static char *ldir;                                     /* where to log driver messages */
 static int maxqsiz       = (DEFMAXQSIZ * 1024 * 1024); /* kill if these bytes behind */
-static int maxstreamsiz  = (DEFMAXSSIZ * 1024 * 1024); /* drop blobs if these bytes behind while streaming*/
+static int maxstreamsiz  = (DEFMAXSSIZ * 1024 * 1024); /* keep latest frame if these bytes behind while streaming */
 static int maxrestarts   = DEFMAXRESTART;
-static int terminateddrv = 0;
+
+/* metrics for -M */
+static int mport;                      /* HTTP port, 0 if none */
+static int msocket = -1;               /* listen socket */
+static unsigned long long clshut[NSD]; /* client shutdowns for each ShutWhy */
+static unsigned long long dvshut[NSD]; /* driver shutdowns for each ShutWhy */
+static const char *shutwhy[NSD] = { "read", "xml", "queue", "write", "stop" };
+static const unsigned long long parsebkt[NPARSEBKT] = { 10000ULL,    100000ULL,    1000000ULL,
+                                                        10000000ULL, 100000000ULL, 1000000000ULL }; /* ns */
+static unsigned long long parsehist[NPARSEBKT + 1]; /* parses within each parsebkt[], last beyond */
+static unsigned long long parsens;                  /* total ns of all parses */
+
+/* one line waiting for the logging thread */
+typedef struct
+{
+    char *s;      /* malloced text, with newline */
+    int len;      /* strlen(s) */
+    char day[11]; /* YYYY-MM-DD of the -l log file it goes to, else "" for stderr */
+} LogLine;
+
+/* ring of LogLines from the main thread to the logging thread, see logLine() */
+static struct
+{
+    pthread_mutex_t lock;     /* guards all below */
+    pthread_cond_t cond;      /* signaled when lines are added or quit is set */
+    pthread_t tid;            /* logging thread */
+    LogLine q[NLOGQ];         /* ring */
+    int head;                 /* index of oldest line */
+    int n;                    /* lines in q */
+    size_t bytes;             /* text in q */
+    int quit;                 /* set to drain and exit */
+    unsigned long long ndrops; /* lines dropped as q was full or no memory */
+} logq;
+static int logging; /* set once the logging thread is running */
+
+/* growing text buffer for metrics */
+typedef struct
+{
+    char *s;     /* malloced text */
+    size_t len;  /* used, sans \0 */
+    size_t size; /* malloced */
+} MText;
+
+/* one connection to msocket. its request is read and its answer written as
+ * each is ready so a slow scraper never holds up the others.
+ */
+typedef struct
+{
+    int active;   /* 1 when s is in use */
+    int s;        /* socket */
+    MText mt;     /* answer, empty until the request arrives */
+    size_t nsent; /* bytes of mt already sent */
+} MetricsCl;
+static MetricsCl mclinfo[MAXMETRICSCL];
 
 static void logStartup(int ac, char *av[]);
 static void usage(void);
@@ -175,18 +496,41 @@ static void usage(void);
 static void reapZombies(void);
 static void noSIGPIPE(void);
 static void indiFIFO(void);
+static int openListen(int lport);
+static void metricsListen(void);
+static void newMetricsClient(void);
+static int readMetrics(MetricsCl *mp);
+static void sendMetrics(MetricsCl *mp);
+static void closeMetricsClient(MetricsCl *mp);
+static void prMetrics(MText *mt);
+static void prTraffic(MText *mt, const char *name, const char *help, size_t off, int clonly);
+static void mtprintf(MText *mt, const char *fmt, ...);
+static char *mtlabel(const char *s, char *buf);
+static unsigned long long metricsClock(void);
+static void noteParseTime(unsigned long long t0);
+static void initIO(void);
+static void watchFd(int fd, IOKind kind, int idx, int events);
+static void watchWrite(int fd, int on);
+static void unwatchFd(int fd);
+static int serviceFd(int fd, int events);
 static void indiRun(void);
 static void indiListen(void);
 static void newFIFO(void);
 static void newClient(void);
 static int newClSocket(void);
-static void shutdownClient(ClInfo *cp);
+static void shutdownClient(ClInfo *cp, ShutWhy why);
 static int readFromClient(ClInfo *cp);
 static void startDvr(DvrInfo *dp);
 static void startLocalDvr(DvrInfo *dp);
 static void startRemoteDvr(DvrInfo *dp);
+static DvrInfo *findRemoteDvr(const char *host, int port);
+static void addUpDev(DvrInfo *dp, const char *dev);
+static void stopRemoteDvr(const char *name);
+static void upBLOBs(void);
+static void upBLOB(DvrInfo *dp, const char *dev);
+static int wantBLOBs(DvrInfo *dp);
 static int openINDIServer(char host[], int indi_port);
-static void shutdownDvr(DvrInfo *dp, int restart);
+static void shutdownDvr(DvrInfo *dp, int restart, ShutWhy why);
 static int isDeviceInDriver(const char *dev, DvrInfo *dp);
 static void q2RDrivers(const char *dev, Msg *mp, XMLEle *root);
 static void q2SDrivers(DvrInfo *me, int isblob, const char *dev, const char *name, Msg *mp, XMLEle *root);
@@ -196,13 +540,58 @@ static void addSDevice(DvrInfo *dp, const char *dev, const char *name);
 static Property *findSDevice(DvrInfo *dp, const char *dev, const char *name);
 static void addClDevice(ClInfo *cp, const char *dev, const char *name, int isblob);
 static int findClDevice(ClInfo *cp, const char *dev, const char *name);
+static unsigned int routeHash(const char *dev, const char *name);
+static unsigned long elsetHash(XMLEle *root, int *nel);
+static void addRoute(int cli, int pi);
+static void rmRoutes(int cli);
+static int findRoute(int cli, const char *dev, const char *name);
+static int routeClients(const char *dev, const char *name);
+static PCache *findPCache(const char *dev, const char *name);
+static void cacheDvrMsg(DvrInfo *dp, XMLEle *root);
+static void mergePCache(PCache *pc, XMLEle *root);
+static void mergeXMLAtt(XMLEle *to, XMLEle *from, const char *name);
+static void flushPCache(int dvi, const char *dev, const char *name);
+static int answerPCache(ClInfo *cp, const char *dev, const char *name, Msg *mp, XMLEle *root);
 static int readFromDriver(DvrInfo *dp);
+static int routeDvrMsg(DvrInfo *dp, XMLEle *root, Msg *mp);
+static DvrMsg *parseDvrChunk(LilXML *lp, RawBLOB *rb, char *buf, int nr, char err[]);
+static int addDvrMsgs(DvrMsg **msgs, int nmsgs, XMLEle **nodes);
+static int passRawBLOB(RawBLOB *rb, DvrMsg **msgs, int nmsgs, char err[]);
+static XMLEle *parseBLOBHeader(const char *buf, size_t len, char err[]);
+static const char *findStr(const char *s, size_t n, const char *str);
+static int heldBLOBTag(const char *s, size_t n);
+static RawBLOB *newRawBLOB(void);
+static char *dvrReadBuf(RawBLOB *rb, char *buf, size_t *np);
+static void delRawBLOB(RawBLOB *rb);
+static void initDvrEvents(void);
+static void *dvrReader(void *arg);
+static void startDvrReader(DvrInfo *dp);
+static void pushDvrEvent(DvrEvent *ep);
+static DvrEvent *popDvrEvent(void);
+static int readDvrEvents(void);
+static ssize_t readDvr(int fd, char *buf, size_t n, FQ *fdq);
+static int mapShmBLOBs(XMLEle *root, Msg **mpp, FQ *fdq, char err[]);
+static void closeFdQ(FQ *fdq);
 static int stderrFromDriver(DvrInfo *dp);
-static int msgQSize(FQ *q);
-static void setMsgXMLEle(Msg *mp, XMLEle *root);
+static int setMsgXMLEle(Msg *mp, XMLEle *root);
+static int setMsgShmBLOBs(Msg *mp, XMLEle *root);
+static int sprShmAtts(char *s, XMLEle *ep);
+static void unmapShmBLOBs(Msg *mp);
+static Msg *binMsg(Msg *mp, XMLEle *root);
+static const char *nextBLOBText(const char *s, const char *end, size_t *np);
+static size_t decodeBLOB(unsigned char *out, const char *in, size_t n);
 static void setMsgStr(Msg *mp, char *str);
 static void freeMsg(Msg *mp);
 static Msg *newMsg(void);
+static void pushClMsg(ClInfo *cp, Msg *mp, XMLEle *root, MsgClass mc);
+static unsigned long clQSize(ClInfo *cp);
+static int nClMsgs(ClInfo *cp);
+static MsgClass msgClass(int isblob, XMLEle *root);
+static int dropStreamMsgs(ClInfo *cp, Msg *mp);
+static int replaceClMsg(ClInfo *cp, Msg *mp, XMLEle *root);
+static int setClMsgIOV(ClInfo *cp, struct iovec *iov, MsgClass *iovq);
+static void pushDvrMsg(DvrInfo *dp, Msg *mp, XMLEle *root);
+static int setMsgIOV(FQ *q, unsigned int nsent, struct iovec *iov);
 static int sendClientMsg(ClInfo *cp);
 static int sendDriverMsg(DvrInfo *cp);
 static void crackBLOB(const char *enableBLOB, BLOBHandling *bp);
@@ -210,6 +599,10 @@ static void crackBLOBHandling(const char *dev, const char *name, const char *ena
 static void traceMsg(XMLEle *root);
 static char *indi_tstamp(char *s);
 static void logDMsg(XMLEle *root, const char *dev);
+static void startLogger(void);
+static void *logger(void *arg);
+static void logLine(const char *day, const char *fmt, ...);
+static void stopLogger(void);
 static void Bye(void);
 
 int main(int ac, char *av[])
@@ -296,6 +689,27 @@ int main(int ac, char *av[])
                         maxrestarts = 0;
                     ac--;
                     break;
+                case 't':
+                    dvrthreads = 1;
+                    break;
+                case 'c':
+                    coalesce = 1;
+                    break;
+                case 's':
+                    shmblobs = 1;
+                    break;
+                case 'g':
+                    propcache = 1;
+                    break;
+                case 'M':
+                    if (ac < 2)
+                    {
+                        fprintf(stderr, "-M requires metrics port value\n");
+                        usage();
+                    }
+                    mport = atoi(*++av);
+                    ac--;
+                    break;
                 case 'v':
                     verbose++;
                     break;
@@ -314,9 +728,16 @@ int main(int ac, char *av[])
     reapZombies();
     noSIGPIPE();
 
+    /* prepare to watch fds */
+    initIO();
+    startLogger();
+    if (dvrthreads)
+        initDvrEvents();
+
     /* realloc seed for client pool */
     clinfo  = (ClInfo *)malloc(1);
     nclinfo = 0;
+    routecl = (RouteCl *)malloc(1);
 
     /* create driver info array all at once since size never changes */
     ndvrinfo = ac;
@@ -331,6 +752,8 @@ int main(int ac, char *av[])
 
     /* announce we are online */
     indiListen();
+    if (mport > 0)
+        metricsListen();
 
     /* Load up FIFO, if available */
     indiFIFO();
@@ -365,11 +788,16 @@ static void usage(void)
     fprintf(stderr, " -l d     : log driver messages to <d>/YYYY-MM-DD.islog\n");
     fprintf(stderr, " -m m     : kill client if gets more than this many MB behind, default %d\n", DEFMAXQSIZ);
     fprintf(stderr,
-            " -d m     : drop streaming blobs if client gets more than this many MB behind, default %d. 0 to disable\n",
+            " -d m     : drop older streaming blobs if client gets more than this many MB behind, default %d. 0 to disable\n",
             DEFMAXSSIZ);
     fprintf(stderr, " -p p     : alternate IP port, default %d\n", INDIPORT);
     fprintf(stderr, " -r r     : maximum driver restarts on error, default %d\n", DEFMAXRESTART);
     fprintf(stderr, " -f path  : Path to fifo for dynamic startup and shutdown of drivers.\n");
+    fprintf(stderr, " -t       : read and parse each driver in its own thread\n");
+    fprintf(stderr, " -c       : replace set messages not yet sent to a client with newer ones\n");
+    fprintf(stderr, " -s       : let local drivers pass BLOBs through shared memory\n");
+    fprintf(stderr, " -g       : answer getProperties from the last values seen when possible\n");
+    fprintf(stderr, " -M p     : serve Prometheus metrics over HTTP on port p\n");
     fprintf(stderr, " -v       : show key events, no traffic\n");
     fprintf(stderr, " -vv      : -v + key message content\n");
     fprintf(stderr, " -vvv     : -vv + complete xml\n");
@@ -485,8 +913,10 @@ static void startLocalDvr(DvrInfo *dp)
     fflush(stderr);
 #endif
 
-    /* build three pipes: r, w and error*/
-    if (pipe(rp) < 0)
+    /* build three pipes: r, w and error. r is a socket with -s so the
+     * driver can pass BLOB fds along with its output.
+     */
+    if (shmblobs ? socketpair(AF_UNIX, SOCK_STREAM, 0, rp) < 0 : pipe(rp) < 0)
     {
         fprintf(stderr, "%s: read pipe: %s\n", indi_tstamp(NULL), strerror(errno));
         Bye();
@@ -502,6 +932,17 @@ static void startLocalDvr(DvrInfo *dp)
         Bye();
     }
 
+    /* let BLOBs come in bigger pieces, fine if not allowed */
+    if (shmblobs)
+    {
+        int sz = DVRPIPESZ;
+        (void)setsockopt(rp[0], SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    }
+#ifdef F_SETPIPE_SZ
+    else
+        (void)fcntl(rp[0], F_SETPIPE_SZ, DVRPIPESZ);
+#endif
+
     /* fork&exec new process */
     pid = fork();
     if (pid < 0)
@@ -534,6 +975,8 @@ static void startLocalDvr(DvrInfo *dp)
             setenv("INDISKEL", dp->envSkel, 1);
         else if (fifo.fd > 0)
             unsetenv("INDISKEL");
+        if (shmblobs)
+            setenv("INDISHMBLOBS", "1", 1);
         char executable[MAXSBUF];
         if (*dp->envPrefix)
         {
@@ -585,23 +1028,36 @@ static void startLocalDvr(DvrInfo *dp)
     dp->rfd     = rp[0];
     dp->wfd     = wp[1];
     dp->efd     = ep[0];
-    dp->lp      = newLilXML();
+    dp->gen     = ++dvrgen;
+    dp->lp      = dvrthreads ? NULL : newLilXML();
+    dp->rb      = dvrthreads ? NULL : newRawBLOB();
+    if (dp->lp)
+        useArenaLilXML(dp->lp, 1);
+    dp->fdq     = shmblobs ? newFQ(1) : NULL;
     dp->msgq    = newFQ(1);
     dp->sprops  = (Property *)malloc(1); /* seed for realloc */
     dp->nsprops = 0;
+    dp->qsize   = 0;
     dp->nsent   = 0;
     dp->active  = 1;
     dp->ndev    = 0;
     dp->dev     = (char **)malloc(sizeof(char *));
 
+    /* watch for traffic */
+    if (dvrthreads)
+        startDvrReader(dp);
+    else
+        watchFd(dp->rfd, IO_DRIVER, dp - dvrinfo, IO_RD);
+    watchFd(dp->wfd, IO_DRIVER, dp - dvrinfo, 0);
+    watchFd(dp->efd, IO_DRVERR, dp - dvrinfo, IO_RD);
+
     /* first message primes driver to report its properties -- dev known
      * if restarting
      */
     mp = newMsg();
-    pushFQ(dp->msgq, mp);
     snprintf(buf, sizeof(buf), "<getProperties version='%g'/>\n", INDIV);
     setMsgStr(mp, buf);
-    mp->count++;
+    pushDvrMsg(dp, mp, NULL);
 
     if (verbose > 0)
         fprintf(stderr, "%s: Driver %s: pid=%d rfd=%d wfd=%d efd=%d\n", indi_tstamp(NULL), dp->name, dp->pid, dp->rfd,
@@ -614,57 +1070,275 @@ static void startLocalDvr(DvrInfo *dp)
 static void startRemoteDvr(DvrInfo *dp)
 {
     Msg *mp;
+    DvrInfo *odp;
     char dev[MAXINDIDEVICE];
     char host[MAXSBUF];
     char buf[MAXSBUF];
-    int indi_port, sockfd;
+    int indi_port, sockfd, i;
 
     /* extract host and port */
     indi_port = INDIPORT;
-    if (sscanf(dp->name, "%[^@]@%[^:]:%d", dev, host, &indi_port) < 2)
+    if (sscanf(dp->name, "%63[^@]@%511[^:]:%d", dev, host, &indi_port) < 2)
     {
         fprintf(stderr, "Bad remote device syntax: %s\n", dp->name);
         Bye();
     }
 
-    /* connect */
+    /* unless restarting, add dev to any connection already open to the same
+     * server and recycle dp.
+     */
+    if (!dp->nupdev)
+    {
+        odp = findRemoteDvr(host, indi_port);
+        if (odp)
+        {
+            addUpDev(odp, dev);
+            if (!isDeviceInDriver(dev, odp))
+            {
+                odp->dev              = (char **)realloc(odp->dev, (odp->ndev + 1) * sizeof(char *));
+                odp->dev[odp->ndev++] = strdup(dev);
+            }
+
+            mp = newMsg();
+            snprintf(buf, sizeof(buf), "<getProperties device='%s' version='%g'/>\n", dev, INDIV);
+            setMsgStr(mp, buf);
+            pushDvrMsg(odp, mp, NULL);
+            if (odp->ublob != B_NEVER)
+                upBLOB(odp, dev);
+
+            dp->active = 0;
+            if (verbose > 0)
+                fprintf(stderr, "%s: Driver %s: sharing connection of %s\n", indi_tstamp(NULL), dp->name, odp->name);
+            return;
+        }
+        addUpDev(dp, dev);
+    }
+
+    /* connect, with a second fd for the reader thread if there is to be one */
     sockfd = openINDIServer(host, indi_port);
+    dp->rfd = dvrthreads ? dup(sockfd) : sockfd;
+    if (dp->rfd < 0)
+    {
+        fprintf(stderr, "%s: Driver %s: dup: %s\n", indi_tstamp(NULL), dp->name, strerror(errno));
+        close(sockfd);
+        Bye();
+    }
 
     /* record flag pid, io channels, init lp and snoop list */
     dp->pid = REMOTEDVR;
     strncpy(dp->host, host, MAXSBUF);
     dp->port    = indi_port;
-    dp->rfd     = sockfd;
     dp->wfd     = sockfd;
-    dp->lp      = newLilXML();
+    dp->gen     = ++dvrgen;
+    dp->lp      = dvrthreads ? NULL : newLilXML();
+    dp->rb      = dvrthreads ? NULL : newRawBLOB();
+    if (dp->lp)
+        useArenaLilXML(dp->lp, 1);
+    dp->fdq     = NULL;
     dp->msgq    = newFQ(1);
     dp->sprops  = (Property *)malloc(1); /* seed for realloc */
     dp->nsprops = 0;
+    dp->qsize   = 0;
     dp->nsent   = 0;
     dp->active  = 1;
-    dp->ndev    = 1;
-    dp->dev     = (char **)malloc(sizeof(char *));
+    dp->ublob   = B_NEVER;
+    dp->ndev    = dp->nupdev;
+    dp->dev     = (char **)malloc(dp->nupdev * sizeof(char *));
+
+    /* N.B. storing names now is key to limiting outbound traffic to these
+     * devs.
+     */
+    for (i = 0; i < dp->nupdev; i++)
+        dp->dev[i] = strdup(dp->updev[i]);
 
-    /* N.B. storing name now is key to limiting outbound traffic to this
-     * dev.
+    /* watch for traffic, rfd and wfd are the same socket unless the reader
+     * thread has its own copy
      */
-    dp->dev[0] = (char *)malloc(MAXINDIDEVICE * sizeof(char));
-    strncpy(dp->dev[0], dev, MAXINDIDEVICE - 1);
-    dp->dev[0][MAXINDIDEVICE - 1] = '\0';
+    if (dvrthreads)
+    {
+        startDvrReader(dp);
+        watchFd(dp->wfd, IO_DRIVER, dp - dvrinfo, 0);
+    }
+    else
+        watchFd(dp->rfd, IO_DRIVER, dp - dvrinfo, IO_RD);
 
     /* Sending getProperties with device lets remote server limit its
-     * outbound (and our inbound) traffic on this socket to this device.
+     * outbound (and our inbound) traffic on this socket to these devices.
      */
-    mp = newMsg();
-    pushFQ(dp->msgq, mp);
-    sprintf(buf, "<getProperties device='%s' version='%g'/>\n", dp->dev[0], INDIV);
-    setMsgStr(mp, buf);
-    mp->count++;
+    for (i = 0; i < dp->ndev; i++)
+    {
+        mp = newMsg();
+        snprintf(buf, sizeof(buf), "<getProperties device='%s' version='%g'/>\n", dp->dev[i], INDIV);
+        setMsgStr(mp, buf);
+        pushDvrMsg(dp, mp, NULL);
+    }
+
+    /* if restarting, ask for BLOBs again if still wanted */
+    upBLOBs();
 
     if (verbose > 0)
         fprintf(stderr, "%s: Driver %s: socket=%d\n", indi_tstamp(NULL), dp->name, sockfd);
 }
 
+/* return the active remote driver connected to host:port, else NULL */
+static DvrInfo *findRemoteDvr(const char *host, int port)
+{
+    DvrInfo *dp;
+
+    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+        if (dp->active && dp->pid == REMOTEDVR && dp->port == port && !strcmp(dp->host, host))
+            return (dp);
+    return (NULL);
+}
+
+/* add dev to the devices dp asks of its remote server, no dups */
+static void addUpDev(DvrInfo *dp, const char *dev)
+{
+    int i;
+
+    for (i = 0; i < dp->nupdev; i++)
+        if (!strcmp(dp->updev[i], dev))
+            return;
+    dp->updev               = (char **)realloc(dp->updev, (dp->nupdev + 1) * sizeof(char *));
+    dp->updev[dp->nupdev++] = strdup(dev);
+}
+
+/* stop the remote device given as dev@host:port. since there is no way to
+ * unsubscribe a device, the connection it shares is opened again for the
+ * devices that remain, if any.
+ */
+static void stopRemoteDvr(const char *name)
+{
+    char dev[MAXINDIDEVICE];
+    char host[MAXSBUF];
+    char **updev;
+    int indi_port, nupdev, i;
+    DvrInfo *dp;
+    XMLEle *root;
+    Msg *mp;
+
+    indi_port = INDIPORT;
+    if (sscanf(name, "%63[^@]@%511[^:]:%d", dev, host, &indi_port) < 2)
+    {
+        fprintf(stderr, "Bad remote device syntax: %s\n", name);
+        return;
+    }
+    dp = findRemoteDvr(host, indi_port);
+    if (!dp)
+        return;
+    for (i = 0; i < dp->nupdev; i++)
+        if (!strcmp(dp->updev[i], dev))
+            break;
+    if (i == dp->nupdev)
+        return;
+
+    if (verbose)
+        fprintf(stderr, "FIFO: Shutting down driver: %s\n", name);
+
+    /* Inform clients that this device is dead */
+    root = addXMLEle(NULL, "delProperty");
+    addXMLAtt(root, "device", dev);
+    mp = newMsg();
+    q2Clients(NULL, 0, dev, "", mp, root);
+    if (mp->count == 0)
+        freeMsg(mp);
+    delXMLEle(root);
+
+    /* forget dev and hold the others over the shutdown */
+    free(dp->updev[i]);
+    memmove(&dp->updev[i], &dp->updev[i + 1], (--dp->nupdev - i) * sizeof(char *));
+    updev      = dp->updev;
+    nupdev     = dp->nupdev;
+    dp->updev  = NULL;
+    dp->nupdev = 0;
+    shutdownDvr(dp, 0, SD_STOP);
+    if (!nupdev)
+    {
+        free(updev);
+        return;
+    }
+
+    dp->updev  = updev;
+    dp->nupdev = nupdev;
+    if (snprintf(dp->name, MAXINDINAME, "%s@%s:%d", updev[0], dp->host, dp->port) >= MAXINDINAME)
+    {
+        fprintf(stderr, "Remote device name too long: %s@%s:%d\n", updev[0], dp->host, dp->port);
+        Bye();
+    }
+    startRemoteDvr(dp);
+}
+
+/* tell each remote server whether we want BLOBs when that changes. the
+ * server keeps one mode for the whole connection so we do too: Also while any
+ * client or snooping driver wants BLOBs from any of its devices, else Never.
+ */
+static void upBLOBs(void)
+{
+    DvrInfo *dp;
+    BLOBHandling want;
+    int i;
+
+    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+    {
+        if (!dp->active || dp->pid != REMOTEDVR)
+            continue;
+        want = wantBLOBs(dp) ? B_ALSO : B_NEVER;
+        if (want == dp->ublob)
+            continue;
+        dp->ublob = want;
+        for (i = 0; i < dp->ndev; i++)
+            upBLOB(dp, dp->dev[i]);
+    }
+}
+
+/* queue enableBLOB for dev to the given remote driver per its ublob */
+static void upBLOB(DvrInfo *dp, const char *dev)
+{
+    char buf[MAXSBUF];
+    Msg *mp;
+
+    mp = newMsg();
+    snprintf(buf, sizeof(buf), "<enableBLOB device='%s'>%s</enableBLOB>\n", dev,
+             dp->ublob == B_NEVER ? "Never" : "Also");
+    setMsgStr(mp, buf);
+    pushDvrMsg(dp, mp, NULL);
+    if (verbose > 1)
+        fprintf(stderr, "%s: Driver %s: %s BLOBs from %s\n", indi_tstamp(NULL), dp->name,
+                dp->ublob == B_NEVER ? "no" : "asking for", dev);
+}
+
+/* return 1 if any client or other driver snooping wants BLOBs from any device
+ * of the given remote driver, else 0.
+ */
+static int wantBLOBs(DvrInfo *dp)
+{
+    ClInfo *cp;
+    DvrInfo *sdp;
+    int i;
+
+    for (cp = clinfo; cp < &clinfo[nclinfo]; cp++)
+    {
+        if (!cp->active)
+            continue;
+        if (cp->allprops && cp->blob != B_NEVER)
+            return (1);
+        for (i = 0; i < cp->nprops; i++)
+            if (cp->props[i].blob != B_NEVER && isDeviceInDriver(cp->props[i].dev, dp))
+                return (1);
+    }
+
+    for (sdp = dvrinfo; sdp < &dvrinfo[ndvrinfo]; sdp++)
+    {
+        if (!sdp->active || sdp == dp)
+            continue;
+        for (i = 0; i < sdp->nsprops; i++)
+            if (sdp->sprops[i].blob != B_NEVER && isDeviceInDriver(sdp->sprops[i].dev, dp))
+                return (1);
+    }
+
+    return (0);
+}
+
 /* open a connection to the given host and port or die.
  * return socket fd.
  */
@@ -705,9 +1379,20 @@ static int openINDIServer(char host[], int indi_port)
 }
 
 /* create the public INDI Driver endpoint lsocket on port.
- * return server socket else exit.
+ * exit if trouble.
  */
 static void indiListen()
+{
+    lsocket = openListen(port);
+    watchFd(lsocket, IO_LISTEN, 0, IO_RD);
+    if (verbose > 0)
+        fprintf(stderr, "%s: listening to port %d on fd %d\n", indi_tstamp(NULL), port, lsocket);
+}
+
+/* open a socket listening on lport.
+ * return server socket else exit.
+ */
+static int openListen(int lport)
 {
     struct sockaddr_in serv_socket;
     int sfd;
@@ -728,7 +1413,7 @@ static void indiListen()
 #else
     serv_socket.sin_addr.s_addr = htonl(INADDR_ANY);
 #endif
-    serv_socket.sin_port = htons((unsigned short)port);
+    serv_socket.sin_port = htons((unsigned short)lport);
     if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
     {
         fprintf(stderr, "%s: setsockopt: %s\n", indi_tstamp(NULL), strerror(errno));
@@ -748,14 +1433,13 @@ static void indiListen()
     }
 
     /* ok */
-    lsocket = sfd;
-    if (verbose > 0)
-        fprintf(stderr, "%s: listening to port %d on fd %d\n", indi_tstamp(NULL), port, sfd);
+    return (sfd);
 }
 
 /* Attempt to open up FIFO */
 static void indiFIFO(void)
 {
+    unwatchFd(fifo.fd);
     close(fifo.fd);
     fifo.fd = -1;
 
@@ -769,140 +1453,313 @@ static void indiFIFO(void)
             fprintf(stderr, "%s: open(%s): %s.\n", indi_tstamp(NULL), fifo.name, strerror(errno));
             Bye();
         }
+
+        watchFd(fifo.fd, IO_FIFO, 0, IO_RD);
     }
 }
 
-/* service traffic from clients and drivers */
-static void indiRun(void)
+/* prepare the fd watch table and the epoll instance, if available.
+ * exit if trouble.
+ */
+static void initIO(void)
 {
-    fd_set rs, ws;
-    int maxfd = 0;
-    int i, s;
-
-    /* init with no writers or readers */
-    FD_ZERO(&ws);
-    FD_ZERO(&rs);
+    iowatch  = (IOWatch *)malloc(1); /* seed for realloc */
+    niowatch = 0;
 
-    if (fifo.name && fifo.fd >= 0)
+#ifdef HAVE_SYS_EPOLL_H
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
     {
-        FD_SET(fifo.fd, &rs);
-        maxfd = fifo.fd;
+        fprintf(stderr, "%s: epoll_create1: %s\n", indi_tstamp(NULL), strerror(errno));
+        Bye();
     }
+#endif
+}
 
-    /* always listen for new clients */
-    FD_SET(lsocket, &rs);
-    if (lsocket > maxfd)
-        maxfd = lsocket;
+/* prepare dvrevq for use by driver reader threads.
+ * exit if trouble.
+ */
+static void initDvrEvents(void)
+{
+    int p[2];
 
-    /* add all client readers and client writers with work to send */
-    for (i = 0; i < nclinfo; i++)
+    if (pipe(p) < 0)
     {
-        ClInfo *cp = &clinfo[i];
-        if (cp->active)
-        {
-            FD_SET(cp->s, &rs);
-            if (nFQ(cp->msgq) > 0)
-                FD_SET(cp->s, &ws);
-            if (cp->s > maxfd)
-                maxfd = cp->s;
-        }
+        fprintf(stderr, "%s: driver event pipe: %s\n", indi_tstamp(NULL), strerror(errno));
+        Bye();
     }
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+
+    dvrevq.rfd  = p[0];
+    dvrevq.wfd  = p[1];
+    dvrevq.head = &dvrevq.stub;
+    dvrevq.tail = &dvrevq.stub;
+    watchFd(dvrevq.rfd, IO_DVREVENT, 0, IO_RD);
+}
 
-    /* add all driver readers and driver writers with work to send */
-    for (i = 0; i < ndvrinfo; i++)
-    {
-        DvrInfo *dp = &dvrinfo[i];
-        if (dp->active)
-        {
-            FD_SET(dp->rfd, &rs);
-            if (dp->rfd > maxfd)
-                maxfd = dp->rfd;
-            if (dp->pid != REMOTEDVR)
-            {
-                FD_SET(dp->efd, &rs);
-                if (dp->efd > maxfd)
-                    maxfd = dp->efd;
-            }
-            if (nFQ(dp->msgq) > 0)
-            {
-                FD_SET(dp->wfd, &ws);
-                if (dp->wfd > maxfd)
-                    maxfd = dp->wfd;
-            }
-        }
-    }
+#ifdef HAVE_SYS_EPOLL_H
+/* apply op to the epoll registration of fd using the events now in iowatch[fd].
+ * exit if trouble.
+ */
+static void epollCtl(int fd, int op)
+{
+    struct epoll_event ev;
 
-    /* wait for action */
-    s = select(maxfd + 1, &rs, &ws, NULL, NULL);
-    if (s < 0)
+    memset(&ev, 0, sizeof(ev));
+    if (iowatch[fd].events & IO_RD)
+        ev.events |= EPOLLIN;
+    if (iowatch[fd].events & IO_WR)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, op, fd, &ev) < 0)
     {
-        if(errno==EINTR)
-            return;
-        fprintf(stderr, "%s: select(%d): %s\n", indi_tstamp(NULL), maxfd + 1, strerror(errno));
+        fprintf(stderr, "%s: epoll_ctl(%d): %s\n", indi_tstamp(NULL), fd, strerror(errno));
         Bye();
     }
+}
+#endif
 
-    /* new command from FIFO? */
-    if (s > 0 && fifo.fd >= 0 && FD_ISSET(fifo.fd, &rs))
-    {
-        newFIFO();
-        s--;
-    }
+/* start watching fd for events on behalf of the given kind of user.
+ * idx is the index of the user in clinfo[] or dvrinfo[], if any.
+ * watching an fd that is already watched just updates it.
+ */
+static void watchFd(int fd, IOKind kind, int idx, int events)
+{
+    IOWatch *wp;
+    int isnew;
 
-    /* new client? */
-    if (s > 0 && FD_ISSET(lsocket, &rs))
+#ifndef HAVE_SYS_EPOLL_H
+    if (fd >= FD_SETSIZE)
     {
-        newClient();
-        s--;
+        fprintf(stderr, "%s: fd %d exceeds FD_SETSIZE %d\n", indi_tstamp(NULL), fd, FD_SETSIZE);
+        Bye();
     }
+#endif
 
-    /* message to/from client? */
-    for (i = 0; s > 0 && i < nclinfo; i++)
+    /* grow table to include fd, new slots are not watched */
+    if (fd >= niowatch)
     {
-        ClInfo *cp = &clinfo[i];
-        if (cp->active)
+        iowatch = (IOWatch *)realloc(iowatch, (fd + 1) * sizeof(IOWatch));
+        if (!iowatch)
         {
-            if (FD_ISSET(cp->s, &rs))
-            {
-                if (readFromClient(cp) < 0)
-                    return; /* fds effected */
-                s--;
-            }
-            if (s > 0 && FD_ISSET(cp->s, &ws))
-            {
-                if (sendClientMsg(cp) < 0)
-                    return; /* fds effected */
-                s--;
-            }
+            fprintf(stderr, "no memory for fd %d\n", fd);
+            Bye();
         }
+        memset(&iowatch[niowatch], 0, (fd + 1 - niowatch) * sizeof(IOWatch));
+        niowatch = fd + 1;
     }
 
-    /* message to/from driver? */
-    for (i = 0; s > 0 && i < ndvrinfo; i++)
-    {
-        DvrInfo *dp = &dvrinfo[i];
-        if (dp->pid != REMOTEDVR && FD_ISSET(dp->efd, &rs))
-        {
-            if (stderrFromDriver(dp) < 0)
-                return; /* fds effected */
-            s--;
-        }
-        if (s > 0 && FD_ISSET(dp->rfd, &rs))
-        {
-            if (readFromDriver(dp) < 0)
-                return; /* fds effected */
-            s--;
-        }
-        if (s > 0 && FD_ISSET(dp->wfd, &ws) && nFQ(dp->msgq) > 0)
-        {
-            if (sendDriverMsg(dp) < 0)
-                return; /* fds effected */
-            s--;
-        }
-    }
+    wp         = &iowatch[fd];
+    isnew      = (wp->kind == IO_NONE);
+    wp->kind   = kind;
+    wp->idx    = idx;
+    wp->events = events;
+
+#ifdef HAVE_SYS_EPOLL_H
+    epollCtl(fd, isnew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+#else
+    INDI_UNUSED(isnew);
+#endif
 }
 
-int isDeviceInDriver(const char *dev, DvrInfo *dp)
+/* turn interest in writing to fd on or off */
+static void watchWrite(int fd, int on)
+{
+    IOWatch *wp;
+    int events;
+
+    if (fd < 0 || fd >= niowatch || iowatch[fd].kind == IO_NONE)
+        return;
+
+    wp     = &iowatch[fd];
+    events = on ? (wp->events | IO_WR) : (wp->events & ~IO_WR);
+    if (events == wp->events)
+        return;
+    wp->events = events;
+
+#ifdef HAVE_SYS_EPOLL_H
+    epollCtl(fd, EPOLL_CTL_MOD);
+#endif
+}
+
+/* stop watching fd.
+ * N.B. call before closing fd.
+ */
+static void unwatchFd(int fd)
+{
+    if (fd < 0 || fd >= niowatch || iowatch[fd].kind == IO_NONE)
+        return;
+
+#ifdef HAVE_SYS_EPOLL_H
+    (void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    memset(&iowatch[fd], 0, sizeof(IOWatch));
+}
+
+/* handle the IO_RD and/or IO_WR events found ready on fd.
+ * return -1 if had to shut down anything, else 0.
+ */
+static int serviceFd(int fd, int events)
+{
+    IOWatch *wp = &iowatch[fd];
+    ClInfo *cp;
+    DvrInfo *dp;
+
+    switch (wp->kind)
+    {
+        case IO_FIFO:
+            /* new command from FIFO, may start or stop drivers */
+            newFIFO();
+            return (-1);
+
+        case IO_LISTEN:
+            /* new client */
+            newClient();
+            break;
+
+        case IO_CLIENT:
+            /* message to/from client */
+            cp = &clinfo[wp->idx];
+            if ((events & IO_RD) && readFromClient(cp) < 0)
+                return (-1); /* fds effected */
+            if ((events & IO_WR) && nClMsgs(cp) > 0)
+                return (sendClientMsg(cp));
+            break;
+
+        case IO_DRIVER:
+            /* message to/from driver */
+            dp = &dvrinfo[wp->idx];
+            if (events & IO_RD)
+            {
+                if (fd != dp->rfd)
+                {
+                    /* we only read rfd so this is a hangup on the write side */
+                    fprintf(stderr, "%s: Driver %s: write hangup\n", indi_tstamp(NULL), dp->name);
+                    shutdownDvr(dp, 1, SD_WRITE);
+                    return (-1);
+                }
+                if (readFromDriver(dp) < 0)
+                    return (-1); /* fds effected */
+            }
+            if ((events & IO_WR) && nFQ(dp->msgq) > 0)
+                return (sendDriverMsg(dp));
+            break;
+
+        case IO_DRVERR:
+            /* message from driver stderr */
+            dp = &dvrinfo[wp->idx];
+            if (stderrFromDriver(dp) < 0)
+                return (-1); /* fds effected */
+            break;
+
+        case IO_DVREVENT:
+            /* messages from driver reader threads */
+            return (readDvrEvents());
+
+        case IO_MLISTEN:
+            /* new metrics request */
+            newMetricsClient();
+            break;
+
+        case IO_METRICS:
+            /* metrics request and its answer */
+            if ((events & IO_RD) && readMetrics(&mclinfo[wp->idx]) < 0)
+                break;
+            if (events & IO_WR)
+                sendMetrics(&mclinfo[wp->idx]);
+            break;
+
+        case IO_NONE:
+            break;
+    }
+
+    return (0);
+}
+
+/* service traffic from clients and drivers */
+static void indiRun(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev[MAXEVENTS];
+    int i, n;
+
+    /* wait for action */
+    n = epoll_wait(epfd, ev, MAXEVENTS, -1);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return;
+        fprintf(stderr, "%s: epoll_wait: %s\n", indi_tstamp(NULL), strerror(errno));
+        Bye();
+    }
+
+    /* service each ready fd, hangups and errors are discovered by reading.
+     * stop if any fds were closed, the rest are still ready next time.
+     */
+    for (i = 0; i < n; i++)
+    {
+        int events = 0;
+
+        if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            events |= IO_RD;
+        if (ev[i].events & EPOLLOUT)
+            events |= IO_WR;
+        if (serviceFd(ev[i].data.fd, events) < 0)
+            return; /* fds effected */
+    }
+#else
+    fd_set rs, ws;
+    int maxfd = -1;
+    int fd, s;
+
+    /* build sets from the watch table */
+    FD_ZERO(&ws);
+    FD_ZERO(&rs);
+    for (fd = 0; fd < niowatch; fd++)
+    {
+        if (iowatch[fd].events & IO_RD)
+            FD_SET(fd, &rs);
+        if (iowatch[fd].events & IO_WR)
+            FD_SET(fd, &ws);
+        if (iowatch[fd].events)
+            maxfd = fd;
+    }
+
+    /* wait for action */
+    s = select(maxfd + 1, &rs, &ws, NULL, NULL);
+    if (s < 0)
+    {
+        if (errno == EINTR)
+            return;
+        fprintf(stderr, "%s: select(%d): %s\n", indi_tstamp(NULL), maxfd + 1, strerror(errno));
+        Bye();
+    }
+
+    /* service each ready fd, stop if any fds were closed */
+    for (fd = 0; s > 0 && fd <= maxfd; fd++)
+    {
+        int events = 0;
+
+        if (FD_ISSET(fd, &rs))
+        {
+            events |= IO_RD;
+            s--;
+        }
+        if (FD_ISSET(fd, &ws))
+        {
+            events |= IO_WR;
+            s--;
+        }
+        if (events && serviceFd(fd, events) < 0)
+            return; /* fds effected */
+    }
+#endif
+}
+
+int isDeviceInDriver(const char *dev, DvrInfo *dp)
 {
     int i = 0;
     for (i = 0; i < dp->ndev; i++)
@@ -959,7 +1816,7 @@ static void newFIFO(void)
         // If remote driver
         if (strstr(line, "@"))
         {
-            n = sscanf(line, "%s %512[^\n]", cmd, tDriver);
+            n = sscanf(line, "%511s %511[^\n]", cmd, tDriver);
 
             // Remove quotes if any
             char *ptr = tDriver;
@@ -976,7 +1833,7 @@ static void newFIFO(void)
         // If local driver
         else
         {
-            n = sscanf(line, "%s %s -%1c \"%512[^\"]\" -%1c \"%512[^\"]\" -%1c \"%512[^\"]\" -%1c \"%512[^\"]\"", cmd,
+            n = sscanf(line, "%511s %511s -%1c \"%511[^\"]\" -%1c \"%511[^\"]\" -%1c \"%511[^\"]\" -%1c \"%511[^\"]\"", cmd,
                        tDriver, arg[0], var[0], arg[1], var[1], arg[2], var[2], arg[3], var[3]);
             remoteDriver = 0;
         }
@@ -1047,6 +1904,8 @@ static void newFIFO(void)
             else
                 startRemoteDvr(dp);
         }
+        else if (remoteDriver)
+            stopRemoteDvr(tDriver);
         else
         {
             for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
@@ -1072,15 +1931,13 @@ static void newFIFO(void)
                         prXMLEle(stderr, root, 0);
                         Msg *mp = newMsg();
 
-                        q2Clients(NULL, 0, dp->dev[i], NULL, mp, root);
-                        if (mp->count > 0)
-                            setMsgXMLEle(mp, root);
-                        else
+                        q2Clients(NULL, 0, dp->dev[i], "", mp, root);
+                        if (mp->count == 0)
                             freeMsg(mp);
                         delXMLEle(root);
                     }
 
-                    shutdownDvr(dp, 0);
+                    shutdownDvr(dp, 0, SD_STOP);
                     break;
                 }
             }
@@ -1094,7 +1951,7 @@ static void newFIFO(void)
 static void newClient()
 {
     ClInfo *cp = NULL;
-    int s, cli;
+    int s, cli, i;
 
     /* assign new socket */
     s = newClSocket();
@@ -1106,8 +1963,9 @@ static void newClient()
     if (cli == nclinfo)
     {
         /* grow clinfo */
-        clinfo = (ClInfo *)realloc(clinfo, (nclinfo + 1) * sizeof(ClInfo));
-        if (!clinfo)
+        clinfo  = (ClInfo *)realloc(clinfo, (nclinfo + 1) * sizeof(ClInfo));
+        routecl = (RouteCl *)realloc(routecl, (nclinfo + 1) * sizeof(RouteCl));
+        if (!clinfo || !routecl)
         {
             fprintf(stderr, "no memory for new client\n");
             Bye();
@@ -1122,10 +1980,18 @@ static void newClient()
     memset(cp, 0, sizeof(*cp));
     cp->active = 1;
     cp->s      = s;
+    cp->seq    = ++clseq;
     cp->lp     = newLilXML();
-    cp->msgq   = newFQ(1);
+    useArenaLilXML(cp->lp, 1);
     cp->props  = malloc(1);
+    cp->curq   = MQ_CTRL;
     cp->nsent  = 0;
+    for (i = 0; i < NMQ; i++)
+    {
+        cp->msgq[i]  = newFQ(1);
+        cp->qsize[i] = 0;
+    }
+    watchFd(s, IO_CLIENT, cli, IO_RD);
 
     if (verbose > 0)
     {
@@ -1163,9 +2029,10 @@ static int readFromClient(ClInfo *cp)
             fprintf(stderr, "%s: Client %d: read: %s\n", indi_tstamp(NULL), cp->s, strerror(errno));
         else if (verbose > 0)
             fprintf(stderr, "%s: Client %d: read EOF\n", indi_tstamp(NULL), cp->s);
-        shutdownClient(cp);
+        shutdownClient(cp, SD_READ);
         return (-1);
     }
+    cp->tr.nrbytes += nr;
 
     /* process XML, sending when find closure */
     for (i = 0; i < nr; i++)
@@ -1178,8 +2045,10 @@ static int readFromClient(ClInfo *cp)
             const char *dev  = findXMLAttValu(root, "device");
             const char *name = findXMLAttValu(root, "name");
             int isblob       = !strcmp(tagXMLEle(root), "setBLOBVector");
+            int pcans;
             Msg *mp;
 
+            cp->tr.nrmsgs++;
             if (verbose > 2)
             {
                 fprintf(stderr, "%s: Client %d: read ", indi_tstamp(NULL), cp->s);
@@ -1191,6 +2060,13 @@ static int readFromClient(ClInfo *cp)
                         tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
             }
 
+            /* note clients that take binary BLOBs, drivers need not know */
+            if (!strcmp(roottag, "getProperties") && !strcmp(findXMLAttValu(root, "blobs"), BINBLOBS))
+            {
+                cp->binblobs = 1;
+                rmXMLAtt(root, "blobs");
+            }
+
             /* snag interested properties.
          * N.B. don't open to alldevs if seen specific dev already, else
          *   remote client connections start returning too much.
@@ -1200,15 +2076,32 @@ static int readFromClient(ClInfo *cp)
             else if (!strcmp(roottag, "getProperties") && !cp->nprops)
                 cp->allprops = 1;
 
-            /* snag enableBLOB -- send to remote drivers too */
+            /* snag enableBLOB -- remote drivers are told by upBLOBs() */
             if (!strcmp(roottag, "enableBLOB"))
                 crackBLOBHandling(dev, name, pcdataXMLEle(root), cp);
 
-            /* build a new message -- set content iff anyone cares */
+            /* build a new message -- content is set iff anyone cares */
             mp = newMsg();
 
-            /* send message to driver(s) responsible for dev */
-            q2RDrivers(dev, mp, root);
+            /* send message to driver(s) responsible for dev, unless answered
+             * from the cache
+             */
+            pcans = (propcache && !strcmp(roottag, "getProperties")) ? answerPCache(cp, dev, name, mp, root) : 0;
+            if (pcans < 0)
+            {
+                if (mp->count == 0)
+                    freeMsg(mp);
+                delXMLEle(root);
+                return (-1);
+            }
+            if (pcans > 0)
+                pchits++;
+            else if (strcmp(roottag, "enableBLOB"))
+                q2RDrivers(dev, mp, root);
+
+            /* either may change whether remote drivers need send BLOBs */
+            if (!strcmp(roottag, "enableBLOB") || !strcmp(roottag, "getProperties"))
+                upBLOBs();
 
             /* JM 2016-05-18: Upstream client can be a chained INDI server. If any driver locally is snooping
          * on any remote drivers, we should catch it and forward it to the responsible snooping driver. */
@@ -1224,10 +2117,8 @@ static int readFromClient(ClInfo *cp)
                     shutany++;
             }
 
-            /* set message content if anyone cares else forget it */
-            if (mp->count > 0)
-                setMsgXMLEle(mp, root);
-            else
+            /* content was set when first queued, forget it if no one cares */
+            if (mp->count == 0)
                 freeMsg(mp);
             delXMLEle(root);
         }
@@ -1236,7 +2127,7 @@ static int readFromClient(ClInfo *cp)
             char *ts = indi_tstamp(NULL);
             fprintf(stderr, "%s: Client %d: XML error: %s\n", ts, cp->s, err);
             fprintf(stderr, "%s: Client %d: XML read: %.*s\n", ts, cp->s, (int)nr, buf);
-            shutdownClient(cp);
+            shutdownClient(cp, SD_XML);
             return (-1);
         }
     }
@@ -1254,12 +2145,21 @@ static int readFromDriver(DvrInfo *dp)
     int shutany = 0;
     ssize_t nr;
     char err[1024];
-    XMLEle **nodes;
-    XMLEle *root;
-    int inode = 0;
+    DvrMsg *msgs;
+    unsigned long long t0;
+    size_t n;
+    char *rd;
+    int i;
 
     /* read driver */
-    nr = read(dp->rfd, buf, sizeof(buf));
+    rd = dvrReadBuf(dp->rb, buf, &n);
+    if (!rd)
+    {
+        fprintf(stderr, "%s: Driver %s: no memory for BLOB\n", indi_tstamp(NULL), dp->name);
+        shutdownDvr(dp, 1, SD_READ);
+        return (-1);
+    }
+    nr = readDvr(dp->rfd, rd, n, dp->fdq);
     if (nr <= 0)
     {
         if (nr < 0)
@@ -1267,186 +2167,976 @@ static int readFromDriver(DvrInfo *dp)
         else
             fprintf(stderr, "%s: Driver %s: stdin EOF\n", indi_tstamp(NULL), dp->name);
 
-        shutdownDvr(dp, 1);
+        shutdownDvr(dp, 1, SD_READ);
         return (-1);
     }
+    dp->tr.nrbytes += nr;
 
     /* process XML chunk */
-    nodes = parseXMLChunk(dp->lp, buf, nr, err);
+    t0   = metricsClock();
+    msgs = parseDvrChunk(dp->lp, dp->rb, rd, nr, err);
+    noteParseTime(t0);
 
-    if (!nodes)
+    if (!msgs)
     {
-        if (err[0])
-        {
-            char *ts = indi_tstamp(NULL);
-            fprintf(stderr, "%s: Driver %s: XML error: %s\n", ts, dp->name, err);
+        char *ts = indi_tstamp(NULL);
+        fprintf(stderr, "%s: Driver %s: XML error: %s\n", ts, dp->name, err);
+        if (rd == buf)
             fprintf(stderr, "%s: Driver %s: XML read: %.*s\n", ts, dp->name, (int)nr, buf);
-            shutdownDvr(dp, 1);
-            return (-1);
-        }
-        return -1;
+        shutdownDvr(dp, 1, SD_XML);
+        return (-1);
     }
 
-    root = nodes[inode];
-    while (root)
+    for (i = 0; msgs[i].root; i++)
     {
-        char *roottag    = tagXMLEle(root);
-        const char *dev  = findXMLAttValu(root, "device");
-        const char *name = findXMLAttValu(root, "name");
-        int isblob       = !strcmp(tagXMLEle(root), "setBLOBVector");
-        Msg *mp;
-
-        if (verbose > 2)
-        {
-            fprintf(stderr, "%s: Driver %s: read ", indi_tstamp(0), dp->name);
-            traceMsg(root);
-        }
-        else if (verbose > 1)
+        if (dp->fdq && mapShmBLOBs(msgs[i].root, &msgs[i].mp, dp->fdq, err) < 0)
         {
-            fprintf(stderr, "%s: Driver %s: read <%s device='%s' name='%s'>\n", indi_tstamp(NULL), dp->name,
-                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+            fprintf(stderr, "%s: Driver %s: %s\n", indi_tstamp(NULL), dp->name, err);
+            delXMLEle(msgs[i].root);
+            if (msgs[i].mp)
+                freeMsg(msgs[i].mp);
+            continue;
         }
+        if (routeDvrMsg(dp, msgs[i].root, msgs[i].mp) < 0)
+            shutany++;
+    }
 
-        /* that's all if driver is just registering a snoop */
-        /* JM 2016-05-18: Send getProperties to upstream chained servers as well.*/
-        if (!strcmp(roottag, "getProperties"))
-        {
-            addSDevice(dp, dev, name);
-            mp = newMsg();
-            /* send to interested chained servers upstream */
-            if (q2Servers(dp, mp, root) < 0)
-                shutany++;
-            /* Send to snooped drivers if they exist so that they can echo back the snooped propertly immediately */
-            q2RDrivers(dev, mp, root);
+    free(msgs);
 
-            if (mp->count > 0)
-                setMsgXMLEle(mp, root);
-            else
-                freeMsg(mp);
-            delXMLEle(root);
-            inode++;
-            root = nodes[inode];
-            continue;
-        }
+    return (shutany ? -1 : 0);
+}
+
+/* route one complete message root read from driver dp to each interested
+ * client and driver. if mp is not NULL it already holds root as content.
+ * root is deleted and mp forgotten if no one cares.
+ * return 0 if ok else -1 if had to shut down anything.
+ */
+static int routeDvrMsg(DvrInfo *dp, XMLEle *root, Msg *mp)
+{
+    char *roottag    = tagXMLEle(root);
+    const char *dev  = findXMLAttValu(root, "device");
+    const char *name = findXMLAttValu(root, "name");
+    int isblob       = !strcmp(tagXMLEle(root), "setBLOBVector");
+    int shutany      = 0;
+
+    dp->tr.nrmsgs++;
+    if (verbose > 2)
+    {
+        fprintf(stderr, "%s: Driver %s: read ", indi_tstamp(0), dp->name);
+        traceMsg(root);
+    }
+    else if (verbose > 1)
+    {
+        fprintf(stderr, "%s: Driver %s: read <%s device='%s' name='%s'>\n", indi_tstamp(NULL), dp->name,
+                tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+    }
+
+    /* build a new message -- content is set iff anyone cares */
+    if (!mp)
+        mp = newMsg();
 
-        /* that's all if driver desires to snoop BLOBs from other drivers */
-        if (!strcmp(roottag, "enableBLOB"))
+    /* that's all if driver is just registering a snoop */
+    /* JM 2016-05-18: Send getProperties to upstream chained servers as well.*/
+    if (!strcmp(roottag, "getProperties"))
+    {
+        addSDevice(dp, dev, name);
+        /* send to interested chained servers upstream */
+        if (q2Servers(dp, mp, root) < 0)
+            shutany++;
+        /* Send to snooped drivers if they exist so that they can echo back the snooped propertly immediately */
+        q2RDrivers(dev, mp, root);
+
+        if (mp->count == 0)
+            freeMsg(mp);
+        delXMLEle(root);
+        return (shutany ? -1 : 0);
+    }
+
+    /* that's all if driver desires to snoop BLOBs from other drivers */
+    if (!strcmp(roottag, "enableBLOB"))
+    {
+        Property *sp = findSDevice(dp, dev, name);
+        if (sp)
         {
-            Property *sp = findSDevice(dp, dev, name);
-            if (sp)
-                crackBLOB(pcdataXMLEle(root), &sp->blob);
-            delXMLEle(root);
-            inode++;
-            root = nodes[inode];
-            continue;
+            crackBLOB(pcdataXMLEle(root), &sp->blob);
+            upBLOBs();
         }
+        freeMsg(mp);
+        delXMLEle(root);
+        return (0);
+    }
 
-        /* Found a new device? Let's add it to driver info */
-        if (dev[0] && isDeviceInDriver(dev, dp) == 0)
-        {
-            dp->dev           = (char **)realloc(dp->dev, (dp->ndev + 1) * sizeof(char *));
-            dp->dev[dp->ndev] = (char *)malloc(MAXINDIDEVICE * sizeof(char));
+    /* Found a new device? Let's add it to driver info */
+    if (dev[0] && isDeviceInDriver(dev, dp) == 0)
+    {
+        dp->dev           = (char **)realloc(dp->dev, (dp->ndev + 1) * sizeof(char *));
+        dp->dev[dp->ndev] = (char *)malloc(MAXINDIDEVICE * sizeof(char));
 
-            strncpy(dp->dev[dp->ndev], dev, MAXINDIDEVICE - 1);
-            dp->dev[dp->ndev][MAXINDIDEVICE - 1] = '\0';
+        strncpy(dp->dev[dp->ndev], dev, MAXINDIDEVICE - 1);
+        dp->dev[dp->ndev][MAXINDIDEVICE - 1] = '\0';
 
 #ifdef OSX_EMBEDED_MODE
-            if (!dp->ndev)
-                fprintf(stderr, "STARTED \"%s\"\n", dp->name);
-            fflush(stderr);
+        if (!dp->ndev)
+            fprintf(stderr, "STARTED \"%s\"\n", dp->name);
+        fflush(stderr);
 #endif
 
-            dp->ndev++;
-        }
-
-        /* log messages if any and wanted */
-        if (ldir)
-            logDMsg(root, dev);
+        dp->ndev++;
+    }
 
-        /* build a new message -- set content iff anyone cares */
-        mp = newMsg();
+    /* log messages if any and wanted */
+    if (ldir)
+        logDMsg(root, dev);
 
-        /* send to interested clients */
-        if (q2Clients(NULL, isblob, dev, name, mp, root) < 0)
-            shutany++;
+    /* note latest values */
+    if (propcache)
+        cacheDvrMsg(dp, root);
 
-        /* send to snooping drivers */
-        q2SDrivers(dp, isblob, dev, name, mp, root);
+    /* send to interested clients */
+    if (q2Clients(NULL, isblob, dev, name, mp, root) < 0)
+        shutany++;
 
-        /* set message content if anyone cares else forget it */
-        if (mp->count > 0)
-            setMsgXMLEle(mp, root);
-        else
-            freeMsg(mp);
-        delXMLEle(root);
-        inode++;
-        root = nodes[inode];
-    }
+    /* send to snooping drivers */
+    q2SDrivers(dp, isblob, dev, name, mp, root);
 
-    free(nodes);
+    /* content was set when first queued, forget it if no one cares.
+     * shared BLOBs are no longer needed either way.
+     */
+    if (mp->count == 0)
+        freeMsg(mp);
+    else
+        unmapShmBLOBs(mp);
+    delXMLEle(root);
 
     return (shutany ? -1 : 0);
 }
 
-/* read more from the given driver stderr, add prefix and send to our stderr.
- * return 0 if ok else -1 if had to restart.
+/* split the next nr bytes read from a driver into complete messages.
+ * setBLOBVector messages are collected raw in rb and returned with a Msg that
+ * already holds them as content and a root of just their elements and
+ * attributes. all else is parsed with lp as usual and returned without a Msg.
+ * N.B. we assume BLOBTAG only appears in the input at the start of a message,
+ *   which holds because '<' can not appear unescaped in pcdata or attributes.
+ * return malloced array terminated with a NULL root, else NULL with reason
+ *   in err[], including if no memory.
  */
-static int stderrFromDriver(DvrInfo *dp)
+static DvrMsg *parseDvrChunk(LilXML *lp, RawBLOB *rb, char *buf, int nr, char err[])
 {
-    static char exbuf[MAXRBUF];
-    static int nexbuf;
-    ssize_t i, nr;
+    DvrMsg *msgs = (DvrMsg *)malloc(sizeof(DvrMsg));
+    int nmsgs    = 0;
+    char *tmp    = NULL;
+    int inplace  = rb->inblob && buf == rb->buf + rb->len; /* see dvrReadBuf() */
+    char *p, *end;
+
+    err[0] = '\0';
+    if (!msgs)
+    {
+        strcpy(err, "no memory for messages");
+        return (NULL);
+    }
+    msgs[0].root = NULL;
 
-    /* read more */
-    nr = read(dp->efd, exbuf + nexbuf, sizeof(exbuf) - nexbuf);
-    if (nr <= 0)
+    /* resume with any bytes held back last time */
+    if (rb->nhold > 0)
     {
-        if (nr < 0)
-            fprintf(stderr, "%s: Driver %s: stderr %s\n", indi_tstamp(NULL), dp->name, strerror(errno));
+        tmp = (char *)malloc(rb->nhold + nr);
+        if (!tmp)
+        {
+            strcpy(err, "no memory for messages");
+            nmsgs = -1;
+        }
         else
-            fprintf(stderr, "%s: Driver %s: stderr EOF\n", indi_tstamp(NULL), dp->name);
-        shutdownDvr(dp, 1);
-        return (-1);
+        {
+            memcpy(tmp, rb->hold, rb->nhold);
+            memcpy(tmp + rb->nhold, buf, nr);
+            buf = tmp;
+            nr += rb->nhold;
+            rb->nhold = 0;
+        }
     }
-    nexbuf += nr;
 
-    /* prefix each whole line to our stderr, save extra for next time */
-    for (i = 0; i < nexbuf; i++)
+    for (p = buf, end = buf + nr; p < end && nmsgs >= 0;)
     {
-        if (exbuf[i] == '\n')
+        if (rb->inblob)
+        {
+            /* append to raw message, checking just the new bytes for BLOBETAG */
+            size_t n    = end - p;
+            size_t from = rb->len > sizeof(BLOBETAG) ? rb->len - sizeof(BLOBETAG) : 0;
+            const char *etag;
+
+            if (!inplace)
+            {
+                if (rb->len + n + 2 > rb->size)
+                {
+                    size_t newsize = rb->size * 2 > rb->len + n + 2 ? rb->size * 2 : rb->len + n + 2;
+                    char *newbuf   = (char *)realloc(rb->buf, newsize);
+
+                    if (!newbuf)
+                    {
+                        strcpy(err, "no memory for BLOB");
+                        nmsgs = -1;
+                        break;
+                    }
+                    rb->buf  = newbuf;
+                    rb->size = newsize;
+                }
+                memcpy(rb->buf + rb->len, p, n);
+            }
+            rb->len += n;
+            p = end;
+
+            etag = findStr(rb->buf + from, rb->len - from, BLOBETAG);
+            if (etag)
+            {
+                /* message is complete, anything beyond it starts over.
+                 * if read in place that must move out of the way first.
+                 */
+                size_t len = etag + sizeof(BLOBETAG) - 1 - rb->buf;
+                p          = end - (rb->len - len);
+                if (inplace && p < end)
+                {
+                    tmp = (char *)malloc(end - p);
+                    if (!tmp)
+                    {
+                        strcpy(err, "no memory for messages");
+                        nmsgs = -1;
+                        break;
+                    }
+                    memcpy(tmp, p, end - p);
+                    end = tmp + (end - p);
+                    p   = tmp;
+                }
+                inplace = 0;
+                rb->len = len;
+                nmsgs   = passRawBLOB(rb, &msgs, nmsgs, err);
+            }
+        }
+        else
+        {
+            /* parse up to the next BLOBTAG, holding back a tail that may be
+             * the start of one.
+             */
+            const char *tag = findStr(p, end - p, BLOBTAG);
+            int n           = tag ? tag - p : (end - p) - heldBLOBTag(p, end - p);
+
+            if (n > 0)
+            {
+                XMLEle **nodes = parseXMLChunk(lp, p, n, err);
+                if (!nodes)
+                {
+                    nmsgs = -1;
+                    break;
+                }
+                nmsgs = addDvrMsgs(&msgs, nmsgs, nodes);
+                free(nodes);
+                p += n;
+            }
+
+            if (tag)
+            {
+                rb->inblob = 1;
+                rb->len    = 0;
+            }
+            else
+            {
+                rb->nhold = end - p;
+                memcpy(rb->hold, p, rb->nhold);
+                p = end;
+            }
+        }
+    }
+
+    free(tmp);
+
+    if (nmsgs < 0)
+    {
+        int i;
+        for (i = 0; msgs[i].root; i++)
         {
-            fprintf(stderr, "%s: Driver %s: %.*s\n", indi_tstamp(NULL), dp->name, (int)i, exbuf);
-            i++;                               /* count including nl */
-            nexbuf -= i;                       /* remove from nexbuf */
-            memmove(exbuf, exbuf + i, nexbuf); /* slide remaining to front */
-            i = -1;                            /* restart for loop scan */
+            delXMLEle(msgs[i].root);
+            if (msgs[i].mp)
+                freeMsg(msgs[i].mp);
         }
+        free(msgs);
+        return (NULL);
     }
 
-    return (0);
+    return (msgs);
 }
 
-/* close down the given client */
-static void shutdownClient(ClInfo *cp)
+/* append each of the NULL-terminated nodes to *msgs, which has nmsgs.
+ * return new count.
+ */
+static int addDvrMsgs(DvrMsg **msgs, int nmsgs, XMLEle **nodes)
 {
-    Msg *mp;
+    int i;
 
-    /* close connection */
-    shutdown(cp->s, SHUT_RDWR);
-    close(cp->s);
+    for (i = 0; nodes[i]; i++)
+    {
+        *msgs               = (DvrMsg *)realloc(*msgs, (nmsgs + 2) * sizeof(DvrMsg));
+        (*msgs)[nmsgs].root = nodes[i];
+        (*msgs)[nmsgs++].mp = NULL;
+    }
+    (*msgs)[nmsgs].root = NULL;
 
-    /* free memory */
-    delLilXML(cp->lp);
-    free(cp->props);
+    return (nmsgs);
+}
 
-    /* decrement and possibly free any unsent messages for this client */
-    while ((mp = (Msg *)popFQ(cp->msgq)) != NULL)
-        if (--mp->count == 0)
-            freeMsg(mp);
-    delFQ(cp->msgq);
+/* append the complete raw setBLOBVector in rb to *msgs, which has nmsgs.
+ * the Msg takes over rb->buf and rb is reset for the next message.
+ * return new count, else -1 with reason in err[].
+ */
+static int passRawBLOB(RawBLOB *rb, DvrMsg **msgs, int nmsgs, char err[])
+{
+    XMLEle *root = parseBLOBHeader(rb->buf, rb->len, err);
+    Msg *mp;
 
-    /* ok now to recycle */
-    cp->active = 0;
+    rb->inblob = 0;
+    if (!root)
+    {
+        (*msgs)[nmsgs].root = NULL;
+        return (-1);
+    }
+
+    /* end with a newline like setMsgXMLEle() */
+    mp                 = newMsg();
+    rb->buf[rb->len++] = '\n';
+    rb->buf[rb->len]   = '\0';
+    mp->cp             = rb->buf;
+    mp->cl             = rb->len;
+    rb->buf            = NULL;
+    rb->len            = 0;
+    rb->size           = 0;
+
+    *msgs               = (DvrMsg *)realloc(*msgs, (nmsgs + 2) * sizeof(DvrMsg));
+    (*msgs)[nmsgs].root = root;
+    (*msgs)[nmsgs++].mp = mp;
+    (*msgs)[nmsgs].root = NULL;
+
+    return (nmsgs);
+}
+
+/* parse the raw setBLOBVector in buf[len] skipping the pcdata of each
+ * oneBLOB, which is all that is large. the result has all elements and
+ * attributes but empty oneBLOBs.
+ * return root, else NULL with reason in err[].
+ */
+static XMLEle *parseBLOBHeader(const char *buf, size_t len, char err[])
+{
+    LilXML *lp   = newLilXML();
+    XMLEle *root = NULL;
+    size_t tag   = 0; /* index of '<' that began the current tag */
+    int intag    = 0; /* set while within <...> */
+    int quote    = 0; /* quote char while within an attribute value */
+    int skip     = 0; /* set while within oneBLOB pcdata */
+    size_t i;
+
+    err[0] = '\0';
+    for (i = 0; i < len && !root && !err[0]; i++)
+    {
+        char c = buf[i];
+
+        if (skip)
+        {
+            /* base64 holds no '<', which begins </oneBLOB> */
+            const char *lt = (const char *)memchr(&buf[i], '<', len - i);
+            if (!lt)
+                break;
+            i    = lt - buf;
+            c    = '<';
+            skip = 0;
+        }
+
+        if (!intag)
+        {
+            if (c == '<')
+            {
+                intag = 1;
+                tag   = i;
+            }
+        }
+        else if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '>')
+        {
+            intag = 0;
+            skip  = !strncmp(&buf[tag], "<oneBLOB", 8) && buf[i - 1] != '/';
+        }
+
+        root = readXMLEle(lp, c, err);
+    }
+
+    delLilXML(lp);
+
+    if (!root && !err[0])
+        strcpy(err, "incomplete setBLOBVector");
+    return (root);
+}
+
+/* return first occurrence of str within s[n], else NULL */
+static const char *findStr(const char *s, size_t n, const char *str)
+{
+    size_t l        = strlen(str);
+    const char *end = s + n;
+
+    while ((size_t)(end - s) >= l)
+    {
+        s = (const char *)memchr(s, str[0], end - s - l + 1);
+        if (!s)
+            return (NULL);
+        if (!memcmp(s, str, l))
+            return (s);
+        s++;
+    }
+
+    return (NULL);
+}
+
+/* return length of the longest tail of s[n] that is a proper prefix of BLOBTAG */
+static int heldBLOBTag(const char *s, size_t n)
+{
+    int l = sizeof(BLOBTAG) - 2;
+
+    for (; l > 0; l--)
+        if ((size_t)l <= n && !memcmp(s + n - l, BLOBTAG, l))
+            return (l);
+
+    return (0);
+}
+
+/* return a new RawBLOB */
+static RawBLOB *newRawBLOB(void)
+{
+    return ((RawBLOB *)calloc(1, sizeof(RawBLOB)));
+}
+
+/* return where the next read of *np bytes for rb should go. while collecting
+ * a raw BLOB that is straight onto its end, with room for each read twice the
+ * last up to MAXBLOBRD, else buf of MAXRBUF.
+ * return NULL if no memory for more of the BLOB.
+ */
+static char *dvrReadBuf(RawBLOB *rb, char *buf, size_t *np)
+{
+    if (!rb->inblob)
+    {
+        rb->rdsize = 0;
+        *np        = MAXRBUF;
+        return (buf);
+    }
+
+    rb->rdsize = rb->rdsize ? rb->rdsize * 2 : MAXRBUF;
+    if (rb->rdsize > MAXBLOBRD)
+        rb->rdsize = MAXBLOBRD;
+
+    /* 2 more for passRawBLOB() */
+    if (rb->len + rb->rdsize + 2 > rb->size)
+    {
+        size_t newsize = rb->size * 2 > rb->len + rb->rdsize + 2 ? rb->size * 2 : rb->len + rb->rdsize + 2;
+        char *newbuf   = (char *)realloc(rb->buf, newsize);
+
+        if (!newbuf)
+            return (NULL);
+        rb->buf  = newbuf;
+        rb->size = newsize;
+    }
+
+    *np = rb->rdsize;
+    return (rb->buf + rb->len);
+}
+
+/* free rb and any message it is collecting */
+static void delRawBLOB(RawBLOB *rb)
+{
+    free(rb->buf);
+    free(rb);
+}
+
+/* body of the thread that reads and parses all input from one driver when
+ * dvrthreads is set. each message is converted to a Msg here and handed to
+ * the main thread on dvrevq together with its XMLEle for routing. at EOF or
+ * trouble a final event with no root is posted and the thread exits.
+ * N.B. we own rp and rp->rfd, dvrinfo[] itself may be moved by the main thread.
+ */
+static void *dvrReader(void *arg)
+{
+    DvrReader *rp = (DvrReader *)arg;
+    char buf[MAXRBUF];
+    char ts[64];
+    char err[1024];
+    DvrEvent *ep;
+    ssize_t nr;
+    size_t nread = 0; /* bytes read not yet reported in an event */
+    int nomem    = 0;
+    ShutWhy why;
+
+    while (!nomem)
+    {
+        unsigned long long t0;
+        DvrMsg *msgs;
+        size_t n;
+        char *rd;
+        int i;
+
+        rd = dvrReadBuf(rp->rb, buf, &n);
+        if (!rd)
+        {
+            fprintf(stderr, "%s: Driver %s: no memory for BLOB\n", indi_tstamp(ts), rp->name);
+            why = SD_READ;
+            break;
+        }
+        nr = readDvr(rp->rfd, rd, n, rp->fdq);
+        if (nr <= 0)
+        {
+            if (nr < 0)
+                fprintf(stderr, "%s: Driver %s: stdin %s\n", indi_tstamp(ts), rp->name, strerror(errno));
+            else
+                fprintf(stderr, "%s: Driver %s: stdin EOF\n", indi_tstamp(ts), rp->name);
+            why = SD_READ;
+            break;
+        }
+        nread += nr;
+
+        t0   = metricsClock();
+        msgs = parseDvrChunk(rp->lp, rp->rb, rd, nr, err);
+        noteParseTime(t0);
+        if (!msgs)
+        {
+            indi_tstamp(ts);
+            fprintf(stderr, "%s: Driver %s: XML error: %s\n", ts, rp->name, err);
+            if (rd == buf)
+                fprintf(stderr, "%s: Driver %s: XML read: %.*s\n", ts, rp->name, (int)nr, buf);
+            why = SD_XML;
+            break;
+        }
+
+        for (i = 0; msgs[i].root; i++)
+        {
+            if (rp->fdq && mapShmBLOBs(msgs[i].root, &msgs[i].mp, rp->fdq, err) < 0)
+            {
+                fprintf(stderr, "%s: Driver %s: %s\n", indi_tstamp(ts), rp->name, err);
+                delXMLEle(msgs[i].root);
+                if (msgs[i].mp)
+                    freeMsg(msgs[i].mp);
+                continue;
+            }
+
+            /* with no memory to pass it on, drop this and the rest and quit */
+            ep = (DvrEvent *)malloc(sizeof(DvrEvent));
+            if (ep && !msgs[i].mp)
+                msgs[i].mp = newMsg();
+            if (!ep || !msgs[i].mp)
+            {
+                fprintf(stderr, "%s: Driver %s: no memory for message\n", indi_tstamp(ts), rp->name);
+                free(ep);
+                for (; msgs[i].root; i++)
+                {
+                    delXMLEle(msgs[i].root);
+                    if (msgs[i].mp)
+                        freeMsg(msgs[i].mp);
+                }
+                why   = SD_READ;
+                nomem = 1;
+                break;
+            }
+
+            ep->dvi   = rp->dvi;
+            ep->gen   = rp->gen;
+            ep->root  = msgs[i].root;
+            ep->mp    = msgs[i].mp;
+            ep->nread = nread;
+            nread     = 0;
+            /* print here to spare the main thread, unless the BLOBs came
+             * through shared memory: those are only base64 encoded if some
+             * recipient wants them that way. if no memory leave it to main.
+             */
+            if (!ep->mp->cp && ep->mp->nshm == 0)
+                setMsgXMLEle(ep->mp, ep->root);
+            pushDvrEvent(ep);
+        }
+        free(msgs);
+    }
+
+    /* tell main thread we are done, with the event saved for this */
+    ep        = rp->endev;
+    ep->dvi   = rp->dvi;
+    ep->gen   = rp->gen;
+    ep->nread = nread;
+    ep->why   = why;
+    pushDvrEvent(ep);
+
+    close(rp->rfd);
+    delLilXML(rp->lp);
+    delRawBLOB(rp->rb);
+    if (rp->fdq)
+        closeFdQ(rp->fdq);
+    free(rp);
+    return (NULL);
+}
+
+/* start a thread to read and parse input from dp.
+ * exit if trouble.
+ */
+static void startDvrReader(DvrInfo *dp)
+{
+    DvrReader *rp = (DvrReader *)malloc(sizeof(DvrReader));
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (!rp || !(rp->endev = (DvrEvent *)calloc(1, sizeof(DvrEvent))))
+    {
+        fprintf(stderr, "%s: Driver %s: no memory for reader thread\n", indi_tstamp(NULL), dp->name);
+        Bye();
+    }
+    rp->rfd = dp->rfd;
+    rp->dvi = dp - dvrinfo;
+    rp->gen = dp->gen;
+    rp->lp  = newLilXML();
+    useArenaLilXML(rp->lp, 1);
+    rp->rb  = newRawBLOB();
+    rp->fdq = dp->fdq; /* now ours */
+    dp->fdq = NULL;
+    strncpy(rp->name, dp->name, MAXINDINAME - 1);
+    rp->name[MAXINDINAME - 1] = '\0';
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, dvrReader, rp) != 0)
+    {
+        fprintf(stderr, "%s: Driver %s: can not start reader thread\n", indi_tstamp(NULL), dp->name);
+        Bye();
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* push ep onto dvrevq and wake the main thread if it may be sleeping.
+ * safe to call from any number of threads concurrently.
+ */
+static void pushDvrEvent(DvrEvent *ep)
+{
+    DvrEvent *prev;
+
+    __atomic_store_n(&ep->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&dvrevq.head, ep, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, ep, __ATOMIC_RELEASE);
+
+    /* only the first push since the main thread last looked writes the pipe */
+    if (ep != &dvrevq.stub && !__atomic_exchange_n(&dvrevq.wakeup, 1, __ATOMIC_SEQ_CST))
+    {
+        if (write(dvrevq.wfd, "", 1) < 0)
+            fprintf(stderr, "Driver event wakeup: %s\n", strerror(errno));
+    }
+}
+
+/* pop the next event from dvrevq, or NULL if none are ready.
+ * only called from the main thread.
+ */
+static DvrEvent *popDvrEvent(void)
+{
+    DvrEvent *tail = dvrevq.tail;
+    DvrEvent *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    /* step over the stub */
+    if (tail == &dvrevq.stub)
+    {
+        if (!next)
+            return (NULL);
+        dvrevq.tail = tail = next;
+        next               = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+    {
+        dvrevq.tail = next;
+        return (tail);
+    }
+
+    /* tail is last unless a producer is part way through a push, in which
+     * case it will write the wakeup pipe again when done.
+     */
+    if (tail != __atomic_load_n(&dvrevq.head, __ATOMIC_ACQUIRE))
+        return (NULL);
+
+    /* put the stub back behind tail so tail can be taken */
+    pushDvrEvent(&dvrevq.stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        dvrevq.tail = next;
+        return (tail);
+    }
+
+    return (NULL);
+}
+
+/* route all messages posted by the driver reader threads.
+ * return 0 if ok else -1 if had to shut down anything.
+ */
+static int readDvrEvents(void)
+{
+    char buf[64];
+    DvrEvent *ep;
+    int shutany = 0;
+
+    /* drain wakeup pipe then allow another before looking at the queue */
+    if (read(dvrevq.rfd, buf, sizeof(buf)) < 0)
+        fprintf(stderr, "%s: Driver event wakeup: %s\n", indi_tstamp(NULL), strerror(errno));
+    __atomic_store_n(&dvrevq.wakeup, 0, __ATOMIC_SEQ_CST);
+
+    while ((ep = popDvrEvent()) != NULL)
+    {
+        DvrInfo *dp = &dvrinfo[ep->dvi];
+
+        if (!dp->active || dp->gen != ep->gen)
+        {
+            /* from a driver that has since been shut down */
+            if (ep->root)
+            {
+                freeMsg(ep->mp);
+                delXMLEle(ep->root);
+            }
+        }
+        else if (!ep->root)
+        {
+            /* reader hit EOF or trouble */
+            dp->tr.nrbytes += ep->nread;
+            shutdownDvr(dp, 1, ep->why);
+            shutany++;
+        }
+        else
+        {
+            dp->tr.nrbytes += ep->nread;
+            if (routeDvrMsg(dp, ep->root, ep->mp) < 0)
+                shutany++;
+        }
+
+        free(ep);
+    }
+
+    return (shutany ? -1 : 0);
+}
+
+/* read up to n bytes from driver fd into buf as read(2). if fdq is not NULL
+ * fd is a socket and any BLOB fds passed along with the bytes are added to it.
+ */
+static ssize_t readDvr(int fd, char *buf, size_t n, FQ *fdq)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(MAXSHMFDS * sizeof(int))];
+    } cbuf;
+    struct cmsghdr *cmp;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t nr;
+
+    if (!fdq)
+        return (read(fd, buf, n));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base       = buf;
+    iov.iov_len        = n;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+
+    nr = recvmsg(fd, &msg, 0);
+    if (nr < 0)
+        return (nr);
+
+    for (cmp = CMSG_FIRSTHDR(&msg); cmp; cmp = CMSG_NXTHDR(&msg, cmp))
+    {
+        if (cmp->cmsg_level == SOL_SOCKET && cmp->cmsg_type == SCM_RIGHTS)
+        {
+            int nfd = (cmp->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int i;
+
+            for (i = 0; i < nfd; i++)
+            {
+                int bfd;
+                memcpy(&bfd, CMSG_DATA(cmp) + i * sizeof(int), sizeof(int));
+                fcntl(bfd, F_SETFD, FD_CLOEXEC);
+                pushFQ(fdq, (void *)(long)bfd);
+            }
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        char ts[64]; /* may be a reader thread */
+        fprintf(stderr, "%s: more than %d BLOB fds in one read, some lost\n", indi_tstamp(ts), MAXSHMFDS);
+    }
+
+    return (nr);
+}
+
+/* if root is a setBLOBVector with oneBLOBs attached through shared memory,
+ * map the next fd on fdq for each into *mpp, creating it if NULL. the content
+ * of *mpp is dropped so it is built from root and the BLOBs when needed.
+ * return 0 if ok else -1 with reason in err[].
+ */
+static int mapShmBLOBs(XMLEle *root, Msg **mpp, FQ *fdq, char err[])
+{
+    XMLEle *ep;
+    Msg *mp;
+    int n = 0;
+
+    if (strcmp(tagXMLEle(root), "setBLOBVector"))
+        return (0);
+    for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+        if (!strcmp(findXMLAttValu(ep, "attached"), "true"))
+            n++;
+    if (n == 0)
+        return (0);
+
+    if (!*mpp)
+        *mpp = newMsg();
+    mp = *mpp;
+    if (mp)
+    {
+        if (mp->cp && mp->cp != mp->buf)
+            free(mp->cp);
+        mp->cp  = NULL;
+        mp->cl  = 0;
+        mp->shm = (ShmBLOB *)calloc(n, sizeof(ShmBLOB));
+    }
+    if (!mp || !mp->shm)
+    {
+        snprintf(err, 1024, "%s.%s: no memory for attached BLOBs", findXMLAttValu(root, "device"),
+                 findXMLAttValu(root, "name"));
+        while (n-- > 0 && nFQ(fdq) > 0)
+            close((int)(long)popFQ(fdq));
+        return (-1);
+    }
+
+    for (; mp->nshm < n; mp->nshm++)
+    {
+        ShmBLOB *sp = &mp->shm[mp->nshm];
+        struct stat st;
+        int fd;
+
+        if (nFQ(fdq) == 0)
+        {
+            snprintf(err, 1024, "%s.%s: BLOB attached without fd", findXMLAttValu(root, "device"),
+                     findXMLAttValu(root, "name"));
+            return (-1);
+        }
+        fd = (int)(long)popFQ(fdq);
+
+        if (fstat(fd, &st) < 0)
+        {
+            snprintf(err, 1024, "BLOB fd: %s", strerror(errno));
+            close(fd);
+            return (-1);
+        }
+        sp->len = st.st_size;
+        if (sp->len > 0)
+        {
+            sp->addr = mmap(NULL, sp->len, PROT_READ, MAP_SHARED, fd, 0);
+            if (sp->addr == MAP_FAILED)
+            {
+                snprintf(err, 1024, "BLOB mmap: %s", strerror(errno));
+                sp->addr = NULL;
+                close(fd);
+                return (-1);
+            }
+        }
+        close(fd);
+    }
+
+    return (0);
+}
+
+/* close each BLOB fd left on fdq, then fdq itself */
+static void closeFdQ(FQ *fdq)
+{
+    while (nFQ(fdq) > 0)
+        close((int)(long)popFQ(fdq));
+    delFQ(fdq);
+}
+
+/* read more from the given driver stderr, add prefix and send to our stderr.
+ * return 0 if ok else -1 if had to restart.
+ */
+static int stderrFromDriver(DvrInfo *dp)
+{
+    static char exbuf[MAXRBUF];
+    static int nexbuf;
+    ssize_t i, s, nr;
+
+    /* read more */
+    nr = read(dp->efd, exbuf + nexbuf, sizeof(exbuf) - nexbuf);
+    if (nr <= 0)
+    {
+        if (nr < 0)
+            fprintf(stderr, "%s: Driver %s: stderr %s\n", indi_tstamp(NULL), dp->name, strerror(errno));
+        else
+            fprintf(stderr, "%s: Driver %s: stderr EOF\n", indi_tstamp(NULL), dp->name);
+        shutdownDvr(dp, 1, SD_READ);
+        return (-1);
+    }
+    nexbuf += nr;
+
+    /* prefix each whole line to our stderr, save extra for next time.
+     * a full buffer with no newline is passed on as is.
+     */
+    for (i = s = 0; i < nexbuf; i++)
+    {
+        if (exbuf[i] == '\n')
+        {
+            logLine("", "%s: Driver %s: %.*s\n", indi_tstamp(NULL), dp->name, (int)(i - s), exbuf + s);
+            s = i + 1;
+        }
+    }
+    if (s == 0 && nexbuf == sizeof(exbuf))
+    {
+        logLine("", "%s: Driver %s: %.*s\n", indi_tstamp(NULL), dp->name, nexbuf, exbuf);
+        s = nexbuf;
+    }
+    nexbuf -= s;
+    memmove(exbuf, exbuf + s, nexbuf); /* slide remaining to front */
+
+    return (0);
+}
+
+/* close down the given client, noting why */
+static void shutdownClient(ClInfo *cp, ShutWhy why)
+{
+    Msg *mp;
+    int i;
+
+    clshut[why]++;
+
+    /* close connection */
+    unwatchFd(cp->s);
+    shutdown(cp->s, SHUT_RDWR);
+    close(cp->s);
+
+    /* free memory */
+    rmRoutes(cp - clinfo);
+    delLilXML(cp->lp);
+    free(cp->props);
+
+    /* decrement and possibly free any unsent messages for this client */
+    for (i = 0; i < NMQ; i++)
+    {
+        while ((mp = (Msg *)popFQ(cp->msgq[i])) != NULL)
+            if (--mp->count == 0)
+                freeMsg(mp);
+        delFQ(cp->msgq[i]);
+        cp->qsize[i] = 0;
+    }
+
+    /* ok now to recycle */
+    cp->active = 0;
+
+    /* remote drivers may no longer need send BLOBs */
+    upBLOBs();
 
     if (verbose > 0)
         fprintf(stderr, "%s: Client %d: shut down complete - bye!\n", indi_tstamp(NULL), cp->s);
@@ -1460,601 +3150,1759 @@ static void shutdownClient(ClInfo *cp)
 #endif
 }
 
-/* close down the given driver and restart */
-static void shutdownDvr(DvrInfo *dp, int restart)
+/* close down the given driver, noting why, and restart */
+static void shutdownDvr(DvrInfo *dp, int restart, ShutWhy why)
+{
+    DvrInfo *odp;
+    Msg *mp;
+    int i;
+
+    dvshut[why]++;
+
+    /* make sure it's dead, reclaim resources */
+    if (dp->pid == REMOTEDVR)
+    {
+        /* socket connection */
+        unwatchFd(dp->wfd);
+        shutdown(dp->wfd, SHUT_RDWR);
+        close(dp->wfd); /* same as rfd, else rfd belongs to the reader thread */
+    }
+    else
+    {
+        /* local pipe connection */
+        kill(dp->pid, SIGKILL); /* we've insured there are no zombies */
+        unwatchFd(dp->wfd);
+        unwatchFd(dp->efd);
+        close(dp->wfd);
+        close(dp->efd);
+        if (!dvrthreads)
+        {
+            /* else rfd belongs to the reader thread, which sees EOF now */
+            unwatchFd(dp->rfd);
+            close(dp->rfd);
+        }
+    }
+
+#ifdef OSX_EMBEDED_MODE
+    fprintf(stderr, "STOPPED \"%s\"\n", dp->name);
+    fflush(stderr);
+#endif
+
+    /* free memory */
+    if (dp->npcache > 0)
+        flushPCache(dp - dvrinfo, "", "");
+    free(dp->sprops);
+    for (i = 0; i < dp->ndev; i++)
+        free(dp->dev[i]);
+    free(dp->dev);
+    if (dp->lp)
+        delLilXML(dp->lp);
+    if (dp->rb)
+        delRawBLOB(dp->rb);
+    if (dp->fdq)
+        closeFdQ(dp->fdq);
+
+    /* ok now to recycle */
+    dp->active = 0;
+    dp->ndev   = 0;
+
+    /* decrement and possibly free any unsent messages for this client */
+    while ((mp = (Msg *)popFQ(dp->msgq)) != NULL)
+        if (--mp->count == 0)
+            freeMsg(mp);
+    delFQ(dp->msgq);
+    dp->qsize = 0;
+
+    if (restart)
+    {
+        if (dp->restarts >= maxrestarts)
+        {
+            fprintf(stderr, "%s: Driver %s: Terminated after #%d restarts.\n", indi_tstamp(NULL), dp->name,
+                    dp->restarts);
+            // If we're not in FIFO mode and we do not have any more drivers, shutdown the server
+            for (odp = dvrinfo; odp < &dvrinfo[ndvrinfo] && !odp->active; odp++)
+                ;
+            if (odp == &dvrinfo[ndvrinfo] && !fifo.name)
+                Bye();
+        }
+        else
+        {
+            fprintf(stderr, "%s: Driver %s: restart #%d\n", indi_tstamp(NULL), dp->name, ++dp->restarts);
+            startDvr(dp);
+        }
+    }
+
+    /* devices of a remote driver are only kept over a restart */
+    if (!dp->active)
+    {
+        for (i = 0; i < dp->nupdev; i++)
+            free(dp->updev[i]);
+        free(dp->updev);
+        dp->updev  = NULL;
+        dp->nupdev = 0;
+    }
+}
+
+/* put Msg mp on queue of each driver responsible for dev, or all drivers
+ * if dev not specified.
+ */
+static void q2RDrivers(const char *dev, Msg *mp, XMLEle *root)
+{
+    DvrInfo *dp;
+
+    /* queue message to each interested driver.
+     * N.B. each remote host:port has just one driver, see startRemoteDvr(),
+     *   so generic getProps do not fan out there more than once.
+     */
+    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+    {
+        if (dp->active == 0)
+            continue;
+
+        /* driver known to not support this dev */
+        if (dev[0] && isDeviceInDriver(dev, dp) == 0)
+            continue;
+
+        /* ok: queue message to this driver */
+        pushDvrMsg(dp, mp, root);
+        if (verbose > 1)
+        {
+            fprintf(stderr, "%s: Driver %s: queuing responsible for <%s device='%s' name='%s'>\n", indi_tstamp(NULL),
+                    dp->name, tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+        }
+    }
+}
+
+/* put Msg mp on queue of each driver snooping dev/name.
+ * if BLOB always honor current mode.
+ */
+static void q2SDrivers(DvrInfo *me, int isblob, const char *dev, const char *name, Msg *mp, XMLEle *root)
+{
+    DvrInfo *dp = NULL;
+
+    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+    {
+        Property *sp = findSDevice(dp, dev, name);
+
+        /* nothing for dp if not snooping for dev/name or wrong BLOB mode */
+        if (!sp)
+            continue;
+        if ((isblob && sp->blob == B_NEVER) || (!isblob && sp->blob == B_ONLY))
+            continue;
+        if (me && me->pid == REMOTEDVR && dp->pid == REMOTEDVR)
+        {
+            // Do not send snoop data to remote drivers at the same host
+            // since they will manage their own snoops remotely
+            if (!strcmp(me->host, dp->host) && me->port == dp->port)
+                continue;
+        }
+
+        /* ok: queue message to this device */
+        pushDvrMsg(dp, mp, root);
+        if (verbose > 1)
+        {
+            fprintf(stderr, "%s: Driver %s: queuing snooped <%s device='%s' name='%s'>\n", indi_tstamp(NULL), dp->name,
+                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+        }
+    }
+}
+
+/* add dev/name to dp's snooping list.
+ * init with blob mode set to B_NEVER.
+ */
+static void addSDevice(DvrInfo *dp, const char *dev, const char *name)
+{
+    Property *sp;
+    char *ip;
+
+    /* no dups */
+    sp = findSDevice(dp, dev, name);
+    if (sp)
+        return;
+
+    /* add dev to sdevs list */
+    dp->sprops = (Property *)realloc(dp->sprops, (dp->nsprops + 1) * sizeof(Property));
+    sp         = &dp->sprops[dp->nsprops++];
+
+    ip = sp->dev;
+    strncpy(ip, dev, MAXINDIDEVICE - 1);
+    ip[MAXINDIDEVICE - 1] = '\0';
+
+    ip = sp->name;
+    strncpy(ip, name, MAXINDINAME - 1);
+    ip[MAXINDINAME - 1] = '\0';
+
+    sp->blob = B_NEVER;
+
+    if (verbose)
+        fprintf(stderr, "%s: Driver %s: snooping on %s.%s\n", indi_tstamp(NULL), dp->name, dev, name);
+}
+
+/* return Property if dp is snooping dev/name, else NULL.
+ */
+static Property *findSDevice(DvrInfo *dp, const char *dev, const char *name)
+{
+    int i;
+
+    for (i = 0; i < dp->nsprops; i++)
+    {
+        Property *sp = &dp->sprops[i];
+        if (!strcmp(sp->dev, dev) && (!sp->name[0] || !strcmp(sp->name, name)))
+            return (sp);
+    }
+
+    return (NULL);
+}
+
+/* put Msg mp on queue of each client interested in dev/name, except notme.
+ * if BLOB always honor current mode.
+ * return -1 if had to shut down any clients, else 0.
+ */
+static int q2Clients(ClInfo *notme, int isblob, const char *dev, const char *name, Msg *mp, XMLEle *root)
+{
+    MsgClass mc = msgClass(isblob, root);
+    int shutany = 0;
+    int ql, i, n;
+
+    /* stream frames and, if enabled, plain set*Vector may be coalesced, so
+     * remember whose they are. a message attribute is never dropped.
+     */
+    if (mc == MQ_STREAM || (coalesce && mc == MQ_CTRL && !strncmp(tagXMLEle(root), "set", 3) &&
+                            !findXMLAtt(root, "message")))
+    {
+        strncpy(mp->dev, dev, MAXINDIDEVICE - 1);
+        strncpy(mp->name, name, MAXINDINAME - 1);
+        mp->elset = elsetHash(root, &mp->nel);
+    }
+
+    /* queue message to each interested client */
+    n = routeClients(dev, name);
+    for (i = 0; i < n; i++)
+    {
+        ClInfo *cp = &clinfo[routecl[i].cli];
+        int pi     = routecl[i].pi;
+
+        /* cp still in use? notme? blob? */
+        if (!cp->active || cp == notme)
+            continue;
+
+        //if ((isblob && cp->blob==B_NEVER) || (!isblob && cp->blob==B_ONLY))
+        if (!isblob && cp->blob == B_ONLY)
+            continue;
+
+        if (isblob)
+        {
+            if (cp->nprops > 0)
+            {
+                if ((pi >= 0 && cp->props[pi].blob == B_NEVER) || (pi < 0 && cp->blob == B_NEVER))
+                    continue;
+            }
+            else if (cp->blob == B_NEVER)
+                continue;
+        }
+
+        /* keep only the latest frame if too far behind in this stream */
+        if (mc == MQ_STREAM && maxstreamsiz > 0 && cp->qsize[MQ_STREAM] > (unsigned long)maxstreamsiz)
+        {
+            int ndrop = dropStreamMsgs(cp, mp);
+            cp->tr.ndrops += ndrop;
+            if (verbose > 1)
+                fprintf(stderr, "%s: Client %d: %lu stream bytes behind. Dropped %d older stream BLOBs\n",
+                        indi_tstamp(NULL), cp->s, cp->qsize[MQ_STREAM], ndrop);
+        }
+
+        /* shut down this client if its q is already too large */
+        ql = clQSize(cp);
+        if (ql > maxqsiz)
+        {
+            if (verbose)
+                fprintf(stderr, "%s: Client %d: %d bytes behind, shutting down\n", indi_tstamp(NULL), cp->s, ql);
+            shutdownClient(cp, SD_QUEUE);
+            shutany++;
+            continue;
+        }
+
+        /* ok: queue message to this client, or replace an older one */
+        if (!(mc == MQ_CTRL && mp->name[0] && replaceClMsg(cp, mp, root)))
+        {
+            Msg *bp = (isblob && cp->binblobs) ? binMsg(mp, root) : NULL;
+            pushClMsg(cp, bp ? bp : mp, root, mc);
+        }
+        if (verbose > 1)
+            fprintf(stderr, "%s: Client %d: queuing <%s device='%s' name='%s'>\n", indi_tstamp(NULL), cp->s,
+                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+    }
+
+    return (shutany ? -1 : 0);
+}
+
+/* put Msg mp on queue of each chained server client, except notme.
+  * return -1 if had to shut down any clients, else 0.
+ */
+static int q2Servers(DvrInfo *me, Msg *mp, XMLEle *root)
+{
+    int shutany = 0, i = 0, devFound = 0;
+    ClInfo *cp;
+    int ql = 0;
+
+    /* queue message to each interested client */
+    for (cp = clinfo; cp < &clinfo[nclinfo]; cp++)
+    {
+        /* cp in use? not chained server? */
+        if (!cp->active || cp->allprops == 1)
+            continue;
+
+        // Only send the message to the upstream server that is connected specfically to the device in driver dp
+        for (i = 0; i < cp->nprops; i++)
+        {
+            Property *pp = &cp->props[i];
+            int j        = 0;
+            for (j = 0; j < me->ndev; j++)
+            {
+                if (!strcmp(pp->dev, me->dev[j]))
+                    break;
+            }
+
+            if (j != me->ndev)
+            {
+                devFound = 1;
+                break;
+            }
+        }
+
+        // If no matching device found, continue
+        if (devFound == 0)
+            continue;
+
+        /* shut down this client if its q is already too large */
+        ql = clQSize(cp);
+        if (ql > maxqsiz)
+        {
+            if (verbose)
+                fprintf(stderr, "%s: Client %d: %d bytes behind, shutting down\n", indi_tstamp(NULL), cp->s, ql);
+            shutdownClient(cp, SD_QUEUE);
+            shutany++;
+            continue;
+        }
+
+        /* ok: queue message to this client */
+        pushClMsg(cp, mp, root, MQ_CTRL);
+        if (verbose > 1)
+            fprintf(stderr, "%s: Client %d: queuing <%s device='%s' name='%s'>\n", indi_tstamp(NULL), cp->s,
+                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+    }
+
+    return (shutany ? -1 : 0);
+}
+
+/* print root as content in Msg mp.
+ * safe to call from any thread.
+ * return 0 if ok else -1 if no memory, leaving mp->cp NULL.
+ */
+static int setMsgXMLEle(Msg *mp, XMLEle *root)
+{
+    /* root lacks the BLOBs if they came through shared memory */
+    if (mp->nshm > 0)
+        return (setMsgShmBLOBs(mp, root));
+
+    /* want cl to only count content, but need room for final \0 */
+    mp->cl = sprlXMLEle(root, 0);
+    if (mp->cl < sizeof(mp->buf))
+        mp->cp = mp->buf;
+    else
+        mp->cp = malloc(mp->cl + 1);
+    if (!mp->cp)
+    {
+        mp->cl = 0;
+        return (-1);
+    }
+    sprXMLEle(mp->cp, root, 0);
+    return (0);
+}
+
+/* print root as content in Msg mp, base64 encoding the BLOBs in mp->shm as
+ * the content of each oneBLOB attached through shared memory.
+ * return 0 if ok else -1 if no memory, leaving mp->cp NULL.
+ */
+static int setMsgShmBLOBs(Msg *mp, XMLEle *root)
+{
+    unsigned char line[B64LINE + 4];
+    XMLEle *ep;
+    size_t l;
+    int i;
+
+    /* room for the elements, with enclen, plus encoded BLOBs and newlines */
+    l = sprlXMLEle(root, 0) + 1;
+    for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+        l += 32;
+    for (i = 0; i < mp->nshm; i++)
+        l += 4 * ((mp->shm[i].len + 2) / 3) + mp->shm[i].len / (B64LINE / 4 * 3) + 2;
+    mp->cp = malloc(l);
+    if (!mp->cp)
+        return (-1);
+
+    l = sprintf(mp->cp, "<%s", tagXMLEle(root));
+    l += sprShmAtts(mp->cp + l, root);
+    l += sprintf(mp->cp + l, ">\n");
+
+    for (ep = nextXMLEle(root, 1), i = 0; ep; ep = nextXMLEle(root, 0))
+    {
+        l += sprintf(mp->cp + l, "  <%s", tagXMLEle(ep));
+        l += sprShmAtts(mp->cp + l, ep);
+
+        if (strcmp(findXMLAttValu(ep, "attached"), "true") || i >= mp->nshm)
+        {
+            l += sprintf(mp->cp + l, ">%s</%s>\n", entityXML(pcdataXMLEle(ep)), tagXMLEle(ep));
+        }
+        else
+        {
+            ShmBLOB *sp              = &mp->shm[i++];
+            const unsigned char *bp = (const unsigned char *)sp->addr;
+            size_t left             = sp->len;
+
+            l += sprintf(mp->cp + l, " enclen='%lu'>\n", (unsigned long)(4 * ((sp->len + 2) / 3)));
+            while (left > 0)
+            {
+                size_t n = left > B64LINE / 4 * 3 ? B64LINE / 4 * 3 : left;
+                int nc   = to64frombits(line, bp, n);
+
+                memcpy(mp->cp + l, line, nc);
+                l += nc;
+                mp->cp[l++] = '\n';
+                bp += n;
+                left -= n;
+            }
+            l += sprintf(mp->cp + l, "  </%s>\n", tagXMLEle(ep));
+        }
+    }
+
+    l += sprintf(mp->cp + l, "</%s>\n", tagXMLEle(root));
+    mp->cl = l;
+    return (0);
+}
+
+/* print the attributes of ep into s as sprXMLEle would, less those that
+ * describe shared memory BLOBs.
+ * return number of chars printed.
+ */
+static int sprShmAtts(char *s, XMLEle *ep)
+{
+    XMLAtt *ap;
+    int l = 0;
+
+    for (ap = nextXMLAtt(ep, 1); ap; ap = nextXMLAtt(ep, 0))
+    {
+        if (!strcmp(nameXMLAtt(ap), "attached") || !strcmp(nameXMLAtt(ap), "enclen"))
+            continue;
+        l += sprintf(s + l, " %s='%s'", nameXMLAtt(ap), entityXML(valuXMLAtt(ap)));
+    }
+
+    return (l);
+}
+
+/* unmap and forget any BLOBs in mp->shm */
+static void unmapShmBLOBs(Msg *mp)
+{
+    int i;
+
+    for (i = 0; i < mp->nshm; i++)
+        if (mp->shm[i].addr)
+            munmap(mp->shm[i].addr, mp->shm[i].len);
+    free(mp->shm);
+    mp->shm  = NULL;
+    mp->nshm = 0;
+}
+
+/* return the Msg to queue in place of setBLOBVector mp to clients that take
+ * binary BLOBs. it has each oneBLOB marked attached with its len in bytes and
+ * no content, and the BLOBs themselves follow the end tag in the same order.
+ * it is built the first time from mp->shm, else by decoding the content of
+ * mp, and mp holds one count on it until freed.
+ * return NULL if no memory, so mp is sent as is.
+ */
+static Msg *binMsg(Msg *mp, XMLEle *root)
+{
+    const char *text = NULL, *end = NULL;
+    unsigned char **blobs;
+    size_t *lens;
+    XMLEle *ep;
+    Msg *bp;
+    size_t l;
+    int nep, i, j, ok;
+
+    if (mp->bin)
+        return (mp->bin);
+
+    /* BLOBs in shared memory are used as is, else decode those in content */
+    if (mp->nshm == 0)
+    {
+        if (!mp->cp && setMsgXMLEle(mp, root) < 0)
+            return (NULL);
+        text = mp->cp;
+        end  = mp->cp + mp->cl;
+    }
+
+    nep   = nXMLEle(root);
+    blobs = (unsigned char **)calloc(nep + 1, sizeof(unsigned char *));
+    lens  = (size_t *)calloc(nep + 1, sizeof(size_t));
+    ok    = blobs && lens;
+    l     = sprlXMLEle(root, 0) + 1;
+    for (ep = nextXMLEle(root, 1), i = j = 0; ok && ep; ep = nextXMLEle(root, 0), i++)
+    {
+        l += 48; /* attached and len */
+        if (strcmp(tagXMLEle(ep), "oneBLOB"))
+            continue;
+
+        if (mp->nshm > 0)
+        {
+            if (!strcmp(findXMLAttValu(ep, "attached"), "true") && j < mp->nshm)
+            {
+                blobs[i] = (unsigned char *)mp->shm[j].addr;
+                lens[i]  = mp->shm[j++].len;
+            }
+        }
+        else if (text && (text = nextBLOBText(text, end, &lens[i])) != NULL)
+        {
+            blobs[i] = (unsigned char *)malloc(lens[i] / 4 * 3 + 3);
+            if (!blobs[i])
+            {
+                ok = 0;
+                break;
+            }
+            text += lens[i];
+            lens[i] = decodeBLOB(blobs[i], text - lens[i], lens[i]);
+        }
+        l += lens[i];
+    }
+
+    bp = ok ? newMsg() : NULL;
+    if (bp && !(bp->cp = malloc(l)))
+    {
+        free(bp);
+        bp = NULL;
+    }
+    if (!bp)
+    {
+        if (blobs && mp->nshm == 0)
+            for (i = 0; i < nep; i++)
+                free(blobs[i]);
+        free(blobs);
+        free(lens);
+        return (NULL);
+    }
+    bp->count = 1;
+    memcpy(bp->dev, mp->dev, sizeof(bp->dev));
+    memcpy(bp->name, mp->name, sizeof(bp->name));
+
+    l = sprintf(bp->cp, "<%s", tagXMLEle(root));
+    l += sprShmAtts(bp->cp + l, root);
+    l += sprintf(bp->cp + l, ">\n");
+    for (ep = nextXMLEle(root, 1), i = 0; ep; ep = nextXMLEle(root, 0), i++)
+    {
+        l += sprintf(bp->cp + l, "  <%s", tagXMLEle(ep));
+        l += sprShmAtts(bp->cp + l, ep);
+        if (strcmp(tagXMLEle(ep), "oneBLOB"))
+            l += sprintf(bp->cp + l, ">%s</%s>\n", entityXML(pcdataXMLEle(ep)), tagXMLEle(ep));
+        else
+            l += sprintf(bp->cp + l, " attached='true' len='%lu'/>\n", (unsigned long)lens[i]);
+    }
+    l += sprintf(bp->cp + l, "</%s>", tagXMLEle(root));
+
+    /* BLOBs follow right after the end tag */
+    for (i = 0; i < nep; i++)
+    {
+        if (lens[i] > 0)
+            memcpy(bp->cp + l, blobs[i], lens[i]);
+        l += lens[i];
+        if (mp->nshm == 0)
+            free(blobs[i]);
+    }
+    bp->cl = l;
+
+    free(blobs);
+    free(lens);
+    mp->bin = bp;
+    return (bp);
+}
+
+/* find the content of the next oneBLOB in the XML text from s up to end.
+ * return start of its content with length in *np, else NULL if none.
+ */
+static const char *nextBLOBText(const char *s, const char *end, size_t *np)
 {
-    Msg *mp;
+    const char *lt;
+    int quote = 0;
 
-    /* make sure it's dead, reclaim resources */
-    if (dp->pid == REMOTEDVR)
+    s = findStr(s, end - s, "<oneBLOB");
+    if (!s)
+        return (NULL);
+
+    /* find end of the start tag, minding quoted attribute values */
+    for (s += 8; s < end; s++)
     {
-        /* socket connection */
-        shutdown(dp->wfd, SHUT_RDWR);
-        close(dp->wfd); /* same as rfd */
+        if (quote)
+        {
+            if (*s == quote)
+                quote = 0;
+        }
+        else if (*s == '"' || *s == '\'')
+            quote = *s;
+        else if (*s == '>')
+            break;
+    }
+    if (s >= end)
+        return (NULL);
+    if (s[-1] == '/')
+    {
+        *np = 0;
+        return (s + 1);
     }
+
+    /* base64 holds no '<', which begins </oneBLOB> */
+    s++;
+    lt = (const char *)memchr(s, '<', end - s);
+    if (!lt)
+        return (NULL);
+    *np = lt - s;
+    return (s);
+}
+
+/* decode the n chars of base64 at in, ignoring whitespace, into out.
+ * return number of bytes decoded.
+ */
+static size_t decodeBLOB(unsigned char *out, const char *in, size_t n)
+{
+    char *b64 = (char *)malloc(n + 1);
+    size_t i, nb64 = 0;
+    int nout = 0;
+
+    for (i = 0; i < n; i++)
+        if (!isspace((unsigned char)in[i]))
+            b64[nb64++] = in[i];
+    if (nb64 >= 4)
+        nout = from64tobits_fast((char *)out, b64, nb64 - nb64 % 4);
+    free(b64);
+
+    return (nout > 0 ? nout : 0);
+}
+
+/* save str as content in Msg mp.
+ */
+static void setMsgStr(Msg *mp, char *str)
+{
+    /* want cl to only count content, but need room for final \0 */
+    mp->cl = strlen(str);
+    if (mp->cl < sizeof(mp->buf))
+        mp->cp = mp->buf;
     else
+        mp->cp = malloc(mp->cl + 1);
+    strcpy(mp->cp, str);
+}
+
+/* return pointer to one new nulled Msg
+ */
+static Msg *newMsg(void)
+{
+    return ((Msg *)calloc(1, sizeof(Msg)));
+}
+
+/* add mp to the class mc queue of client cp and watch to send it.
+ * if mp has no content yet it is set from root, so we only build it once
+ * someone cares.
+ */
+static void pushClMsg(ClInfo *cp, Msg *mp, XMLEle *root, MsgClass mc)
+{
+    if (!mp->cp && setMsgXMLEle(mp, root) < 0)
     {
-        /* local pipe connection */
-        kill(dp->pid, SIGKILL); /* we've insured there are no zombies */
-        close(dp->wfd);
-        close(dp->rfd);
-        close(dp->efd);
+        fprintf(stderr, "%s: Client %d: no memory for message\n", indi_tstamp(NULL), cp->s);
+        return;
     }
+    mp->count++;
+    if (nClMsgs(cp) == 0)
+        watchWrite(cp->s, 1);
+    pushFQ(cp->msgq[mc], mp);
+    cp->qsize[mc] += mp->cl;
+}
 
-#ifdef OSX_EMBEDED_MODE
-    fprintf(stderr, "STOPPED \"%s\"\n", dp->name);
-    fflush(stderr);
-#endif
+/* return bytes queued to cp in all classes */
+static unsigned long clQSize(ClInfo *cp)
+{
+    return (cp->qsize[MQ_CTRL] + cp->qsize[MQ_BLOB] + cp->qsize[MQ_STREAM]);
+}
 
-    /* free memory */
-    free(dp->sprops);
-    free(dp->dev);
-    delLilXML(dp->lp);
+/* return number of Msgs queued to cp in all classes */
+static int nClMsgs(ClInfo *cp)
+{
+    return (nFQ(cp->msgq[MQ_CTRL]) + nFQ(cp->msgq[MQ_BLOB]) + nFQ(cp->msgq[MQ_STREAM]));
+}
 
-    /* ok now to recycle */
-    dp->active = 0;
-    dp->ndev   = 0;
+/* return the class of client queue for message root */
+static MsgClass msgClass(int isblob, XMLEle *root)
+{
+    XMLEle *ep;
 
-    /* decrement and possibly free any unsent messages for this client */
-    while ((mp = (Msg *)popFQ(dp->msgq)) != NULL)
-        if (--mp->count == 0)
-            freeMsg(mp);
-    delFQ(dp->msgq);
+    if (!isblob)
+        return (MQ_CTRL);
+
+    for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+    {
+        if (!strcmp(tagXMLEle(ep), "oneBLOB") && strstr(findXMLAttValu(ep, "format"), "stream"))
+            return (MQ_STREAM);
+    }
+
+    return (MQ_BLOB);
+}
+
+/* remove each stream Msg queued to cp for the same property as mp, except
+ * one already being sent.
+ * return number removed.
+ */
+static int dropStreamMsgs(ClInfo *cp, Msg *mp)
+{
+    FQ *q = cp->msgq[MQ_STREAM];
+    int i, n = nFQ(q);
+    int ndrop = 0;
+
+    /* rotate the whole queue once, pushing back those we keep */
+    for (i = 0; i < n; i++)
+    {
+        Msg *qmp = (Msg *)popFQ(q);
+
+        if ((i == 0 && cp->nsent > 0 && cp->curq == MQ_STREAM) || strcmp(qmp->dev, mp->dev) ||
+            strcmp(qmp->name, mp->name))
+        {
+            pushFQ(q, qmp);
+            continue;
+        }
+
+        cp->qsize[MQ_STREAM] -= qmp->cl;
+        if (--qmp->count == 0)
+            freeMsg(qmp);
+        ndrop++;
+    }
+
+    return (ndrop);
+}
+
+/* add mp to the queue of driver dp and watch to send it.
+ * if mp has no content yet it is set from root.
+ */
+static void pushDvrMsg(DvrInfo *dp, Msg *mp, XMLEle *root)
+{
+    if (!mp->cp && setMsgXMLEle(mp, root) < 0)
+    {
+        fprintf(stderr, "%s: Driver %s: no memory for message\n", indi_tstamp(NULL), dp->name);
+        return;
+    }
+    mp->count++;
+    pushFQ(dp->msgq, mp);
+    dp->qsize += mp->cl;
+    if (nFQ(dp->msgq) == 1)
+        watchWrite(dp->wfd, 1);
+}
+
+/* free Msg mp and everything it contains */
+static void freeMsg(Msg *mp)
+{
+    if (mp->cp && mp->cp != mp->buf)
+        free(mp->cp);
+    if (mp->bin && --mp->bin->count == 0)
+        freeMsg(mp->bin);
+    unmapShmBLOBs(mp);
+    free(mp);
+}
+
+/* fill iov with the unsent content of the messages on q, starting nsent bytes
+ * into the first, until have MAXIOV pieces or MAXWSIZ bytes.
+ * return number of iov entries used.
+ */
+static int setMsgIOV(FQ *q, unsigned int nsent, struct iovec *iov)
+{
+    size_t budget = MAXWSIZ;
+    int i, niov = 0;
+
+    for (i = 0; i < nFQ(q) && niov < MAXIOV && budget > 0; i++)
+    {
+        Msg *mp  = (Msg *)peekiFQ(q, i);
+        size_t n = mp->cl - nsent;
+
+        if (n > budget)
+            n = budget;
+        iov[niov].iov_base = &mp->cp[nsent];
+        iov[niov].iov_len  = n;
+        niov++;
+        budget -= n;
+        nsent = 0;
+    }
+
+    return (niov);
+}
+
+/* replace with mp the latest unsent set*Vector queued to cp for the same
+ * property and elements, looking back no further than the last message that can not be
+ * coalesced so the order of all else is kept.
+ * return 1 if replaced, else 0.
+ */
+static int replaceClMsg(ClInfo *cp, Msg *mp, XMLEle *root)
+{
+    FQ *q    = cp->msgq[MQ_CTRL];
+    int last = (cp->nsent > 0 && cp->curq == MQ_CTRL) ? 1 : 0;
+    int i;
+
+    for (i = nFQ(q) - 1; i >= last; i--)
+    {
+        Msg *qmp = (Msg *)peekiFQ(q, i);
+
+        if (!qmp->name[0])
+            break;
+        if (!strcmp(qmp->name, mp->name) && !strcmp(qmp->dev, mp->dev) && qmp->nel == mp->nel &&
+            qmp->elset == mp->elset)
+        {
+            if (!mp->cp && setMsgXMLEle(mp, root) < 0)
+                return (0);
+            mp->count++;
+            setiFQ(q, i, mp);
+            cp->qsize[MQ_CTRL] += mp->cl;
+            cp->qsize[MQ_CTRL] -= qmp->cl;
+            if (--qmp->count == 0)
+                freeMsg(qmp);
+            if (verbose > 1)
+                fprintf(stderr, "%s: Client %d: replacing queued <%s device='%s' name='%s'>\n", indi_tstamp(NULL),
+                        cp->s, tagXMLEle(root), mp->dev, mp->name);
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
+/* fill iov with the unsent content of the messages queued to cp in the order
+ * they are to be sent: rest of any message already begun, then each class in
+ * turn, until have MAXIOV pieces or MAXWSIZ bytes. set iovq[] to the class of
+ * each.
+ * return number of iov entries used.
+ */
+static int setClMsgIOV(ClInfo *cp, struct iovec *iov, MsgClass *iovq)
+{
+    size_t budget = MAXWSIZ;
+    int niov      = 0;
+    int mc, i;
+
+    if (cp->nsent > 0)
+    {
+        Msg *mp  = (Msg *)peekFQ(cp->msgq[cp->curq]);
+        size_t n = mp->cl - cp->nsent;
+
+        if (n > budget)
+            n = budget;
+        iov[niov].iov_base = &mp->cp[cp->nsent];
+        iov[niov].iov_len  = n;
+        iovq[niov++]       = cp->curq;
+        budget -= n;
+    }
+
+    for (mc = 0; mc < NMQ; mc++)
+    {
+        FQ *q = cp->msgq[mc];
+
+        i = (cp->nsent > 0 && mc == cp->curq) ? 1 : 0;
+        for (; i < nFQ(q) && niov < MAXIOV && budget > 0; i++)
+        {
+            Msg *mp  = (Msg *)peekiFQ(q, i);
+            size_t n = mp->cl;
+
+            if (n > budget)
+                n = budget;
+            iov[niov].iov_base = mp->cp;
+            iov[niov].iov_len  = n;
+            iovq[niov++]       = mc;
+            budget -= n;
+        }
+    }
+
+    return (niov);
+}
+
+/* write the next chunk of the messages queued to the given client, gathering
+ * as many as fit in one writev in priority order. pop each message when
+ * complete and free it if we are the last one to use it. shut down this
+ * client if trouble.
+ * N.B. we assume we will never be called with all of cp->msgq[] empty.
+ * return 0 if ok else -1 if had to shut down.
+ */
+static int sendClientMsg(ClInfo *cp)
+{
+    struct iovec iov[MAXIOV];
+    MsgClass iovq[MAXIOV];
+    ssize_t nw;
+    Msg *mp;
+    int i;
+
+    /* send next chunk, never more than MAXWSIZ to reduce blocking */
+    nw = writev(cp->s, iov, setClMsgIOV(cp, iov, iovq));
+
+    /* shut down if trouble */
+    if (nw <= 0)
+    {
+        if (nw == 0)
+            fprintf(stderr, "%s: Client %d: write returned 0\n", indi_tstamp(NULL), cp->s);
+        else
+            fprintf(stderr, "%s: Client %d: write: %s\n", indi_tstamp(NULL), cp->s, strerror(errno));
+        shutdownClient(cp, SD_WRITE);
+        return (-1);
+    }
+    cp->tr.nwbytes += nw;
+
+    /* update amount sent of each message written, each is now first in its
+     * queue. when complete: free message if we are the last to use it and
+     * pop from our queue.
+     */
+    for (i = 0; nw > 0; i++)
+    {
+        ssize_t n;
+
+        cp->curq = iovq[i];
+        mp       = (Msg *)peekFQ(cp->msgq[cp->curq]);
+        n        = mp->cl - cp->nsent;
+        if (n > nw)
+            n = nw;
+
+        /* trace */
+        if (verbose > 2)
+        {
+            fprintf(stderr, "%s: Client %d: sending msg copy %d nq %d:\n%.*s\n", indi_tstamp(NULL), cp->s,
+                    mp->count, nClMsgs(cp), (int)n, &mp->cp[cp->nsent]);
+        }
+        else if (verbose > 1)
+        {
+            fprintf(stderr, "%s: Client %d: sending %.50s\n", indi_tstamp(NULL), cp->s, &mp->cp[cp->nsent]);
+        }
+
+        cp->nsent += n;
+        nw -= n;
+        if (cp->nsent == mp->cl)
+        {
+            cp->tr.nwmsgs++;
+            cp->qsize[cp->curq] -= mp->cl;
+            if (--mp->count == 0)
+                freeMsg(mp);
+            popFQ(cp->msgq[cp->curq]);
+            cp->nsent = 0;
+        }
+    }
+
+    if (nClMsgs(cp) == 0)
+        watchWrite(cp->s, 0);
+
+    return (0);
+}
+
+/* write the next chunk of the messages in the queue to the given driver,
+ * gathering as many as fit in one writev. pop each message when complete and
+ * free it if we are the last one to use it. restart this driver if touble.
+ * N.B. we assume we will never be called with dp->msgq empty.
+ * return 0 if ok else -1 if had to shut down.
+ */
+static int sendDriverMsg(DvrInfo *dp)
+{
+    struct iovec iov[MAXIOV];
+    ssize_t nw;
+    Msg *mp;
+
+    /* send next chunk, never more than MAXWSIZ to reduce blocking */
+    nw = writev(dp->wfd, iov, setMsgIOV(dp->msgq, dp->nsent, iov));
+
+    /* restart if trouble */
+    if (nw <= 0)
+    {
+        if (nw == 0)
+            fprintf(stderr, "%s: Driver %s: write returned 0\n", indi_tstamp(NULL), dp->name);
+        else
+            fprintf(stderr, "%s: Driver %s: write: %s\n", indi_tstamp(NULL), dp->name, strerror(errno));
+        shutdownDvr(dp, 1, SD_WRITE);
+        return (-1);
+    }
+    dp->tr.nwbytes += nw;
+
+    /* update amount sent of each message written. when complete: free
+     * message if we are the last to use it and pop from our queue.
+     */
+    while (nw > 0)
+    {
+        ssize_t n;
+
+        mp = (Msg *)peekFQ(dp->msgq);
+        n  = mp->cl - dp->nsent;
+        if (n > nw)
+            n = nw;
+
+        /* trace */
+        if (verbose > 2)
+        {
+            fprintf(stderr, "%s: Driver %s: sending msg copy %d nq %d:\n%.*s\n", indi_tstamp(NULL), dp->name,
+                    mp->count, nFQ(dp->msgq), (int)n, &mp->cp[dp->nsent]);
+        }
+        else if (verbose > 1)
+        {
+            fprintf(stderr, "%s: Driver %s: sending %.50s\n", indi_tstamp(NULL), dp->name, &mp->cp[dp->nsent]);
+        }
+
+        dp->nsent += n;
+        nw -= n;
+        if (dp->nsent == mp->cl)
+        {
+            dp->tr.nwmsgs++;
+            dp->qsize -= mp->cl;
+            if (--mp->count == 0)
+                freeMsg(mp);
+            popFQ(dp->msgq);
+            dp->nsent = 0;
+        }
+    }
+
+    if (nFQ(dp->msgq) == 0)
+        watchWrite(dp->wfd, 0);
+
+    return (0);
+}
+
+/* return the route[] bucket for dev/name */
+static unsigned int routeHash(const char *dev, const char *name)
+{
+    unsigned int h = 2166136261u; /* FNV-1a */
+
+    while (*dev)
+        h = (h ^ (unsigned char)*dev++) * 16777619u;
+    h = (h ^ '.') * 16777619u;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+
+    return (h & (NROUTE - 1));
+}
+
+/* return a hash of the names of the elements of root, in order, and their
+ * count in *nel. a partial update of a vector hashes differently than a full
+ * one so coalescing never drops the elements only the older one carried.
+ */
+static unsigned long elsetHash(XMLEle *root, int *nel)
+{
+    unsigned long h = 2166136261u; /* FNV-1a */
+    XMLEle *ep;
+    int n = 0;
+
+    for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+    {
+        const char *name = findXMLAttValu(ep, "name");
+
+        while (*name)
+            h = (h ^ (unsigned char)*name++) * 16777619u;
+        h = (h ^ '.') * 16777619u;
+        n++;
+    }
+
+    *nel = n;
+    return (h);
+}
+
+/* add clinfo[cli].props[pi] to the routing index */
+static void addRoute(int cli, int pi)
+{
+    Property *pp   = &clinfo[cli].props[pi];
+    unsigned int h = routeHash(pp->dev, pp->name);
+    Route *rp      = (Route *)malloc(sizeof(Route));
+
+    if (!rp)
+    {
+        fprintf(stderr, "no memory for client route\n");
+        Bye();
+    }
+    rp->cli  = cli;
+    rp->pi   = pi;
+    rp->next = route[h];
+    route[h] = rp;
+}
 
-    if (restart)
+/* remove all props of clinfo[cli] from the routing index */
+static void rmRoutes(int cli)
+{
+    ClInfo *cp = &clinfo[cli];
+    int i;
+
+    for (i = 0; i < cp->nprops; i++)
     {
-        if (dp->restarts >= maxrestarts)
-        {
-            fprintf(stderr, "%s: Driver %s: Terminated after #%d restarts.\n", indi_tstamp(NULL), dp->name,
-                    dp->restarts);
-            // If we're not in FIFO mode and we do not have any more drivers, shutdown the server
-            terminateddrv++;
-            if ((ndvrinfo - terminateddrv) <= 0 && !fifo.name)
-                Bye();
-        }
-        else
+        Route **rpp = &route[routeHash(cp->props[i].dev, cp->props[i].name)];
+
+        while (*rpp)
         {
-            fprintf(stderr, "%s: Driver %s: restart #%d\n", indi_tstamp(NULL), dp->name, ++dp->restarts);
-            startDvr(dp);
+            Route *rp = *rpp;
+            if (rp->cli == cli)
+            {
+                *rpp = rp->next;
+                free(rp);
+            }
+            else
+                rpp = &rp->next;
         }
     }
 }
 
-/* put Msg mp on queue of each driver responsible for dev, or all drivers
- * if dev not specified.
- */
-static void q2RDrivers(const char *dev, Msg *mp, XMLEle *root)
+/* return index into clinfo[cli].props[] of exactly dev/name, else -1 */
+static int findRoute(int cli, const char *dev, const char *name)
 {
-    DvrInfo *dp;
-    char *roottag = tagXMLEle(root);
-
-    char lastRemoteHost[MAXSBUF];
-    int lastRemotePort = -1;
+    Route *rp;
 
-    /* queue message to each interested driver.
-     * N.B. don't send generic getProps to more than one remote driver,
-     *   otherwise they all fan out and we get multiple responses back.
-     */
-    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+    for (rp = route[routeHash(dev, name)]; rp; rp = rp->next)
     {
-        int isRemote = (dp->pid == REMOTEDVR);
-
-        if (dp->active == 0)
-            continue;
+        Property *pp;
 
-        /* driver known to not support this dev */
-        if (dev[0] && isDeviceInDriver(dev, dp) == 0)
-            continue;
-
-        /* Only send message to each *unique* remote driver at a particular host:port
-         * Since it will be propogated to all other devices there */
-        if (!dev[0] && isRemote && !strcmp(lastRemoteHost, dp->host) && lastRemotePort == dp->port)
+        if (rp->cli != cli)
             continue;
+        pp = &clinfo[cli].props[rp->pi];
+        if (!strcmp(pp->dev, dev) && !strcmp(pp->name, name))
+            return (rp->pi);
+    }
 
-        /* JM 2016-10-30: Only send enableBLOB to remote drivers */
-        if (isRemote == 0 && !strcmp(roottag, "enableBLOB"))
-            continue;
+    return (-1);
+}
 
-        /* Retain last remote driver data so that we do not send the same info again to a driver
-         * residing on the same host:port */
-        if (isRemote)
-        {
-            strncpy(lastRemoteHost, dp->host, MAXSBUF);
-            lastRemotePort = dp->port;
-        }
+/* add cli to routecl[] unless already there for this routing pass.
+ * if pi >= 0 it is the index of the prop in cli matching dev/name exactly.
+ */
+static void addRouteCl(int cli, int pi)
+{
+    ClInfo *cp = &clinfo[cli];
 
-        /* ok: queue message to this driver */
-        mp->count++;
-        pushFQ(dp->msgq, mp);
-        if (verbose > 1)
-        {
-            fprintf(stderr, "%s: Driver %s: queuing responsible for <%s device='%s' name='%s'>\n", indi_tstamp(NULL),
-                    dp->name, tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
-        }
+    if (cp->rstamp != routestamp)
+    {
+        cp->rstamp             = routestamp;
+        cp->rslot              = nroutecl;
+        routecl[nroutecl].cli  = cli;
+        routecl[nroutecl++].pi = pi;
     }
+    else if (pi >= 0)
+        routecl[cp->rslot].pi = pi;
 }
 
-/* put Msg mp on queue of each driver snooping dev/name.
- * if BLOB always honor current mode.
+/* fill routecl[] with each active client that may be interested in dev/name,
+ * with the index of its prop matching dev/name exactly or -1.
+ * return number of entries.
  */
-static void q2SDrivers(DvrInfo *me, int isblob, const char *dev, const char *name, Msg *mp, XMLEle *root)
+static int routeClients(const char *dev, const char *name)
 {
-    DvrInfo *dp = NULL;
+    Route *rp;
+    int cli;
 
-    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+    nroutecl = 0;
+    routestamp++;
+
+    /* clients that want everything, or all of them if no dev */
+    for (cli = 0; cli < nclinfo; cli++)
     {
-        Property *sp = findSDevice(dp, dev, name);
+        ClInfo *cp = &clinfo[cli];
+        if (cp->active && (cp->allprops || !dev[0]))
+            addRouteCl(cli, -1);
+    }
 
-        /* nothing for dp if not snooping for dev/name or wrong BLOB mode */
-        if (!sp)
-            continue;
-        if ((isblob && sp->blob == B_NEVER) || (!isblob && sp->blob == B_ONLY))
-            continue;
-        if (me && me->pid == REMOTEDVR && dp->pid == REMOTEDVR)
-        {
-            // Do not send snoop data to remote drivers at the same host
-            // since they will manage their own snoops remotely
-            if (!strcmp(me->host, dp->host) && me->port == dp->port)
-                continue;
-        }
+    if (!dev[0])
+        return (nroutecl);
 
-        /* ok: queue message to this device */
-        mp->count++;
-        pushFQ(dp->msgq, mp);
-        if (verbose > 1)
+    /* clients that want exactly dev/name */
+    for (rp = route[routeHash(dev, name)]; rp; rp = rp->next)
+    {
+        Property *pp = &clinfo[rp->cli].props[rp->pi];
+        if (!strcmp(pp->dev, dev) && !strcmp(pp->name, name))
+            addRouteCl(rp->cli, rp->pi);
+    }
+
+    /* clients that want all of dev */
+    if (name[0])
+    {
+        for (rp = route[routeHash(dev, "")]; rp; rp = rp->next)
         {
-            fprintf(stderr, "%s: Driver %s: queuing snooped <%s device='%s' name='%s'>\n", indi_tstamp(NULL), dp->name,
-                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+            Property *pp = &clinfo[rp->cli].props[rp->pi];
+            if (!pp->name[0] && !strcmp(pp->dev, dev))
+                addRouteCl(rp->cli, -1);
         }
     }
+
+    return (nroutecl);
 }
 
-/* add dev/name to dp's snooping list.
- * init with blob mode set to B_NEVER.
+/* return 0 if cp may be interested in dev/name else -1
  */
-static void addSDevice(DvrInfo *dp, const char *dev, const char *name)
+static int findClDevice(ClInfo *cp, const char *dev, const char *name)
 {
-    Property *sp;
-    char *ip;
+    int cli = cp - clinfo;
+
+    if (cp->allprops || !dev[0])
+        return (0);
+    if (findRoute(cli, dev, "") >= 0 || findRoute(cli, dev, name) >= 0)
+        return (0);
+    return (-1);
+}
+
+/* add the given device and property to the devs[] list of client if new.
+ */
+static void addClDevice(ClInfo *cp, const char *dev, const char *name, int isblob)
+{
+    Property *pp;
 
+    if (isblob)
+    {
+        if (findRoute(cp - clinfo, dev, name) >= 0)
+            return;
+    }
     /* no dups */
-    sp = findSDevice(dp, dev, name);
-    if (sp)
+    else if (!findClDevice(cp, dev, name))
         return;
 
-    /* add dev to sdevs list */
-    dp->sprops = (Property *)realloc(dp->sprops, (dp->nsprops + 1) * sizeof(Property));
-    sp         = &dp->sprops[dp->nsprops++];
+    /* add */
+    cp->props = (Property *)realloc(cp->props, (cp->nprops + 1) * sizeof(Property));
+    pp        = &cp->props[cp->nprops++];
 
-    ip = sp->dev;
-    strncpy(ip, dev, MAXINDIDEVICE - 1);
-    ip[MAXINDIDEVICE - 1] = '\0';
+    strncpy(pp->dev, dev, MAXINDIDEVICE - 1);
+    pp->dev[MAXINDIDEVICE - 1] = '\0';
+    strncpy(pp->name, name, MAXINDINAME - 1);
+    pp->name[MAXINDINAME - 1] = '\0';
+    pp->blob = B_NEVER;
 
-    ip = sp->name;
-    strncpy(ip, name, MAXINDINAME - 1);
-    ip[MAXINDINAME - 1] = '\0';
+    addRoute(cp - clinfo, cp->nprops - 1);
+}
 
-    sp->blob = B_NEVER;
+/* return the cache entry for dev/name, else NULL */
+static PCache *findPCache(const char *dev, const char *name)
+{
+    PCache *pc;
 
-    if (verbose)
-        fprintf(stderr, "%s: Driver %s: snooping on %s.%s\n", indi_tstamp(NULL), dp->name, dev, name);
+    for (pc = pcache[routeHash(dev, name)]; pc; pc = pc->next)
+        if (!strcmp(pc->name, name) && !strcmp(pc->dev, dev))
+            return (pc);
+    return (NULL);
 }
 
-/* return Property if dp is snooping dev/name, else NULL.
+/* note the given message from dp in pcache[]: a def*Vector replaces the
+ * entry for its property, a set*Vector updates it and delProperty removes
+ * those it names.
  */
-static Property *findSDevice(DvrInfo *dp, const char *dev, const char *name)
+static void cacheDvrMsg(DvrInfo *dp, XMLEle *root)
 {
-    int i;
+    char *roottag    = tagXMLEle(root);
+    const char *dev  = findXMLAttValu(root, "device");
+    const char *name = findXMLAttValu(root, "name");
+    unsigned int h;
+    PCache *pc;
 
-    for (i = 0; i < dp->nsprops; i++)
+    if (!strcmp(roottag, "delProperty"))
     {
-        Property *sp = &dp->sprops[i];
-        if (!strcmp(sp->dev, dev) && (!sp->name[0] || !strcmp(sp->name, name)))
-            return (sp);
+        if (dev[0])
+            flushPCache(-1, dev, name);
+        return;
+    }
+    if (!dev[0] || !name[0])
+        return;
+
+    if (!strncmp(roottag, "set", 3))
+    {
+        pc = findPCache(dev, name);
+        if (pc)
+            mergePCache(pc, root);
+        return;
     }
+    if (strncmp(roottag, "def", 3))
+        return;
 
-    return (NULL);
+    pc = findPCache(dev, name);
+    if (pc)
+    {
+        /* redefined, keep its place */
+        delXMLEle(pc->def);
+        if (pc->mp && --pc->mp->count == 0)
+            freeMsg(pc->mp);
+        pc->mp = NULL;
+        dvrinfo[pc->dvi].npcache--;
+    }
+    else
+    {
+        pc = (PCache *)calloc(1, sizeof(PCache));
+        if (!pc)
+        {
+            fprintf(stderr, "no memory for property cache\n");
+            Bye();
+        }
+        strncpy(pc->dev, dev, MAXINDIDEVICE - 1);
+        strncpy(pc->name, name, MAXINDINAME - 1);
+        h          = routeHash(dev, name);
+        pc->next   = pcache[h];
+        pcache[h]  = pc;
+        pc->lprev  = pctail;
+        if (pctail)
+            pctail->lnext = pc;
+        else
+            pchead = pc;
+        pctail = pc;
+    }
+
+    /* a message is only news once */
+    pc->def = cloneXMLEle(root);
+    rmXMLAtt(pc->def, "message");
+    pc->dvi = dp - dvrinfo;
+    dp->npcache++;
 }
 
-/* put Msg mp on queue of each client interested in dev/name, except notme.
- * if BLOB always honor current mode.
- * return -1 if had to shut down any clients, else 0.
+/* merge the values of set*Vector root into the def*Vector of pc.
+ * BLOB contents are not kept.
  */
-static int q2Clients(ClInfo *notme, int isblob, const char *dev, const char *name, Msg *mp, XMLEle *root)
+static void mergePCache(PCache *pc, XMLEle *root)
 {
-    int shutany = 0;
-    ClInfo *cp;
-    int ql, i = 0;
+    XMLEle *ep, *dep;
+    const char *name;
 
-    /* queue message to each interested client */
-    for (cp = clinfo; cp < &clinfo[nclinfo]; cp++)
+    mergeXMLAtt(pc->def, root, "state");
+    mergeXMLAtt(pc->def, root, "timeout");
+    mergeXMLAtt(pc->def, root, "timestamp");
+
+    for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
     {
-        /* cp in use? notme? want this dev/name? blob? */
-        if (!cp->active || cp == notme)
+        if (!strcmp(tagXMLEle(ep), "oneBLOB"))
             continue;
-        if (findClDevice(cp, dev, name) < 0)
+        name = findXMLAttValu(ep, "name");
+        for (dep = nextXMLEle(pc->def, 1); dep; dep = nextXMLEle(pc->def, 0))
+            if (!strcmp(findXMLAttValu(dep, "name"), name))
+                break;
+        if (!dep)
             continue;
+        editXMLEle(dep, pcdataXMLEle(ep));
+        mergeXMLAtt(dep, ep, "min");
+        mergeXMLAtt(dep, ep, "max");
+        mergeXMLAtt(dep, ep, "step");
+    }
 
-        //if ((isblob && cp->blob==B_NEVER) || (!isblob && cp->blob==B_ONLY))
-        if (!isblob && cp->blob == B_ONLY)
-            continue;
+    /* content is built again when next wanted */
+    if (pc->mp && --pc->mp->count == 0)
+        freeMsg(pc->mp);
+    pc->mp = NULL;
+}
 
-        if (isblob)
-        {
-            if (cp->nprops > 0)
-            {
-                Property *pp   = NULL;
-                int blob_found = 0;
-                for (i = 0; i < cp->nprops; i++)
-                {
-                    pp = &cp->props[i];
-                    if (!strcmp(pp->dev, dev) && (!strcmp(pp->name, name)))
-                    {
-                        blob_found = 1;
-                        break;
-                    }
-                }
+/* copy attribute name from element from to element to, if present */
+static void mergeXMLAtt(XMLEle *to, XMLEle *from, const char *name)
+{
+    XMLAtt *ap = findXMLAtt(from, name);
+    XMLAtt *tp;
 
-                if ((blob_found && pp->blob == B_NEVER) || (blob_found == 0 && cp->blob == B_NEVER))
-                    continue;
-            }
-            else if (cp->blob == B_NEVER)
-                continue;
-        }
+    if (!ap)
+        return;
+    tp = findXMLAtt(to, name);
+    if (tp)
+        editXMLAtt(tp, valuXMLAtt(ap));
+    else
+        addXMLAtt(to, name, valuXMLAtt(ap));
+}
 
-        /* shut down this client if its q is already too large */
-        ql = msgQSize(cp->msgq);
-        if (isblob && maxstreamsiz > 0 && ql > maxstreamsiz)
-        {
-            // Drop frames for streaming blobs
-            /* pull out each name/BLOB pair, decode */
-            XMLEle *ep      = NULL;
-            int streamFound = 0;
-            for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
-            {
-                if (strcmp(tagXMLEle(ep), "oneBLOB") == 0)
-                {
-                    XMLAtt *fa = findXMLAtt(ep, "format");
+/* remove the cache entries from dvrinfo[dvi] if dvi >= 0, else those for dev
+ * and, if given, name.
+ */
+static void flushPCache(int dvi, const char *dev, const char *name)
+{
+    PCache *pc, *lnext, **pp;
 
-                    if (fa && strstr(valuXMLAtt(fa), "stream"))
-                    {
-                        streamFound = 1;
-                        break;
-                    }
-                }
-            }
-            if (streamFound)
-            {
-                if (verbose > 1)
-                    fprintf(stderr, "%s: Client %d: %d bytes behind. Dropping stream BLOB...\n", indi_tstamp(NULL),
-                            cp->s, ql);
-                continue;
-            }
-        }
-        if (ql > maxqsiz)
-        {
-            if (verbose)
-                fprintf(stderr, "%s: Client %d: %d bytes behind, shutting down\n", indi_tstamp(NULL), cp->s, ql);
-            shutdownClient(cp);
-            shutany++;
+    for (pc = pchead; pc; pc = lnext)
+    {
+        lnext = pc->lnext;
+        if (dvi >= 0 ? pc->dvi != dvi : (strcmp(pc->dev, dev) || (name[0] && strcmp(pc->name, name))))
             continue;
-        }
 
-        /* ok: queue message to this client */
-        mp->count++;
-        pushFQ(cp->msgq, mp);
-        if (verbose > 1)
-            fprintf(stderr, "%s: Client %d: queuing <%s device='%s' name='%s'>\n", indi_tstamp(NULL), cp->s,
-                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
-    }
+        for (pp = &pcache[routeHash(pc->dev, pc->name)]; *pp != pc; pp = &(*pp)->next)
+            ;
+        *pp = pc->next;
+        if (pc->lprev)
+            pc->lprev->lnext = pc->lnext;
+        else
+            pchead = pc->lnext;
+        if (pc->lnext)
+            pc->lnext->lprev = pc->lprev;
+        else
+            pctail = pc->lprev;
 
-    return (shutany ? -1 : 0);
+        dvrinfo[pc->dvi].npcache--;
+        delXMLEle(pc->def);
+        if (pc->mp && --pc->mp->count == 0)
+            freeMsg(pc->mp);
+        free(pc);
+    }
 }
 
-/* put Msg mp on queue of each chained server client, except notme.
-  * return -1 if had to shut down any clients, else 0.
+/* answer getProperties root from client cp for dev/name from pcache[] as far
+ * as possible. a generic request is still sent as mp to each driver with no
+ * properties cached yet. the answers are queued as q2Clients() would, so a
+ * client that takes only BLOBs gets none and one too far behind is shut down.
+ * return 1 if done, 0 if nothing is known so the drivers must be asked, or
+ * -1 if cp had to be shut down.
  */
-static int q2Servers(DvrInfo *me, Msg *mp, XMLEle *root)
+static int answerPCache(ClInfo *cp, const char *dev, const char *name, Msg *mp, XMLEle *root)
 {
-    int shutany = 0, i = 0, devFound = 0;
-    ClInfo *cp;
-    int ql = 0;
+    DvrInfo *dp;
+    PCache *pc;
+    int n = 0;
+    int ql;
 
-    /* queue message to each interested client */
-    for (cp = clinfo; cp < &clinfo[nclinfo]; cp++)
+    for (pc = pchead; pc; pc = pc->lnext)
     {
-        /* cp in use? not chained server? */
-        if (!cp->active || cp->allprops == 1)
+        if (dev[0] && (strcmp(pc->dev, dev) || (name[0] && strcmp(pc->name, name))))
             continue;
-
-        // Only send the message to the upstream server that is connected specfically to the device in driver dp
-        for (i = 0; i < cp->nprops; i++)
-        {
-            Property *pp = &cp->props[i];
-            int j        = 0;
-            for (j = 0; j < me->ndev; j++)
-            {
-                if (!strcmp(pp->dev, me->dev[j]))
-                    break;
-            }
-
-            if (j != me->ndev)
-            {
-                devFound = 1;
-                break;
-            }
-        }
-
-        // If no matching device found, continue
-        if (devFound == 0)
+        n++;
+        if (cp->blob == B_ONLY)
             continue;
 
-        /* shut down this client if its q is already too large */
-        ql = msgQSize(cp->msgq);
+        ql = clQSize(cp);
         if (ql > maxqsiz)
         {
             if (verbose)
                 fprintf(stderr, "%s: Client %d: %d bytes behind, shutting down\n", indi_tstamp(NULL), cp->s, ql);
-            shutdownClient(cp);
-            shutany++;
-            continue;
+            shutdownClient(cp, SD_QUEUE);
+            return (-1);
+        }
+
+        if (!pc->mp)
+        {
+            pc->mp = newMsg();
+            if (!pc->mp)
+                continue;
+            pc->mp->count = 1; /* ours */
         }
-
-        /* ok: queue message to this client */
-        mp->count++;
-        pushFQ(cp->msgq, mp);
-        if (verbose > 1)
-            fprintf(stderr, "%s: Client %d: queuing <%s device='%s' name='%s'>\n", indi_tstamp(NULL), cp->s,
-                    tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name"));
+        pushClMsg(cp, pc->mp, pc->def, MQ_CTRL);
     }
 
-    return (shutany ? -1 : 0);
+    if (dev[0])
+        return (n > 0);
+
+    for (dp = dvrinfo; dp < &dvrinfo[ndvrinfo]; dp++)
+        if (dp->active && !dp->npcache)
+            pushDvrMsg(dp, mp, root);
+    return (1);
 }
 
-/* return size of all Msqs on the given q */
-static int msgQSize(FQ *q)
+/* block to accept a new client arriving on lsocket.
+ * return private nonblocking socket or exit.
+ */
+static int newClSocket()
 {
-    int i, l = 0;
+    struct sockaddr_in cli_socket;
+    socklen_t cli_len;
+    int cli_fd;
 
-    for (i = 0; i < nFQ(q); i++)
+    /* get a private connection to new client */
+    cli_len = sizeof(cli_socket);
+    cli_fd  = accept(lsocket, (struct sockaddr *)&cli_socket, &cli_len);
+    if (cli_fd < 0)
     {
-        Msg *mp = (Msg *)peekiFQ(q, i);
-        l += mp->cl;
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        Bye();
     }
 
-    return (l);
-}
-
-/* print root as content in Msg mp.
- */
-static void setMsgXMLEle(Msg *mp, XMLEle *root)
-{
-    /* want cl to only count content, but need room for final \0 */
-    mp->cl = sprlXMLEle(root, 0);
-    if (mp->cl < sizeof(mp->buf))
-        mp->cp = mp->buf;
-    else
-        mp->cp = malloc(mp->cl + 1);
-    sprXMLEle(mp->cp, root, 0);
-}
-
-/* save str as content in Msg mp.
- */
-static void setMsgStr(Msg *mp, char *str)
-{
-    /* want cl to only count content, but need room for final \0 */
-    mp->cl = strlen(str);
-    if (mp->cl < sizeof(mp->buf))
-        mp->cp = mp->buf;
-    else
-        mp->cp = malloc(mp->cl + 1);
-    strcpy(mp->cp, str);
+    /* ok */
+    return (cli_fd);
 }
 
-/* return pointer to one new nulled Msg
+/* create the metrics endpoint msocket on mport.
+ * exit if trouble.
  */
-static Msg *newMsg(void)
-{
-    return ((Msg *)calloc(1, sizeof(Msg)));
-}
-
-/* free Msg mp and everything it contains */
-static void freeMsg(Msg *mp)
+static void metricsListen(void)
 {
-    if (mp->cp && mp->cp != mp->buf)
-        free(mp->cp);
-    free(mp);
+    msocket = openListen(mport);
+    watchFd(msocket, IO_MLISTEN, 0, IO_RD);
+    if (verbose > 0)
+        fprintf(stderr, "%s: metrics on port %d on fd %d\n", indi_tstamp(NULL), mport, msocket);
 }
 
-/* write the next chunk of the current message in the queue to the given
- * client. pop message from queue when complete and free the message if we are
- * the last one to use it. shut down this client if trouble.
- * N.B. we assume we will never be called with cp->msgq empty.
- * return 0 if ok else -1 if had to shut down.
- */
-static int sendClientMsg(ClInfo *cp)
+/* accept a connection to msocket, nonblocking, and watch for its request */
+static void newMetricsClient(void)
 {
-    ssize_t nsend, nw;
-    Msg *mp;
-
-    /* get current message */
-    mp = (Msg *)peekFQ(cp->msgq);
+    MetricsCl *mp = NULL;
+    int s, i;
 
-    /* send next chunk, never more than MAXWSIZ to reduce blocking */
-    nsend = mp->cl - cp->nsent;
-    if (nsend > MAXWSIZ)
-        nsend = MAXWSIZ;
-    nw = write(cp->s, &mp->cp[cp->nsent], nsend);
-
-    /* shut down if trouble */
-    if (nw <= 0)
+    s = accept(msocket, NULL, NULL);
+    if (s < 0)
     {
-        if (nw == 0)
-            fprintf(stderr, "%s: Client %d: write returned 0\n", indi_tstamp(NULL), cp->s);
-        else
-            fprintf(stderr, "%s: Client %d: write: %s\n", indi_tstamp(NULL), cp->s, strerror(errno));
-        shutdownClient(cp);
-        return (-1);
+        fprintf(stderr, "%s: metrics accept: %s\n", indi_tstamp(NULL), strerror(errno));
+        return;
     }
 
-    /* trace */
-    if (verbose > 2)
+    /* find a free slot, else turn it away */
+    for (i = 0; i < MAXMETRICSCL; i++)
     {
-        fprintf(stderr, "%s: Client %d: sending msg copy %d nq %d:\n%.*s\n", indi_tstamp(NULL), cp->s, mp->count,
-                nFQ(cp->msgq), (int)nw, &mp->cp[cp->nsent]);
+        if (!mclinfo[i].active)
+        {
+            mp = &mclinfo[i];
+            break;
+        }
     }
-    else if (verbose > 1)
+    if (!mp)
     {
-        fprintf(stderr, "%s: Client %d: sending %.50s\n", indi_tstamp(NULL), cp->s, &mp->cp[cp->nsent]);
+        if (verbose > 0)
+            fprintf(stderr, "%s: metrics: too many connections\n", indi_tstamp(NULL));
+        close(s);
+        return;
     }
 
-    /* update amount sent. when complete: free message if we are the last
-     * to use it and pop from our queue.
-     */
-    cp->nsent += nw;
-    if (cp->nsent == mp->cl)
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    memset(mp, 0, sizeof(*mp));
+    mp->active = 1;
+    mp->s      = s;
+    watchFd(s, IO_METRICS, i, IO_RD);
+}
+
+/* read the HTTP request on metrics connection mp and, whatever was asked
+ * for, queue all metrics as the answer and watch to send it.
+ * return -1 if mp was closed, else 0.
+ */
+static int readMetrics(MetricsCl *mp)
+{
+    MText body = { NULL, 0, 0 };
+    char req[2048];
+    ssize_t nr;
+
+    /* just drain the request */
+    nr = read(mp->s, req, sizeof(req));
+    if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+        return (0);
+    if (nr <= 0)
     {
-        if (--mp->count == 0)
-            freeMsg(mp);
-        popFQ(cp->msgq);
-        cp->nsent = 0;
+        closeMetricsClient(mp);
+        return (-1);
     }
 
+    prMetrics(&body);
+    mtprintf(&mp->mt,
+             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %lu\r\nConnection: close\r\n\r\n%s",
+             (unsigned long)body.len, body.s ? body.s : "");
+    free(body.s);
+
+    /* done reading, now just send */
+    watchFd(mp->s, IO_METRICS, (int)(mp - mclinfo), IO_WR);
     return (0);
 }
 
-/* write the next chunk of the current message in the queue to the given
- * driver. pop message from queue when complete and free the message if we are
- * the last one to use it. restart this driver if touble.
- * N.B. we assume we will never be called with dp->msgq empty.
- * return 0 if ok else -1 if had to shut down.
+/* send more of the answer queued on metrics connection mp, closing it once
+ * all is sent or if trouble.
  */
-static int sendDriverMsg(DvrInfo *dp)
+static void sendMetrics(MetricsCl *mp)
 {
-    ssize_t nsend, nw;
-    Msg *mp;
+    ssize_t nw;
 
-    /* get current message */
-    mp = (Msg *)peekFQ(dp->msgq);
-
-    /* send next chunk, never more than MAXWSIZ to reduce blocking */
-    nsend = mp->cl - dp->nsent;
-    if (nsend > MAXWSIZ)
-        nsend = MAXWSIZ;
-    nw = write(dp->wfd, &mp->cp[dp->nsent], nsend);
+    nw = write(mp->s, mp->mt.s + mp->nsent, mp->mt.len - mp->nsent);
+    if (nw < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (nw > 0)
+        mp->nsent += nw;
+    if (nw <= 0 || mp->nsent == mp->mt.len)
+        closeMetricsClient(mp);
+}
 
-    /* restart if trouble */
-    if (nw <= 0)
-    {
-        if (nw == 0)
-            fprintf(stderr, "%s: Driver %s: write returned 0\n", indi_tstamp(NULL), dp->name);
-        else
-            fprintf(stderr, "%s: Driver %s: write: %s\n", indi_tstamp(NULL), dp->name, strerror(errno));
-        shutdownDvr(dp, 1);
-        return (-1);
-    }
+/* stop watching, close and free metrics connection mp */
+static void closeMetricsClient(MetricsCl *mp)
+{
+    unwatchFd(mp->s);
+    close(mp->s);
+    free(mp->mt.s);
+    memset(mp, 0, sizeof(*mp));
+}
 
-    /* trace */
-    if (verbose > 2)
-    {
-        fprintf(stderr, "%s: Driver %s: sending msg copy %d nq %d:\n%.*s\n", indi_tstamp(NULL), dp->name, mp->count,
-                nFQ(dp->msgq), (int)nw, &mp->cp[dp->nsent]);
-    }
-    else if (verbose > 1)
-    {
-        fprintf(stderr, "%s: Driver %s: sending %.50s\n", indi_tstamp(NULL), dp->name, &mp->cp[dp->nsent]);
-    }
+/* print all metrics to mt in the Prometheus text format */
+static void prMetrics(MText *mt)
+{
+    static const char *mqname[NMQ] = { "ctrl", "blob", "stream" };
+    unsigned long long cum = 0, ndrops;
+    char lbl[2 * MAXINDINAME];
+    int i, n;
+
+    for (i = n = 0; i < nclinfo; i++)
+        n += clinfo[i].active;
+    mtprintf(mt, "# HELP indiserver_clients Clients connected.\n# TYPE indiserver_clients gauge\n");
+    mtprintf(mt, "indiserver_clients %d\n", n);
+
+    prTraffic(mt, "read_bytes_total", "Bytes read from", offsetof(Traffic, nrbytes), 0);
+    prTraffic(mt, "read_messages_total", "Messages read from", offsetof(Traffic, nrmsgs), 0);
+    prTraffic(mt, "written_bytes_total", "Bytes written to", offsetof(Traffic, nwbytes), 0);
+    prTraffic(mt, "written_messages_total", "Messages written to", offsetof(Traffic, nwmsgs), 0);
+    prTraffic(mt, "dropped_stream_blobs_total", "Stream BLOBs dropped as too far behind for",
+              offsetof(Traffic, ndrops), 1);
+
+    mtprintf(mt, "# HELP indiserver_cached_getproperties_total getProperties answered without asking drivers.\n");
+    mtprintf(mt, "# TYPE indiserver_cached_getproperties_total counter\n");
+    mtprintf(mt, "indiserver_cached_getproperties_total %llu\n", pchits);
+
+    mtprintf(mt, "# HELP indiserver_client_queue_bytes Bytes queued to each client.\n");
+    mtprintf(mt, "# TYPE indiserver_client_queue_bytes gauge\n");
+    for (i = 0; i < nclinfo; i++)
+        for (n = 0; clinfo[i].active && n < NMQ; n++)
+            mtprintf(mt, "indiserver_client_queue_bytes{client=\"%lu\",class=\"%s\"} %lu\n", clinfo[i].seq,
+                     mqname[n], clinfo[i].qsize[n]);
+    mtprintf(mt, "# HELP indiserver_client_queue_messages Messages queued to each client.\n");
+    mtprintf(mt, "# TYPE indiserver_client_queue_messages gauge\n");
+    for (i = 0; i < nclinfo; i++)
+        for (n = 0; clinfo[i].active && n < NMQ; n++)
+            mtprintf(mt, "indiserver_client_queue_messages{client=\"%lu\",class=\"%s\"} %d\n", clinfo[i].seq,
+                     mqname[n], nFQ(clinfo[i].msgq[n]));
 
-    /* update amount sent. when complete: free message if we are the last
-     * to use it and pop from our queue.
-     */
-    dp->nsent += nw;
-    if (dp->nsent == mp->cl)
+    mtprintf(mt, "# HELP indiserver_driver_queue_bytes Bytes queued to each driver.\n");
+    mtprintf(mt, "# TYPE indiserver_driver_queue_bytes gauge\n");
+    for (i = 0; i < ndvrinfo; i++)
+        if (dvrinfo[i].active)
+            mtprintf(mt, "indiserver_driver_queue_bytes{driver=\"%s\"} %lu\n", mtlabel(dvrinfo[i].name, lbl),
+                     dvrinfo[i].qsize);
+    mtprintf(mt, "# HELP indiserver_driver_queue_messages Messages queued to each driver.\n");
+    mtprintf(mt, "# TYPE indiserver_driver_queue_messages gauge\n");
+    for (i = 0; i < ndvrinfo; i++)
+        if (dvrinfo[i].active)
+            mtprintf(mt, "indiserver_driver_queue_messages{driver=\"%s\"} %d\n", mtlabel(dvrinfo[i].name, lbl),
+                     nFQ(dvrinfo[i].msgq));
+    mtprintf(mt, "# HELP indiserver_driver_restarts_total Times each driver has been restarted.\n");
+    mtprintf(mt, "# TYPE indiserver_driver_restarts_total counter\n");
+    for (i = 0; i < ndvrinfo; i++)
+        mtprintf(mt, "indiserver_driver_restarts_total{driver=\"%s\"} %d\n", mtlabel(dvrinfo[i].name, lbl),
+                 dvrinfo[i].restarts);
+
+    mtprintf(mt, "# HELP indiserver_client_shutdowns_total Clients shut down, by reason.\n");
+    mtprintf(mt, "# TYPE indiserver_client_shutdowns_total counter\n");
+    for (i = 0; i < NSD; i++)
+        mtprintf(mt, "indiserver_client_shutdowns_total{reason=\"%s\"} %llu\n", shutwhy[i], clshut[i]);
+    mtprintf(mt, "# HELP indiserver_driver_shutdowns_total Drivers shut down, by reason.\n");
+    mtprintf(mt, "# TYPE indiserver_driver_shutdowns_total counter\n");
+    for (i = 0; i < NSD; i++)
+        mtprintf(mt, "indiserver_driver_shutdowns_total{reason=\"%s\"} %llu\n", shutwhy[i], dvshut[i]);
+
+    pthread_mutex_lock(&logq.lock);
+    n      = logq.n;
+    ndrops = logq.ndrops;
+    pthread_mutex_unlock(&logq.lock);
+    mtprintf(mt, "# HELP indiserver_log_queue_lines Lines waiting to be logged.\n");
+    mtprintf(mt, "# TYPE indiserver_log_queue_lines gauge\n");
+    mtprintf(mt, "indiserver_log_queue_lines %d\n", n);
+    mtprintf(mt, "# HELP indiserver_log_dropped_lines_total Lines dropped as logging fell behind.\n");
+    mtprintf(mt, "# TYPE indiserver_log_dropped_lines_total counter\n");
+    mtprintf(mt, "indiserver_log_dropped_lines_total %llu\n", ndrops);
+
+    mtprintf(mt, "# HELP indiserver_driver_parse_seconds Time to parse each read from a driver.\n");
+    mtprintf(mt, "# TYPE indiserver_driver_parse_seconds histogram\n");
+    for (i = 0; i <= NPARSEBKT; i++)
     {
-        if (--mp->count == 0)
-            freeMsg(mp);
-        popFQ(dp->msgq);
-        dp->nsent = 0;
+        cum += __atomic_load_n(&parsehist[i], __ATOMIC_RELAXED);
+        if (i < NPARSEBKT)
+            mtprintf(mt, "indiserver_driver_parse_seconds_bucket{le=\"%g\"} %llu\n", parsebkt[i] / 1e9, cum);
+        else
+            mtprintf(mt, "indiserver_driver_parse_seconds_bucket{le=\"+Inf\"} %llu\n", cum);
     }
-
-    return (0);
+    mtprintf(mt, "indiserver_driver_parse_seconds_sum %.9f\n", __atomic_load_n(&parsens, __ATOMIC_RELAXED) / 1e9);
+    mtprintf(mt, "indiserver_driver_parse_seconds_count %llu\n", cum);
 }
 
-/* return 0 if cp may be interested in dev/name else -1
+/* print the Traffic counter at off of each client and, unless clonly, each
+ * driver as metrics indiserver_client_<name> and indiserver_driver_<name>.
  */
-static int findClDevice(ClInfo *cp, const char *dev, const char *name)
+static void prTraffic(MText *mt, const char *name, const char *help, size_t off, int clonly)
 {
+    char lbl[2 * MAXINDINAME];
     int i;
 
-    if (cp->allprops || !dev[0])
-        return (0);
-    for (i = 0; i < cp->nprops; i++)
-    {
-        Property *pp = &cp->props[i];
-        if (!strcmp(pp->dev, dev) && (!pp->name[0] || !strcmp(pp->name, name)))
-            return (0);
-    }
-    return (-1);
+    mtprintf(mt, "# HELP indiserver_client_%s %s each client.\n", name, help);
+    mtprintf(mt, "# TYPE indiserver_client_%s counter\n", name);
+    for (i = 0; i < nclinfo; i++)
+        if (clinfo[i].active)
+            mtprintf(mt, "indiserver_client_%s{client=\"%lu\"} %llu\n", name, clinfo[i].seq,
+                     *(unsigned long long *)((char *)&clinfo[i].tr + off));
+
+    if (clonly)
+        return;
+
+    mtprintf(mt, "# HELP indiserver_driver_%s %s each driver.\n", name, help);
+    mtprintf(mt, "# TYPE indiserver_driver_%s counter\n", name);
+    for (i = 0; i < ndvrinfo; i++)
+        mtprintf(mt, "indiserver_driver_%s{driver=\"%s\"} %llu\n", name, mtlabel(dvrinfo[i].name, lbl),
+                 *(unsigned long long *)((char *)&dvrinfo[i].tr + off));
 }
 
-/* add the given device and property to the devs[] list of client if new.
+/* append printf-style text to mt. if no memory for more, mt keeps what it
+ * had so it still ends with the last whole line.
  */
-static void addClDevice(ClInfo *cp, const char *dev, const char *name, int isblob)
+static void mtprintf(MText *mt, const char *fmt, ...)
 {
-    Property *pp;
-    //char *ip;
-    int i = 0;
+    va_list ap;
+    int n;
 
-    if (isblob)
+    while (1)
     {
-        for (i = 0; i < cp->nprops; i++)
+        size_t newsize;
+        char *news;
+
+        va_start(ap, fmt);
+        n = vsnprintf(mt->s + mt->len, mt->size - mt->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (mt->len + n < mt->size)
+            break;
+        newsize = mt->size * 2 > mt->len + n + 1 ? mt->size * 2 : mt->len + n + 1024;
+        news    = (char *)realloc(mt->s, newsize);
+        if (!news)
         {
-            Property *pp = &cp->props[i];
-            if (!strcmp(pp->dev, dev) && (name == NULL || !strcmp(pp->name, name)))
-                return;
+            if (mt->s)
+                mt->s[mt->len] = '\0';
+            return;
         }
+        mt->s    = news;
+        mt->size = newsize;
     }
-    /* no dups */
-    else if (!findClDevice(cp, dev, name))
-        return;
+    mt->len += n;
+}
 
-    /* add */
-    cp->props = (Property *)realloc(cp->props, (cp->nprops + 1) * sizeof(Property));
-    pp        = &cp->props[cp->nprops++];
+/* copy s to buf escaped as a metrics label value: \, " and newline get a
+ * backslash. buf must hold 2*MAXINDINAME. return buf.
+ */
+static char *mtlabel(const char *s, char *buf)
+{
+    char *bp = buf;
 
-    /*ip = pp->dev;
-    strncpy (ip, dev, MAXINDIDEVICE-1);
-    ip[MAXINDIDEVICE-1] = '\0';
+    for (; *s && bp < buf + 2 * MAXINDINAME - 2; s++)
+    {
+        if (*s == '\\' || *s == '"')
+            *bp++ = '\\', *bp++ = *s;
+        else if (*s == '\n')
+            *bp++ = '\\', *bp++ = 'n';
+        else
+            *bp++ = *s;
+    }
+    *bp = '\0';
+    return (buf);
+}
 
-    ip = pp->name;
-    strncpy (ip, name, MAXINDINAME-1);
-        ip[MAXINDINAME-1] = '\0';*/
+/* return a monotonic time in ns if keeping metrics, else 0 */
+static unsigned long long metricsClock(void)
+{
+    struct timespec ts;
 
-    strncpy(pp->dev, dev, MAXINDIDEVICE);
-    strncpy(pp->name, name, MAXINDINAME);
-    pp->blob = B_NEVER;
+    if (mport <= 0)
+        return (0);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
 }
 
-/* block to accept a new client arriving on lsocket.
- * return private nonblocking socket or exit.
+/* add the time since t0 from metricsClock() to the parse time histogram.
+ * safe to call from any thread.
  */
-static int newClSocket()
+static void noteParseTime(unsigned long long t0)
 {
-    struct sockaddr_in cli_socket;
-    socklen_t cli_len;
-    int cli_fd;
+    unsigned long long dt;
+    int i;
 
-    /* get a private connection to new client */
-    cli_len = sizeof(cli_socket);
-    cli_fd  = accept(lsocket, (struct sockaddr *)&cli_socket, &cli_len);
-    if (cli_fd < 0)
-    {
-        fprintf(stderr, "accept: %s\n", strerror(errno));
-        Bye();
-    }
+    if (!t0)
+        return;
 
-    /* ok */
-    return (cli_fd);
+    dt = metricsClock() - t0;
+    for (i = 0; i < NPARSEBKT && dt > parsebkt[i]; i++)
+        ;
+    __atomic_fetch_add(&parsehist[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&parsens, dt, __ATOMIC_RELAXED);
 }
 
 /* convert the string value of enableBLOB to our B_ state value.
@@ -2075,26 +4923,22 @@ static void crackBLOBHandling(const char *dev, const char *name, const char *ena
 {
     int i = 0;
 
-    /* If we have EnableBLOB with property name, we add it to Client device list */
+    /* If we have EnableBLOB with property name, we add it to Client device list
+       and apply the policy to it */
     if (name[0])
+    {
         addClDevice(cp, dev, name, 1);
-    else
-        /* Otherwise, we set the whole client blob handling to what's passed (enableBLOB) */
-        crackBLOB(enableBLOB, &cp->blob);
+        i = findRoute(cp - clinfo, dev, name);
+        if (i >= 0)
+            crackBLOB(enableBLOB, &cp->props[i].blob);
+        return;
+    }
 
-    /* If whole client blob handling policy was updated, we need to pass that also to all children
-       and if the request was for a specific property, then we apply the policy to it */
+    /* Otherwise, we set the whole client blob handling to what's passed (enableBLOB)
+       and we need to pass that also to all children */
+    crackBLOB(enableBLOB, &cp->blob);
     for (i = 0; i < cp->nprops; i++)
-    {
-        Property *pp = &cp->props[i];
-        if (!name[0])
-            crackBLOB(enableBLOB, &pp->blob);
-        else if (!strcmp(pp->dev, dev) && (!strcmp(pp->name, name)))
-        {
-            crackBLOB(enableBLOB, &pp->blob);
-            return;
-        }
-    }
+        crackBLOB(enableBLOB, &cp->props[i].blob);
 }
 
 /* print key attributes and values of the given xml to stderr.
@@ -2130,22 +4974,23 @@ static void traceMsg(XMLEle *root)
     fprintf(stderr, "\n");
 }
 
-/* fill s with current UT string.
+/* fill s, of at least 64 chars, with current UT string.
  * if no s, use a static buffer
  * return s or buffer.
- * N.B. if use our buffer, be sure to use before calling again
+ * N.B. if use our buffer, be sure to use before calling again. only the main
+ *   thread may do so, other threads must pass their own s.
  */
 static char *indi_tstamp(char *s)
 {
     static char sbuf[64];
-    struct tm *tp;
+    struct tm tm;
     time_t t;
 
     time(&t);
-    tp = gmtime(&t);
+    gmtime_r(&t, &tm);
     if (!s)
         s = sbuf;
-    strftime(s, sizeof(sbuf), "%Y-%m-%dT%H:%M:%S", tp);
+    strftime(s, sizeof(sbuf), "%Y-%m-%dT%H:%M:%S", &tm);
     return (s);
 }
 
@@ -2154,9 +4999,8 @@ static char *indi_tstamp(char *s)
 static void logDMsg(XMLEle *root, const char *dev)
 {
     char stamp[64];
-    char logfn[1024];
+    char day[11];
     const char *ts, *ms;
-    FILE *fp;
 
     /* get message, if any */
     ms = findXMLAttValu(root, "message");
@@ -2172,17 +5016,161 @@ static void logDMsg(XMLEle *root, const char *dev)
     }
 
     /* append to log file, name is date portion of time stamp */
-    sprintf(logfn, "%s/%.10s.islog", ldir, ts);
-    fp = fopen(logfn, "a");
-    if (!fp)
-        return; /* oh well */
-    fprintf(fp, "%s: %s: %s\n", ts, dev, ms);
-    fclose(fp);
+    snprintf(day, sizeof(day), "%.10s", ts);
+    logLine(day, "%s: %s: %s\n", ts, dev, ms);
+}
+
+/* start the thread that writes driver stderr and the -l logs.
+ * exit if trouble.
+ */
+static void startLogger(void)
+{
+    pthread_mutex_init(&logq.lock, NULL);
+    pthread_cond_init(&logq.cond, NULL);
+    if (pthread_create(&logq.tid, NULL, logger, NULL) != 0)
+    {
+        fprintf(stderr, "%s: logging thread: %s\n", indi_tstamp(NULL), strerror(errno));
+        Bye();
+    }
+    logging = 1;
+}
+
+/* logging thread: write each batch of lines from logq to stderr or the day's
+ * file in ldir, keeping the file open until the day changes. if no memory for
+ * a batch they are taken one at a time.
+ */
+static void *logger(void *arg)
+{
+    LogLine one;
+    LogLine *batch = (LogLine *)malloc(NLOGQ * sizeof(LogLine));
+    int maxbatch   = batch ? NLOGQ : 1;
+    unsigned long long ndrops = 0, nd;
+    char day[sizeof(one.day)] = "";
+    char logfn[1024];
+    char ts[64];
+    FILE *fp = NULL;
+    int i, n, quit;
+
+    (void)arg;
+    if (!batch)
+        batch = &one;
+    while (1)
+    {
+        /* take all waiting, or as many as batch holds */
+        pthread_mutex_lock(&logq.lock);
+        while (logq.n == 0 && !logq.quit)
+            pthread_cond_wait(&logq.cond, &logq.lock);
+        for (n = 0; logq.n > 0 && n < maxbatch; n++)
+        {
+            batch[n]  = logq.q[logq.head];
+            logq.head = (logq.head + 1) % NLOGQ;
+            logq.n--;
+            logq.bytes -= batch[n].len;
+        }
+        nd   = logq.ndrops;
+        quit = logq.quit && logq.n == 0;
+        pthread_mutex_unlock(&logq.lock);
+
+        /* write them */
+        if (nd != ndrops)
+        {
+            fprintf(stderr, "%s: logging fell behind, %llu lines dropped\n", indi_tstamp(ts), nd - ndrops);
+            ndrops = nd;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (!batch[i].day[0])
+                fwrite(batch[i].s, 1, batch[i].len, stderr);
+            else
+            {
+                if (!fp || strcmp(day, batch[i].day))
+                {
+                    if (fp)
+                        fclose(fp);
+                    strcpy(day, batch[i].day);
+                    snprintf(logfn, sizeof(logfn), "%s/%s.islog", ldir, day);
+                    fp = fopen(logfn, "a"); /* oh well if fails */
+                }
+                if (fp)
+                    fwrite(batch[i].s, 1, batch[i].len, fp);
+            }
+            free(batch[i].s);
+        }
+        if (fp)
+            fflush(fp);
+        fflush(stderr);
+
+        if (quit)
+            break;
+    }
+
+    if (fp)
+        fclose(fp);
+    if (batch != &one)
+        free(batch);
+    return (NULL);
+}
+
+/* queue one printf-style line for the logging thread to write to stderr, or
+ * to the -l log file for day if not empty. if it is too far behind, or there
+ * is no memory, the line is dropped and counted.
+ */
+static void logLine(const char *day, const char *fmt, ...)
+{
+    char buf[MAXRBUF + 256];
+    LogLine *lp;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+
+    /* write directly if no thread yet */
+    if (!logging)
+    {
+        fwrite(buf, 1, len, stderr);
+        return;
+    }
+
+    pthread_mutex_lock(&logq.lock);
+    lp = &logq.q[(logq.head + logq.n) % NLOGQ];
+    if (logq.n == NLOGQ || logq.bytes + len > MAXLOGQ || !(lp->s = (char *)malloc(len + 1)))
+        logq.ndrops++;
+    else
+    {
+        memcpy(lp->s, buf, len);
+        lp->s[len] = '\0';
+        lp->len    = len;
+        snprintf(lp->day, sizeof(lp->day), "%s", day);
+        if (logq.n++ == 0)
+            pthread_cond_signal(&logq.cond);
+        logq.bytes += len;
+    }
+    pthread_mutex_unlock(&logq.lock);
+}
+
+/* write all lines still queued and stop the logging thread */
+static void stopLogger(void)
+{
+    if (!logging)
+        return;
+    pthread_mutex_lock(&logq.lock);
+    logq.quit = 1;
+    pthread_cond_signal(&logq.cond);
+    pthread_mutex_unlock(&logq.lock);
+    pthread_join(logq.tid, NULL);
+    logging = 0;
 }
 
 /* log when then exit */
 static void Bye()
 {
+    stopLogger();
     fprintf(stderr, "%s: good bye\n", indi_tstamp(NULL));
     exit(1);
 }
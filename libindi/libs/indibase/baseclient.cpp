@@ -23,6 +23,7 @@
 #include "basedevice.h"
 #include "locale_compat.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <fcntl.h>
 #include <cstdlib>
@@ -53,6 +54,7 @@
 #endif
 
 #define MAXINDIBUF 49152
+#define MAXB64HINT (4L * 1024 * 1024) /* most room taken for a BLOB before its bytes arrive */
 
 INDI::BaseClient::BaseClient()
 {
@@ -63,6 +65,17 @@ INDI::BaseClient::BaseClient()
 
     timeout_sec = 3;
     timeout_us  = 0;
+
+    binaryBLOBs = false;
+    binRoot     = nullptr;
+    binIndex    = 0;
+    binRead     = 0;
+
+    b64Ele  = nullptr;
+    b64Buf  = nullptr;
+    b64Size = 0;
+    b64Len  = 0;
+    b64NQ   = 0;
 }
 
 INDI::BaseClient::~BaseClient()
@@ -354,32 +367,30 @@ void INDI::BaseClient::listenINDI()
 {
     char buffer[MAXINDIBUF];
     char msg[MAXRBUF];
-    int n = 0, err_code = 0;
+    int n = 0;
 #ifdef _WINDOWS
     SOCKET maxfd = 0;
 #else
     int maxfd = 0;
 #endif
     fd_set rs;
-    XMLEle **nodes = nullptr;
-    XMLEle *root = nullptr;
-    int inode = 0;
+    const char *blobs = binaryBLOBs ? " blobs='binary'" : "";
 
     AutoCNumeric locale;
 
     if (cDeviceNames.empty())
     {
-        sendString("<getProperties version='%g'/>\n", INDIV);
+        sendString("<getProperties version='%g'%s/>\n", INDIV, blobs);
         if (verbose)
-            fprintf(stderr, "<getProperties version='%g'/>\n", INDIV);
+            fprintf(stderr, "<getProperties version='%g'%s/>\n", INDIV, blobs);
     }
     else
     {
         for (auto& str : cDeviceNames)
         {
-            sendString("<getProperties version='%g' device='%s'/>\n", INDIV, str.c_str());
+            sendString("<getProperties version='%g' device='%s'%s/>\n", INDIV, str.c_str(), blobs);
             if (verbose)
-                IDLog("<getProperties version='%g' device='%s'/>\n", INDIV, str.c_str());
+                IDLog("<getProperties version='%g' device='%s'%s/>\n", INDIV, str.c_str(), blobs);
         }
     }
 
@@ -398,7 +409,15 @@ void INDI::BaseClient::listenINDI()
 #endif
 
     clear();
-    lillp = newLilXML();
+    static const XMLHandler handlers = { startXML, pcdataXML, endXML };
+
+    lillp   = newLilXML();
+    useArenaLilXML(lillp, 1);
+    setSAXLilXML(lillp, &handlers, this);
+    binRoot = nullptr;
+    b64Ele  = nullptr;
+    binBLOBs.clear();
+    xmlHold.clear();
 
     /* read from server, exit if find all requested properties */
     while (sConnected)
@@ -423,10 +442,20 @@ void INDI::BaseClient::listenINDI()
 
         if (n > 0 && FD_ISSET(sockfd, &rs))
         {
+            char *buf = buffer;
+            int size  = MAXINDIBUF;
+
+            // Read the rest of a large binary BLOB straight into place
+            if (binRoot && binBLOBs[binIndex].second - binRead > MAXINDIBUF)
+            {
+                buf  = binBLOBs[binIndex].first + binRead;
+                size = binBLOBs[binIndex].second - binRead;
+            }
+
 #ifdef _WINDOWS
-            n = recv(sockfd, buffer, MAXINDIBUF, 0);
+            n = recv(sockfd, buf, size, 0);
 #else
-            n = recv(sockfd, buffer, MAXINDIBUF, MSG_DONTWAIT);
+            n = recv(sockfd, buf, size, MSG_DONTWAIT);
 #endif
             if (n <= 0)
             {
@@ -440,43 +469,25 @@ void INDI::BaseClient::listenINDI()
                     continue;
             }
 
-            nodes = parseXMLChunk(lillp, buffer, n, msg);
-
-            if (!nodes)
+            if (buf != buffer)
             {
-                if (msg[0])
-                {
-                    IDLog("Bad XML from %s/%d: %s\n%s\n", cServer.c_str(), cPort, msg, buffer);
-                    return;
-                }
-                return;
-            }
-            root = nodes[inode];
-            while (root)
-            {
-                if (verbose)
-                    prXMLEle(stderr, root, 0);
-
-                if ((err_code = dispatchCommand(root, msg)) < 0)
-                {
-                    // Silenty ignore property duplication errors
-                    if (err_code != INDI_PROPERTY_DUPLICATED)
-                    {
-                        IDLog("Dispatch command error(%d): %s\n", err_code, msg);
-                        prXMLEle(stderr, root, 0);
-                    }
-                }
-
-                delXMLEle(root); // not yet, delete and continue
-                inode++;
-                root = nodes[inode];
+                binRead += n;
+                nextBinaryBLOB(msg);
             }
-            free(nodes);
-            inode = 0;
+            else if (!processXML(buffer, n, msg))
+                return;
         }
     }
 
+    if (binRoot)
+    {
+        delXMLEle(binRoot);
+        binRoot = nullptr;
+    }
     delLilXML(lillp);
+    free(b64Buf);
+    b64Buf  = nullptr;
+    b64Size = 0;
 
     serverDisconnected((sConnected == false) ? 0 : -1);
     sConnected = false;
@@ -485,6 +496,297 @@ void INDI::BaseClient::listenINDI()
     //pthread_exit(0);
 }
 
+/* The server sends a setBLOBVector with binary BLOBs as usual, except each oneBLOB has attached='true' and len='N'
+ * and no content. The N bytes of each then follow the end tag, in order. So XML is only parsed up to and including
+ * each setBLOBVector end tag, and when that completes a message with binary BLOBs the bytes that follow are read
+ * into the pcdata of its oneBLOBs before it is dispatched.
+ */
+bool INDI::BaseClient::processXML(const char *buf, int n, char *msg)
+{
+    static const char etag[] = "</setBLOBVector>";
+    const int netag          = sizeof(etag) - 1;
+    std::vector<char> joined;
+
+    // Resume with any bytes held back last time
+    if (!xmlHold.empty())
+    {
+        joined.assign(xmlHold.begin(), xmlHold.end());
+        joined.insert(joined.end(), buf, buf + n);
+        xmlHold.clear();
+        buf = joined.data();
+        n   = joined.size();
+    }
+
+    const char *p   = buf;
+    const char *end = buf + n;
+    while (p < end)
+    {
+        if (binRoot)
+        {
+            p += fillBinaryBLOBs(p, end - p, msg);
+            continue;
+        }
+
+        // Parse through the next end tag, else hold back a tail that may be the start of one
+        const char *tag = std::search(p, end, etag, etag + netag);
+        int len;
+        if (tag != end)
+            len = tag + netag - p;
+        else
+        {
+            int hold = std::min<int>(netag - 1, end - p);
+            while (hold > 0 && memcmp(end - hold, etag, hold))
+                hold--;
+            xmlHold.assign(end - hold, hold);
+            len = end - p - hold;
+        }
+
+        if (len > 0 && !parseXML(p, len, msg))
+            return false;
+        p += len;
+
+        if (tag == end)
+            break;
+    }
+
+    return true;
+}
+
+bool INDI::BaseClient::parseXML(const char *buf, int n, char *msg)
+{
+    XMLEle **nodes = parseXMLChunk(lillp, const_cast<char *>(buf), n, msg);
+
+    if (!nodes)
+    {
+        if (msg[0])
+            IDLog("Bad XML from %s/%d: %s\n%.*s\n", cServer.c_str(), cPort, msg, n, buf);
+        return false;
+    }
+
+    for (int i = 0; nodes[i]; i++)
+    {
+        if (verbose)
+            prXMLEle(stderr, nodes[i], 0);
+
+        // Only the last can be a setBLOBVector, which waits for its BLOBs
+        if (!strcmp(tagXMLEle(nodes[i]), "setBLOBVector") && attachBinaryBLOBs(nodes[i]))
+            binRoot = nodes[i];
+        else
+            dispatchXML(nodes[i], msg);
+    }
+    free(nodes);
+
+    return true;
+}
+
+bool INDI::BaseClient::attachBinaryBLOBs(XMLEle *root)
+{
+    binBLOBs.clear();
+    binIndex = 0;
+    binRead  = 0;
+
+    for (XMLEle *ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+    {
+        // N.B. base64 BLOBs already decoded by endXML() have no len
+        if (strcmp(tagXMLEle(ep), "oneBLOB") || strcmp(findXMLAttValu(ep, "attached"), "true") ||
+            !findXMLAtt(ep, "len"))
+            continue;
+
+        int len = atoi(findXMLAttValu(ep, "len"));
+        if (len < 0)
+            len = 0;
+        // Our own memory so setBLOB() can take it over rather than copy it
+        char *pcdata = static_cast<char *>(malloc(len + 1));
+        if (pcdata)
+            adoptXMLEleLen(ep, pcdata, len);
+        else
+            pcdata = editXMLEleLen(ep, len);
+        if (len > 0)
+            binBLOBs.push_back(std::make_pair(pcdata, len));
+    }
+
+    return !binBLOBs.empty();
+}
+
+int INDI::BaseClient::fillBinaryBLOBs(const char *buf, int n, char *msg)
+{
+    int used = 0;
+
+    while (binRoot && used < n)
+    {
+        int len = std::min(binBLOBs[binIndex].second - binRead, n - used);
+
+        memcpy(binBLOBs[binIndex].first + binRead, buf + used, len);
+        binRead += len;
+        used += len;
+        nextBinaryBLOB(msg);
+    }
+
+    return used;
+}
+
+void INDI::BaseClient::nextBinaryBLOB(char *msg)
+{
+    while (binRoot && binRead == binBLOBs[binIndex].second)
+    {
+        binRead = 0;
+        if (++binIndex < binBLOBs.size())
+            continue;
+
+        XMLEle *root = binRoot;
+        binRoot      = nullptr;
+        binBLOBs.clear();
+        dispatchXML(root, msg);
+    }
+}
+
+/* Rather than collect all the base64 of a BLOB in its oneBLOB only to decode it once complete, lillp passes it
+ * here as it arrives to be decoded straight away. The bytes then become the pcdata, without a copy, and the
+ * oneBLOB is marked attached, just as if it had come as a binary BLOB.
+ */
+int INDI::BaseClient::startXML(void *ud, XMLEle *ep)
+{
+    BaseClient *client = static_cast<BaseClient *>(ud);
+    XMLEle *pe         = parentXMLEle(ep);
+
+    // A new message, so forget any oneBLOB lost to bad XML
+    if (!pe)
+        client->b64Ele = nullptr;
+
+    if (!pe || strcmp(tagXMLEle(ep), "oneBLOB") || strcmp(tagXMLEle(pe), "setBLOBVector") ||
+        !strcmp(findXMLAttValu(ep, "attached"), "true"))
+        return 1;
+
+    // Room for all of it up front if we are told how much there is, within reason as it may not be so
+    long n = atol(findXMLAttValu(ep, "enclen")) / 4 * 3;
+    if (n <= 0)
+        n = atol(findXMLAttValu(ep, "size"));
+    if (n < 0)
+        n = 0;
+    if (n > MAXB64HINT)
+        n = MAXB64HINT;
+    if (!client->b64Buf || client->b64Size < static_cast<size_t>(n) + 3)
+    {
+        free(client->b64Buf);
+        client->b64Size = n + 3;
+        client->b64Buf  = static_cast<char *>(malloc(client->b64Size));
+        if (!client->b64Buf)
+        {
+            IDLog("INDI::BaseClient: no memory for BLOB %s\n", findXMLAttValu(ep, "name"));
+            client->b64Size = 0;
+            return 1;
+        }
+    }
+
+    client->b64Ele = ep;
+    client->b64Len = 0;
+    client->b64NQ  = 0;
+    return 0;
+}
+
+void INDI::BaseClient::pcdataXML(void *ud, XMLEle *ep, const char *s, int n)
+{
+    BaseClient *client = static_cast<BaseClient *>(ud);
+
+    if (ep == client->b64Ele)
+        client->decodeBLOB64(s, n, false);
+}
+
+int INDI::BaseClient::endXML(void *ud, XMLEle *ep)
+{
+    BaseClient *client = static_cast<BaseClient *>(ud);
+
+    if (ep == client->b64Ele)
+    {
+        client->decodeBLOB64(nullptr, 0, true);
+        if (client->b64Ele)
+        {
+            adoptXMLEleLen(ep, client->b64Buf, client->b64Len);
+            addXMLAtt(ep, "attached", "true");
+            client->b64Buf  = nullptr;
+            client->b64Size = 0;
+            client->b64Ele  = nullptr;
+        }
+    }
+
+    return 1;
+}
+
+void INDI::BaseClient::decodeBLOB64(const char *s, int n, bool last)
+{
+    const char *end = s + n;
+
+    // Always room for every quad n can hold, the one begun last time and the \0 adoptXMLEleLen() adds
+    size_t need = b64Len + (n + b64NQ) / 4 * 3 + 3;
+    if (b64Size < need)
+    {
+        size_t size = std::max(2 * b64Size, need);
+        char *buf   = static_cast<char *>(realloc(b64Buf, size));
+        if (!buf)
+        {
+            IDLog("INDI::BaseClient: no memory for BLOB %s\n", findXMLAttValu(b64Ele, "name"));
+            free(b64Buf);
+            b64Buf  = nullptr;
+            b64Size = 0;
+            b64Ele  = nullptr;
+            return;
+        }
+        b64Buf  = buf;
+        b64Size = size;
+    }
+    char *op = b64Buf + b64Len;
+
+    // Finish the quad begun in the last chunk
+    while (b64NQ > 0 && b64NQ < 4 && s < end)
+    {
+        if (*s != '\n' && *s != '\r')
+            b64Quad[b64NQ++] = *s;
+        s++;
+    }
+    if (b64NQ == 4)
+    {
+        op += from64tobits_fast(op, b64Quad, 4);
+        b64NQ = 0;
+    }
+
+    // Decode all the whole quads, keeping back any start of one more
+    if (!last)
+    {
+        int nsig = 0;
+        for (const char *p = s; p < end; p++)
+            nsig += *p != '\n' && *p != '\r';
+        for (int left = nsig % 4; left > 0; end--)
+            if (end[-1] != '\n' && end[-1] != '\r')
+                b64Quad[--left] = end[-1], b64NQ++;
+    }
+    if (s < end)
+        op += from64tobits_fast(op, s, end - s);
+    else if (last && b64NQ > 0)
+    {
+        op += from64tobits_fast(op, b64Quad, b64NQ);
+        b64NQ = 0;
+    }
+
+    b64Len = op - b64Buf;
+}
+
+void INDI::BaseClient::dispatchXML(XMLEle *root, char *msg)
+{
+    int err_code = 0;
+
+    if ((err_code = dispatchCommand(root, msg)) < 0)
+    {
+        // Silenty ignore property duplication errors
+        if (err_code != INDI_PROPERTY_DUPLICATED)
+        {
+            IDLog("Dispatch command error(%d): %s\n", err_code, msg);
+            prXMLEle(stderr, root, 0);
+        }
+    }
+
+    delXMLEle(root);
+}
+
 int INDI::BaseClient::dispatchCommand(XMLEle *root, char *errmsg)
 {
     if (!strcmp(tagXMLEle(root), "message"))
@@ -189,6 +189,19 @@ class INDI::BaseClient : public INDI::BaseMediator
      */
     bool isVerbose() const { return verbose; }
 
+    /**
+     * @brief setBinaryBLOBs Ask the server to send BLOBs as raw binary rather than base64. This saves a third of the
+     * bandwidth and the decoding. It is disabled by default and servers that do not support it keep sending base64.
+     * @param enable If true, request binary BLOBs when connecting to the server.
+     */
+    void setBinaryBLOBs(bool enable) { binaryBLOBs = enable; }
+
+    /**
+     * @brief isBinaryBLOBs Is client asking for binary BLOBs?
+     * @return True if binary BLOBs are requested when connecting to the server.
+     */
+    bool isBinaryBLOBs() const { return binaryBLOBs; }
+
     /**
      * @brief setConnectionTimeout Set connection timeout. By default it is 3 seconds.
      * @param seconds seconds
@@ -262,6 +275,26 @@ class INDI::BaseClient : public INDI::BaseMediator
     // Listen to INDI server and process incoming messages
     void listenINDI();
 
+    // Parse n bytes read from the server, dispatching complete messages. Return false on bad XML.
+    bool processXML(const char *buf, int n, char *msg);
+    // Parse n bytes holding complete messages, or their start, with lillp.
+    bool parseXML(const char *buf, int n, char *msg);
+    // Make room for the binary BLOBs following root. Return true if there are any to read.
+    bool attachBinaryBLOBs(XMLEle *root);
+    // Copy binary BLOBs from buf and return bytes used.
+    int fillBinaryBLOBs(const char *buf, int n, char *msg);
+    // Move on past each BLOB completely read, dispatching binRoot after the last.
+    void nextBinaryBLOB(char *msg);
+    // Dispatch and delete root.
+    void dispatchXML(XMLEle *root, char *msg);
+
+    // lillp event handlers, which decode base64 BLOBs as their pcdata arrives.
+    static int startXML(void *ud, XMLEle *ep);
+    static void pcdataXML(void *ud, XMLEle *ep, const char *s, int n);
+    static int endXML(void *ud, XMLEle *ep);
+    // Decode the next n chars of the base64 of b64Ele, all that is left too if last.
+    void decodeBLOB64(const char *s, int n, bool last);
+
     void sendString(const char *fmt, ...);
 
     std::vector<INDI::BaseDevice *> cDevices;
@@ -276,5 +309,23 @@ class INDI::BaseClient : public INDI::BaseMediator
     // Parse & FILE buffers for IO
 
     LilXML *lillp; /* XML parser context */
+
+    // Binary BLOBs, which follow the end tag of their setBLOBVector
+
+    bool binaryBLOBs;                               /* request binary BLOBs */
+    XMLEle *binRoot;                                /* setBLOBVector waiting for its BLOBs */
+    std::vector<std::pair<char *, int>> binBLOBs;   /* pcdata of each BLOB and its length */
+    size_t binIndex;                                /* binBLOBs[] now being read */
+    int binRead;                                    /* bytes of it read so far */
+    std::string xmlHold;                            /* end of last read that may begin an end tag */
+
+    // Base64 BLOBs, decoded as they arrive
+
+    XMLEle *b64Ele;                                 /* oneBLOB being decoded, if any */
+    char *b64Buf;                                   /* its bytes so far, from malloc and handed over at the end */
+    size_t b64Size;                                 /* bytes allocated at b64Buf, b64Len of them used */
+    size_t b64Len;
+    char b64Quad[4];                                /* start of a quad split between chunks */
+    int b64NQ;                                      /* chars in b64Quad[] */
     uint32_t timeout_sec, timeout_us;
 };
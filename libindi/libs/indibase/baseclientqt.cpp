@@ -94,6 +94,7 @@ bool INDI::BaseClientQt::connectServer()
     clear();
 
     lillp = newLilXML();
+    useArenaLilXML(lillp, 1);
 
     sConnected = true;
 
@@ -43,6 +43,8 @@
    \attention All notifications functions defined in INDI::BaseMediator <b>must</b> be implemented in the client class even if
    they are not used because these are pure virtual functions.
 
+   \note Unlike INDI::BaseClient::setBinaryBLOBs, BaseClientQt does not ask for binary BLOBs and always receives them base64 encoded.
+
    \see <a href="http://indilib.org/develop/tutorials/107-client-development-tutorial.html">INDI Client Tutorial</a> for more details.
    \author Jasem Mutlaq
 
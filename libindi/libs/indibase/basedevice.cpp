@@ -24,6 +24,7 @@
 #include "indistandardproperty.h"
 #include "locale_compat.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
@@ -40,6 +41,7 @@
 INDI::BaseDevice::BaseDevice()
 {
     mediator = nullptr;
+    pIndexed = 0;
     lp       = newLilXML();
     deviceID = new char[MAXINDIDEVICE];
     memset(deviceID, 0, MAXINDIDEVICE);
@@ -113,351 +115,119 @@ IBLOBVectorProperty *INDI::BaseDevice::getBLOB(const char *name)
 
 IPState INDI::BaseDevice::getPropertyState(const char *name)
 {
-    IPState state = IPS_IDLE;
-    INDI_PROPERTY_TYPE pType;
-    void *pPtr;
-
-    INumberVectorProperty *nvp;
-    ITextVectorProperty *tvp;
-    ISwitchVectorProperty *svp;
-    ILightVectorProperty *lvp;
-    IBLOBVectorProperty *bvp;
+    INDI::Property *pContainer = findProperty(name);
 
-    std::vector<INDI::Property *>::iterator orderi = pAll.begin();
-
-    for (; orderi != pAll.end(); ++orderi)
-    {
-        pType = (*orderi)->getType();
-        pPtr  = (*orderi)->getProperty();
-
-        switch (pType)
-        {
-            case INDI_NUMBER:
-                nvp = static_cast<INumberVectorProperty *>(pPtr);
-                if (nvp == nullptr)
-                    continue;
-                if (!strcmp(name, nvp->name))
-                    return nvp->s;
-                break;
-            case INDI_SWITCH:
-                svp = static_cast<ISwitchVectorProperty *>(pPtr);
-                if (svp == nullptr)
-                    continue;
-                if (!strcmp(name, svp->name))
-                    return svp->s;
-                break;
-            case INDI_TEXT:
-                tvp = static_cast<ITextVectorProperty *>(pPtr);
-                if (tvp == nullptr)
-                    continue;
-                if (!strcmp(name, tvp->name))
-                    return tvp->s;
-                break;
-            case INDI_LIGHT:
-                lvp = static_cast<ILightVectorProperty *>(pPtr);
-                if (lvp == nullptr)
-                    continue;
-                if (!strcmp(name, lvp->name))
-                    return lvp->s;
-                break;
-            case INDI_BLOB:
-                bvp = static_cast<IBLOBVectorProperty *>(pPtr);
-                if (bvp == nullptr)
-                    continue;
-                if (!strcmp(name, bvp->name))
-                    return bvp->s;
-                break;
-            default:
-                break;
-        }
-    }
+    if (pContainer == nullptr)
+        return IPS_IDLE;
 
-    return state;
+    return pContainer->getState();
 }
 
 IPerm INDI::BaseDevice::getPropertyPermission(const char *name)
 {
-    IPerm perm = IP_RO;
+    INDI::Property *pContainer = findProperty(name);
 
-    INDI_PROPERTY_TYPE pType;
-    void *pPtr;
+    if (pContainer == nullptr)
+        return IP_RO;
 
-    INumberVectorProperty *nvp;
-    ITextVectorProperty *tvp;
-    ISwitchVectorProperty *svp;
-    IBLOBVectorProperty *bvp;
-
-    std::vector<INDI::Property *>::iterator orderi = pAll.begin();
-
-    for (; orderi != pAll.end(); ++orderi)
-    {
-        pType = (*orderi)->getType();
-        pPtr  = (*orderi)->getProperty();
+    return pContainer->getPermission();
+}
 
-        switch (pType)
-        {
-            case INDI_NUMBER:
-                nvp = static_cast<INumberVectorProperty *>(pPtr);
-                if (nvp == nullptr)
-                    continue;
-                if (!strcmp(name, nvp->name))
-                    return nvp->p;
-                break;
-            case INDI_SWITCH:
-                svp = static_cast<ISwitchVectorProperty *>(pPtr);
-                if (svp == nullptr)
-                    continue;
-                if (!strcmp(name, svp->name))
-                    return svp->p;
-                break;
-            case INDI_TEXT:
-                tvp = static_cast<ITextVectorProperty *>(pPtr);
-                if (tvp == nullptr)
-                    continue;
-                if (!strcmp(name, tvp->name))
-                    return tvp->p;
-                break;
-            case INDI_BLOB:
-                bvp = static_cast<IBLOBVectorProperty *>(pPtr);
-                if (bvp == nullptr)
-                    continue;
-                if (!strcmp(name, bvp->name))
-                    return bvp->p;
-                break;
-            default:
-                break;
-        }
-    }
+void *INDI::BaseDevice::getRawProperty(const char *name, INDI_PROPERTY_TYPE type)
+{
+    INDI::Property *pContainer = getProperty(name, type);
 
-    return perm;
+    return pContainer ? pContainer->getProperty() : nullptr;
 }
 
-void *INDI::BaseDevice::getRawProperty(const char *name, INDI_PROPERTY_TYPE type)
+INDI::Property *INDI::BaseDevice::getProperty(const char *name, INDI_PROPERTY_TYPE type)
 {
-    INDI_PROPERTY_TYPE pType;
-    void *pPtr = nullptr;
-    bool pRegistered = false;
+    INDI::Property *pContainer = findProperty(name);
 
-    std::vector<INDI::Property *>::iterator orderi = pAll.begin();
+    if (pContainer == nullptr)
+        return nullptr;
 
-    INumberVectorProperty *nvp = nullptr;
-    ITextVectorProperty *tvp = nullptr;
-    ISwitchVectorProperty *svp = nullptr;
-    ILightVectorProperty *lvp = nullptr;
-    IBLOBVectorProperty *bvp = nullptr;
+    if ((type == INDI_UNKNOWN || pContainer->getType() == type) && pContainer->getRegistered())
+        return pContainer;
 
-    for (; orderi != pAll.end(); ++orderi)
+    // Another property by the same name may follow the first one in pAll
+    for (INDI::Property *oneProperty : pAll)
     {
-        pType       = (*orderi)->getType();
-        pPtr        = (*orderi)->getProperty();
-        pRegistered = (*orderi)->getRegistered();
-
-        if (type != INDI_UNKNOWN && pType != type)
+        if (type != INDI_UNKNOWN && oneProperty->getType() != type)
             continue;
 
-        switch (pType)
-        {
-            case INDI_NUMBER:
-                nvp = static_cast<INumberVectorProperty *>(pPtr);
-                if (nvp == nullptr)
-                    continue;
-
-                if (!strcmp(name, nvp->name) && pRegistered)
-                    return pPtr;
-                break;
-            case INDI_TEXT:
-                tvp = static_cast<ITextVectorProperty *>(pPtr);
-                if (tvp == nullptr)
-                    continue;
-
-                if (!strcmp(name, tvp->name) && pRegistered)
-                    return pPtr;
-                break;
-            case INDI_SWITCH:
-                svp = static_cast<ISwitchVectorProperty *>(pPtr);
-                if (svp == nullptr)
-                    continue;
-
-                //IDLog("Switch %s and aux value is now %d\n", svp->name, regStatus );
-                if (!strcmp(name, svp->name) && pRegistered)
-                    return pPtr;
-                break;
-            case INDI_LIGHT:
-                lvp = static_cast<ILightVectorProperty *>(pPtr);
-                if (lvp == nullptr)
-                    continue;
-
-                if (!strcmp(name, lvp->name) && pRegistered)
-                    return pPtr;
-                break;
-            case INDI_BLOB:
-                bvp = static_cast<IBLOBVectorProperty *>(pPtr);
-                if (bvp == nullptr)
-                    continue;
-
-                if (!strcmp(name, bvp->name) && pRegistered)
-                    return pPtr;
-            case INDI_UNKNOWN:
-                break;
-        }
+        if (oneProperty->getRegistered() && oneProperty->getName() && !strcmp(name, oneProperty->getName()))
+            return oneProperty;
     }
 
     return nullptr;
 }
 
-INDI::Property *INDI::BaseDevice::getProperty(const char *name, INDI_PROPERTY_TYPE type)
+int INDI::BaseDevice::removeProperty(const char *name, char *errmsg)
 {
-    INDI_PROPERTY_TYPE pType;
-    void *pPtr;
-    bool pRegistered = false;
-
-    std::vector<INDI::Property *>::iterator orderi;
+    INDI::Property *pContainer = findProperty(name);
 
-    INumberVectorProperty *nvp;
-    ITextVectorProperty *tvp;
-    ISwitchVectorProperty *svp;
-    ILightVectorProperty *lvp;
-    IBLOBVectorProperty *bvp;
-
-    for (orderi = pAll.begin(); orderi != pAll.end(); ++orderi)
+    if (pContainer == nullptr)
     {
-        pType       = (*orderi)->getType();
-        pPtr        = (*orderi)->getProperty();
-        pRegistered = (*orderi)->getRegistered();
-
-        if (type != INDI_UNKNOWN && pType != type)
-            continue;
-
-        switch (pType)
-        {
-            case INDI_NUMBER:
-                nvp = static_cast<INumberVectorProperty *>(pPtr);
-                if (nvp == nullptr)
-                    continue;
-
-                if (!strcmp(name, nvp->name) && pRegistered)
-                    return *orderi;
-                break;
-            case INDI_TEXT:
-                tvp = static_cast<ITextVectorProperty *>(pPtr);
-                if (tvp == nullptr)
-                    continue;
+        snprintf(errmsg, MAXRBUF, "Error: Property %s not found in device %s.", name, deviceID);
+        return INDI_PROPERTY_INVALID;
+    }
 
-                if (!strcmp(name, tvp->name) && pRegistered)
-                    return *orderi;
-                break;
-            case INDI_SWITCH:
-                svp = static_cast<ISwitchVectorProperty *>(pPtr);
-                if (svp == nullptr)
-                    continue;
+    // Those after it in pAll move down one, so index them all again
+    pAll.erase(std::find(pAll.begin(), pAll.end(), pContainer));
+    reindexProperties();
 
-                //IDLog("Switch %s and aux value is now %d\n", svp->name, regStatus );
-                if (!strcmp(name, svp->name) && pRegistered)
-                    return *orderi;
-                break;
-            case INDI_LIGHT:
-                lvp = static_cast<ILightVectorProperty *>(pPtr);
-                if (lvp == nullptr)
-                    continue;
+    pContainer->setRegistered(false);
+    delete pContainer;
 
-                if (!strcmp(name, lvp->name) && pRegistered)
-                    return *orderi;
-                break;
-            case INDI_BLOB:
-                bvp = static_cast<IBLOBVectorProperty *>(pPtr);
-                if (bvp == nullptr)
-                    continue;
+    return 0;
+}
 
-                if (!strcmp(name, bvp->name) && pRegistered)
-                    return *orderi;
-                break;
-            case INDI_UNKNOWN:
-                break;
-        }
+void INDI::BaseDevice::indexProperty(INDI::Property *pContainer)
+{
+    if (pIndexed + 1 != pAll.size())
+    {
+        reindexProperties();
+        return;
     }
 
-    return nullptr;
+    if (pContainer->getName())
+        pIndex.emplace(pContainer->getName(), pIndexed);
+    pIndexed++;
 }
 
-int INDI::BaseDevice::removeProperty(const char *name, char *errmsg)
+INDI::Property *INDI::BaseDevice::findProperty(const char *name)
 {
-    std::vector<INDI::Property *>::iterator orderi;
-
-    INDI_PROPERTY_TYPE pType;
-    void *pPtr;
+    if (pIndexed != pAll.size())
+        reindexProperties();
 
-    INumberVectorProperty *nvp;
-    ITextVectorProperty *tvp;
-    ISwitchVectorProperty *svp;
-    ILightVectorProperty *lvp;
-    IBLOBVectorProperty *bvp;
+    auto it = pIndex.find(name);
+    if (it == pIndex.end())
+        return nullptr;
 
-    for (orderi = pAll.begin(); orderi != pAll.end(); ++orderi)
+    // pAll may have been changed behind our back, so make sure the hit is still what we indexed
+    INDI::Property *pContainer = pAll[it->second];
+    if (pContainer->getName() == nullptr || strcmp(name, pContainer->getName()))
     {
-        pType = (*orderi)->getType();
-        pPtr  = (*orderi)->getProperty();
-
-        switch (pType)
-        {
-            case INDI_NUMBER:
-                nvp = static_cast<INumberVectorProperty *>(pPtr);
-                if (!strcmp(name, nvp->name))
-                {
-                    (*orderi)->setRegistered(false);
-                    delete *orderi;
-                    orderi = pAll.erase(orderi);
+        reindexProperties();
+        it = pIndex.find(name);
+        if (it == pIndex.end())
+            return nullptr;
+        pContainer = pAll[it->second];
+    }
 
-                    return 0;
-                }
-                break;
-            case INDI_TEXT:
-                tvp = static_cast<ITextVectorProperty *>(pPtr);
-                if (!strcmp(name, tvp->name))
-                {
-                    (*orderi)->setRegistered(false);
-                    delete *orderi;
-                    orderi = pAll.erase(orderi);
+    return pContainer;
+}
 
-                    return 0;
-                }
-                break;
-            case INDI_SWITCH:
-                svp = static_cast<ISwitchVectorProperty *>(pPtr);
-                if (!strcmp(name, svp->name))
-                {
-                    (*orderi)->setRegistered(false);
-                    delete *orderi;
-                    orderi = pAll.erase(orderi);
-                    return 0;
-                }
-                break;
-            case INDI_LIGHT:
-                lvp = static_cast<ILightVectorProperty *>(pPtr);
-                if (!strcmp(name, lvp->name))
-                {
-                    (*orderi)->setRegistered(false);
-                    delete *orderi;
-                    orderi = pAll.erase(orderi);
-                    return 0;
-                }
-                break;
-            case INDI_BLOB:
-                bvp = static_cast<IBLOBVectorProperty *>(pPtr);
-                if (!strcmp(name, bvp->name))
-                {
-                    (*orderi)->setRegistered(false);
-                    delete *orderi;
-                    orderi = pAll.erase(orderi);
-                    return 0;
-                }
-                break;
-            case INDI_UNKNOWN:
-                break;
-        }
+void INDI::BaseDevice::reindexProperties()
+{
+    pIndex.clear();
+    for (size_t i = 0; i < pAll.size(); i++)
+    {
+        if (pAll[i]->getName())
+            pIndex.emplace(pAll[i]->getName(), i);
     }
-
-    snprintf(errmsg, MAXRBUF, "Error: Property %s not found in device %s.", name, deviceID);
-    return INDI_PROPERTY_INVALID;
+    pIndexed = pAll.size();
 }
 
 bool INDI::BaseDevice::buildSkeleton(const char *filename)
@@ -638,6 +408,7 @@ int INDI::BaseDevice::buildProp(XMLEle *root, char *errmsg)
             indiProp->setType(INDI_NUMBER);
 
             pAll.push_back(indiProp);
+            indexProperty(indiProp);
 
             //IDLog("Adding number property %s to list.\n", nvp->name);
             if (mediator)
@@ -704,6 +475,7 @@ int INDI::BaseDevice::buildProp(XMLEle *root, char *errmsg)
             indiProp->setType(INDI_SWITCH);
 
             pAll.push_back(indiProp);
+            indexProperty(indiProp);
             //IDLog("Adding Switch property %s to list.\n", svp->name);
             if (mediator)
                 mediator->newProperty(indiProp);
@@ -768,6 +540,7 @@ int INDI::BaseDevice::buildProp(XMLEle *root, char *errmsg)
             indiProp->setType(INDI_TEXT);
 
             pAll.push_back(indiProp);
+            indexProperty(indiProp);
 
             //IDLog("Adding Text property %s to list with initial value of %s.\n", tvp->name, tvp->tp[0].text);
             if (mediator)
@@ -828,6 +601,7 @@ int INDI::BaseDevice::buildProp(XMLEle *root, char *errmsg)
             indiProp->setType(INDI_LIGHT);
 
             pAll.push_back(indiProp);
+            indexProperty(indiProp);
 
             //IDLog("Adding Light property %s to list.\n", lvp->name);
             if (mediator)
@@ -898,6 +672,7 @@ int INDI::BaseDevice::buildProp(XMLEle *root, char *errmsg)
             indiProp->setType(INDI_BLOB);
 
             pAll.push_back(indiProp);
+            indexProperty(indiProp);
             //IDLog("Adding BLOB property %s to list.\n", bvp->name);
             if (mediator)
                 mediator->newProperty(indiProp);
@@ -1150,10 +925,28 @@ int INDI::BaseDevice::setBLOB(IBLOBVectorProperty *bvp, XMLEle *root, char *errm
                     continue;
                 }
 
-                blobEL->size    = blobSize;
-                int bloblen     = pcdatalenXMLEle(ep);
-                blobEL->blob    = (unsigned char *)realloc(blobEL->blob, 3 * bloblen / 4);
-                blobEL->bloblen = from64tobits_fast(static_cast<char *>(blobEL->blob), pcdataXMLEle(ep), bloblen);
+                blobEL->size = blobSize;
+                int bloblen  = pcdatalenXMLEle(ep);
+
+                /* binary BLOBs need no decoding, their bytes are simply taken over */
+                if (!strcmp(findXMLAttValu(ep, "attached"), "true"))
+                {
+                    char *blob = takeXMLEleLen(ep, &bloblen);
+                    if (blob == nullptr)
+                    {
+                        snprintf(errmsg, MAXRBUF, "INDI: %s.%s.%s no memory for BLOB", blobEL->bvp->device,
+                                 blobEL->bvp->name, blobEL->name);
+                        return -1;
+                    }
+                    free(blobEL->blob);
+                    blobEL->blob    = blob;
+                    blobEL->bloblen = bloblen;
+                }
+                else
+                {
+                    blobEL->blob    = (unsigned char *)realloc(blobEL->blob, 3 * bloblen / 4);
+                    blobEL->bloblen = from64tobits_fast(static_cast<char *>(blobEL->blob), pcdataXMLEle(ep), bloblen);
+                }
 
                 strncpy(blobEL->format, valuXMLAtt(fa), MAXINDIFORMAT);
 
@@ -1286,6 +1079,7 @@ void INDI::BaseDevice::registerProperty(void *p, INDI_PROPERTY_TYPE type)
         pContainer->setType(type);
 
         pAll.push_back(pContainer);
+        indexProperty(pContainer);
     }
     else if (type == INDI_TEXT)
     {
@@ -1302,6 +1096,7 @@ void INDI::BaseDevice::registerProperty(void *p, INDI_PROPERTY_TYPE type)
         pContainer->setType(type);
 
         pAll.push_back(pContainer);
+        indexProperty(pContainer);
     }
     else if (type == INDI_SWITCH)
     {
@@ -1318,6 +1113,7 @@ void INDI::BaseDevice::registerProperty(void *p, INDI_PROPERTY_TYPE type)
         pContainer->setType(type);
 
         pAll.push_back(pContainer);
+        indexProperty(pContainer);
     }
     else if (type == INDI_LIGHT)
     {
@@ -1334,6 +1130,7 @@ void INDI::BaseDevice::registerProperty(void *p, INDI_PROPERTY_TYPE type)
         pContainer->setType(type);
 
         pAll.push_back(pContainer);
+        indexProperty(pContainer);
     }
     else if (type == INDI_BLOB)
     {
@@ -1350,6 +1147,7 @@ void INDI::BaseDevice::registerProperty(void *p, INDI_PROPERTY_TYPE type)
         pContainer->setType(type);
 
         pAll.push_back(pContainer);
+        indexProperty(pContainer);
     }
 }
 
@@ -22,6 +22,7 @@
 #include "indiproperty.h"
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <stdint.h>
@@ -210,9 +211,21 @@ class INDI::BaseDevice
     int setBLOB(IBLOBVectorProperty *pp, XMLEle *root, char *errmsg);
 
   private:
+    /** \brief Enter a property just appended to pAll in the name index */
+    void indexProperty(INDI::Property *pContainer);
+    /** \brief Return the first property in pAll with the given name, or nullptr if none */
+    INDI::Property *findProperty(const char *name);
+    /** \brief Rebuild the name index from pAll */
+    void reindexProperties();
+
     char *deviceID;
 
     std::vector<INDI::Property *> pAll;
+    /* position in pAll of the first property by each name, so lookups need not scan pAll.
+     * getProperties() lets others change pAll, so each hit is checked and the index rebuilt if stale.
+     */
+    std::unordered_map<std::string, size_t> pIndex;
+    size_t pIndexed; /* pAll.size() as of the last change to pIndex */
 
     LilXML *lp;
 
@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  * only handles elements, attributes and pcdata content.
  * <! ... > and <? ... > are silently ignored.
  * pcdata is collected into one string, sans leading whitespace first line.
+ * elements may also be reported as they are parsed, see setSAXLilXML().
  *
  * #define MAIN_TST to create standalone test program
  */
@@ -42,6 +43,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #pragma warning(disable : 4996)
 #endif
 
+/* storage class for data that must be private to each thread */
+#if defined(_MSC_VER)
+#define LILXML_TLS __declspec(thread)
+#else
+#define LILXML_TLS __thread
+#include <pthread.h>
+#endif
+
 #include "lilxml.h"
 
 /* used to efficiently manage growing malloced string space */
@@ -52,21 +61,66 @@ typedef struct
     int sm;  /* total malloced bytes */
 } String;
 #define MINMEM 64 /* starting string length */
+#define MAXPCHINT (4L * 1024 * 1024) /* most pcdata room taken on trust, see sizePCData() */
+
+/* one block of arena memory */
+typedef struct _arena_chunk
+{
+    struct _arena_chunk *next; /* older chunks */
+    size_t size;               /* bytes in buf[] */
+    size_t used;               /* bytes of buf[] handed out */
+    char *lastp;               /* most recent allocation, may grow in place */
+    char buf[];
+} ArenaChunk;
+
+/* bump allocator holding all of one parsed tree, see useArenaLilXML().
+ * each allocation is preceded by its size. nothing is freed until the root
+ * of the tree is deleted, when the chunks go all at once. once the tree is
+ * complete it is sealed and any later edits use malloc, but with a header
+ * of ARENAMALLOC so xfree() and xrealloc() can tell the two apart.
+ */
+typedef struct _arena
+{
+    ArenaChunk *chunks; /* newest first, this Arena is in the oldest */
+    XMLEle *root;       /* tree that owns us */
+    int sealed;         /* tree complete, allocate from malloc from now on */
+    int mixed;          /* tree also refers to malloced or foreign memory */
+} Arena;
+#define ARENACHUNK 8192 /* usual arena chunk size */
+#define ARENABIG   2048 /* larger allocations go to malloc */
+#define ARENAHDR   8    /* room for the size ahead of each allocation */
+#define ARENAMALLOC ((size_t)-1) /* header in place of the size if from malloc */
+#define ARENARND(n) (((n) + 7) & ~(size_t)7)
 
 static int oneXMLchar(LilXML *lp, int c, char ynot[]);
 static void initParser(LilXML *lp);
 static void pushXMLEle(LilXML *lp);
 static void popXMLEle(LilXML *lp);
 static void resetEndTag(LilXML *lp);
+static void delPartial(LilXML *lp);
 static XMLAtt *growAtt(XMLEle *e);
-static XMLEle *growEle(XMLEle *pe);
-static void freeAtt(XMLAtt *a);
+static XMLEle *growEle(Arena *ar, XMLEle *pe);
+static void freeAtt(Arena *ar, XMLAtt *a);
 static int isTokenChar(int start, int c);
-static void growString(String *sp, int c);
-static void appendString(String *sp, const char *str);
-static void freeString(String *sp);
-static void newString(String *sp);
+static void growString(Arena *ar, String *sp, int c);
+static void appendString(Arena *ar, String *sp, const char *str);
+static void appendStringLen(Arena *ar, String *sp, const char *str, int strl);
+static int scanPCData(LilXML *lp, const char *s, int n);
+static void sizePCData(LilXML *lp);
+static void flushPCData(LilXML *lp, int all);
+static void startXMLEle(LilXML *lp);
+static int endXMLEle(LilXML *lp);
+static void freeString(Arena *ar, String *sp);
+static void freePCData(XMLEle *ep);
+static void newString(Arena *ar, String *sp);
 static void *moremem(void *old, int n);
+static Arena *newArena(void);
+static void delArena(Arena *ar);
+static ArenaChunk *newChunk(size_t size);
+static void keepSpareChunk(ArenaChunk *cp);
+static void *xalloc(Arena *ar, size_t n);
+static void *xrealloc(Arena *ar, void *old, size_t n);
+static void xfree(Arena *ar, void *p);
 
 typedef enum {
     LOOK4START = 0, /* looking for first element start */
@@ -97,7 +151,9 @@ struct _LilXML
     int delim;     /* attribute value delimiter */
     int lastc;     /* last char (just used wiht skipping)*/
     int skipping;  /* in comment or declaration */
-    int inblob;    /* in oneBLOB element */
+    int arena;     /* give each new tree its own Arena */
+    const XMLHandler *sax; /* event handlers, if any */
+    void *saxud;           /* passed to each sax handler */
 };
 
 /* internal representation of a (possibly nested) XML element */
@@ -113,6 +169,9 @@ struct _xml_ele
     int eit;           /* used to iterate over el[] */
     String pcdata;     /* character data in this element */
     int pcdata_hasent; /* 1 if pcdata contains an entity char*/
+    int pcdata_own;    /* 1 if pcdata.s is from plain malloc, see adoptXMLEleLen() */
+    int stream;        /* 1 if pcdata goes to the sax pcdata handler */
+    Arena *ar;         /* arena of the tree we were parsed in, else NULL */
 };
 
 /* internal representation of an attribute */
@@ -132,6 +191,16 @@ static void *(*mymalloc)(size_t size)             = malloc;
 static void *(*myrealloc)(void *ptr, size_t size) = realloc;
 static void (*myfree)(void *ptr)                  = free;
 
+/* one spare ARENACHUNK chunk per thread, saves a malloc per tree. it is
+ * kept across LilXMLs and freed when the thread exits.
+ */
+static LILXML_TLS ArenaChunk *sparechunk;
+#if !defined(_MSC_VER)
+static pthread_key_t sparekey;
+static pthread_once_t sparekeyonce = PTHREAD_ONCE_INIT;
+static LILXML_TLS int sparekeyset;
+#endif
+
 /* install new version of malloc/realloc/free.
  * N.B. don't call after first use of any other lilxml function
  */
@@ -155,28 +224,55 @@ LilXML *newLilXML()
 /* discard */
 void delLilXML(LilXML *lp)
 {
-    delXMLEle(lp->ce);
-    freeString(&lp->endtag);
+    delPartial(lp);
+    freeString(NULL, &lp->endtag);
+    freeString(NULL, &lp->entity);
     (*myfree)(lp);
 }
 
+/* build each tree lp parses from now on in its own arena if on, else with
+ * individual mallocs as usual. the trees behave the same either way, but an
+ * arena tree costs just a malloc or two to build and one free to delete.
+ * memory of elements deleted from it is not reused until the root goes.
+ */
+void useArenaLilXML(LilXML *lp, int on)
+{
+    lp->arena = on;
+}
+
+/* call the handlers at hp with ud as lp parses from now on, none if NULL */
+void setSAXLilXML(LilXML *lp, const XMLHandler *hp, void *ud)
+{
+    lp->sax   = hp;
+    lp->saxud = ud;
+}
+
 /* delete ep and all its children and remove from parent's list if known */
 void delXMLEle(XMLEle *ep)
 {
+    Arena *ar;
     int i;
 
     /* benign if NULL */
     if (!ep)
         return;
+    ar = ep->ar;
+
+    /* a whole arena tree holding nothing else just goes at once */
+    if (ar && ar->root == ep && !ar->mixed)
+    {
+        delArena(ar);
+        return;
+    }
 
     /* delete all parts of ep */
-    freeString(&ep->tag);
-    freeString(&ep->pcdata);
+    freeString(ar, &ep->tag);
+    freePCData(ep);
     if (ep->at)
     {
         for (i = 0; i < ep->nat; i++)
-            freeAtt(ep->at[i]);
-        (*myfree)(ep->at);
+            freeAtt(ar, ep->at[i]);
+        xfree(ar, ep->at);
     }
     if (ep->el)
     {
@@ -187,7 +283,7 @@ void delXMLEle(XMLEle *ep)
 
             delXMLEle(ep->el[i]);
         }
-        (*myfree)(ep->el);
+        xfree(ar, ep->el);
     }
 
     /* remove from parent's list if known */
@@ -204,11 +300,13 @@ void delXMLEle(XMLEle *ep)
         }
     }
 
-    /* delete ep itself */
-    (*myfree)(ep);
+    /* delete ep itself, along with its whole arena if it is the root */
+    if (ar && ar->root == ep)
+        delArena(ar);
+    else
+        xfree(ar, ep);
 }
 
-//#define WITH_MEMCHR
 XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
 {
     XMLEle **nodes = (XMLEle **)malloc(sizeof(XMLEle *));
@@ -218,82 +316,21 @@ XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
     int s;
     ynot[0] = '\0';
 
-    if (lp->inblob)
-    {
-#ifdef WITH_ENCLEN
-        if (size < lp->ce->pcdata.sm - lp->ce->pcdata.sl)
-        {
-            memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-            lp->ce->pcdata.sl += size;
-            return nodes;
-        }
-        else
-            lp->inblob = 0;
-#endif
-#ifdef WITH_MEMCHR
-        char *ltpos = memchr(buf, '<', size);
-        if (!ltpos)
-        {
-            lp->ce->pcdata.s = (char *)moremem(lp->ce->pcdata.s, lp->ce->pcdata.sm + size);
-            lp->ce->pcdata.sm += size;
-            memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-            lp->ce->pcdata.sl += size;
-            return nodes;
-        }
-        else
-            lp->inblob = 0;
-#endif
-    }
-    else
+    while (curr - buf < size)
     {
-        if (lp->ce)
+        char newc = *curr;
+
+        /* take plain pcdata a run at a time */
+        if (lp->cs == INCON && !lp->skipping && lp->lastc != '<')
         {
-            char *ctag = tagXMLEle(lp->ce);
-            if (ctag && !(strcmp(ctag, "oneBLOB")) && (lp->cs == INCON))
+            int n = scanPCData(lp, curr, size - (curr - buf));
+            if (n > 0)
             {
-#ifdef WITH_ENCLEN
-                XMLAtt *blenatt = findXMLAtt(lp->ce, "enclen");
-                if (blenatt)
-                {
-                    int blen;
-                    sscanf(valuXMLAtt(blenatt), "%d", &blen);
-                    // if (lp->ce->pcdata.sm < blen) { // always realloc
-                    if (blen % 72 != 0)
-                        blen += (blen / 72) + 1; // add room for those '\n'
-                    else
-                        blen += (blen / 72);
-                    lp->ce->pcdata.s  = (char *)moremem(lp->ce->pcdata.s, blen);
-                    lp->ce->pcdata.sm = blen; // or always set sm
-                    //}
-                    if (size < blen - lp->ce->pcdata.sl)
-                    {
-                        memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-                        lp->ce->pcdata.sl += size;
-                        lp->inblob = 1;
-                        return nodes;
-                    }
-                }
-#endif
-#ifdef WITH_MEMCHR
-                char *ltpos = memchr(buf, '<', size);
-                if (!ltpos)
-                {
-                    lp->ce->pcdata.s = (char *)moremem(lp->ce->pcdata.s, lp->ce->pcdata.sm + size);
-                    lp->ce->pcdata.sm += size;
-                    memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-                    lp->ce->pcdata.sl += size;
-                    lp->inblob = 1;
-                    return nodes;
-                }
-                else
-                    lp->inblob = 0;
-#endif
+                curr += n;
+                continue;
             }
         }
-    }
-    while (curr - buf < size)
-    {
-        char newc = *curr;
+
         /* EOF? */
         if (newc == 0)
         {
@@ -357,14 +394,20 @@ XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
             continue;
         }
 
-        /* Ok! store ce in nodes and we start over.
+        /* Ok! store ce in nodes, unless the end handler let it go, and we
+         * start over.
          * N.B. up to caller to call delXMLEle with what we return.
          */
-        nodes[nnodes - 1] = lp->ce;
-        nodes             = (XMLEle **)realloc(nodes, (nnodes + 1) * sizeof(XMLEle *));
-        nodes[nnodes]     = NULL;
-        nnodes += 1;
-        lp->ce = NULL;
+        if (lp->ce)
+        {
+            if (lp->ce->ar)
+                lp->ce->ar->sealed = 1;
+            nodes[nnodes - 1] = lp->ce;
+            nodes             = (XMLEle **)realloc(nodes, (nnodes + 1) * sizeof(XMLEle *));
+            nodes[nnodes]     = NULL;
+            nnodes += 1;
+            lp->ce = NULL;
+        }
         initParser(lp);
         curr++;
     }
@@ -450,6 +493,8 @@ XMLEle *readXMLEle(LilXML *lp, int newc, char ynot[])
     root   = lp->ce;
     lp->ce = NULL;
     initParser(lp);
+    if (root && root->ar)
+        root->ar->sealed = 1;
     return (root);
 }
 
@@ -461,6 +506,7 @@ XMLEle *parseXML(char buf[], char ynot[])
     LilXML *lp = newLilXML();
     XMLEle *root;
 
+    useArenaLilXML(lp, 1);
     do
     {
         root = readXMLEle(lp, *buf++, ynot);
@@ -638,8 +684,8 @@ XMLEle *readXMLFile(FILE *fp, LilXML *lp, char ynot[])
  */
 XMLEle *addXMLEle(XMLEle *parent, const char *tag)
 {
-    XMLEle *ep = growEle(parent);
-    appendString(&ep->tag, tag);
+    XMLEle *ep = growEle(parent ? parent->ar : NULL, parent);
+    appendString(ep->ar, &ep->tag, tag);
     return (ep);
 }
 
@@ -648,24 +694,83 @@ XMLEle *addXMLEle(XMLEle *parent, const char *tag)
  */
 void appXMLEle(XMLEle *ep, XMLEle *newep)
 {
-    ep->el            = (XMLEle **)moremem(ep->el, (ep->nel + 1) * sizeof(XMLEle *));
+    ep->el            = (XMLEle **)xrealloc(ep->ar, ep->el, (ep->nel + 1) * sizeof(XMLEle *));
     ep->el[ep->nel++] = newep;
+    if (ep->ar && newep->ar != ep->ar)
+        ep->ar->mixed = 1;
 }
 
 /* set the pcdata of the given element */
 void editXMLEle(XMLEle *ep, const char *pcdata)
 {
-    freeString(&ep->pcdata);
-    appendString(&ep->pcdata, pcdata);
+    freePCData(ep);
+    appendString(ep->ar, &ep->pcdata, pcdata);
     ep->pcdata_hasent = (strpbrk(pcdata, entities) != NULL);
 }
 
+/* make the pcdata of the given element len uninitialized bytes, return it */
+char *editXMLEleLen(XMLEle *ep, int len)
+{
+    freePCData(ep);
+    ep->pcdata.s      = (char *)xalloc(ep->ar, len + 1);
+    ep->pcdata.sm     = len + 1;
+    ep->pcdata.sl     = len;
+    ep->pcdata.s[len] = '\0';
+    ep->pcdata_hasent = 0;
+    return (ep->pcdata.s);
+}
+
+/* make the len bytes at pcdata, from malloc with room for len+1, the pcdata of the given element */
+void adoptXMLEleLen(XMLEle *ep, char *pcdata, int len)
+{
+    freePCData(ep);
+    ep->pcdata.s      = pcdata;
+    ep->pcdata.sm     = len + 1;
+    ep->pcdata.sl     = len;
+    ep->pcdata.s[len] = '\0';
+    ep->pcdata_hasent = 0;
+    ep->pcdata_own    = 1;
+    if (ep->ar)
+        ep->ar->mixed = 1;
+}
+
+/* return the pcdata of the given element in memory from malloc that is now the caller's to free, leaving
+ * the element with none. the storage is handed over as is if from adoptXMLEleLen(), else it is a copy.
+ * return NULL if no memory.
+ */
+char *takeXMLEleLen(XMLEle *ep, int *len)
+{
+    char *s;
+
+    if (ep->pcdata_own)
+    {
+        s               = ep->pcdata.s;
+        *len            = ep->pcdata.sl;
+        ep->pcdata_own  = 0;
+        ep->pcdata.s    = NULL;
+        ep->pcdata.sl   = 0;
+        ep->pcdata.sm   = 0;
+    }
+    else
+    {
+        s = (char *)malloc(ep->pcdata.sl + 1);
+        if (!s)
+            return (NULL);
+        memcpy(s, ep->pcdata.s, ep->pcdata.sl + 1);
+        *len = ep->pcdata.sl;
+        freeString(ep->ar, &ep->pcdata);
+    }
+
+    newString(ep->ar, &ep->pcdata);
+    return (s);
+}
+
 /* add an attribute to the given XML element */
 XMLAtt *addXMLAtt(XMLEle *ep, const char *name, const char *valu)
 {
     XMLAtt *ap = growAtt(ep);
-    appendString(&ap->name, name);
-    appendString(&ap->valu, valu);
+    appendString(ep->ar, &ap->name, name);
+    appendString(ep->ar, &ap->valu, valu);
     return (ap);
 }
 
@@ -678,7 +783,7 @@ void rmXMLAtt(XMLEle *ep, const char *name)
     {
         if (strcmp(ep->at[i]->name.s, name) == 0)
         {
-            freeAtt(ep->at[i]);
+            freeAtt(ep->ar, ep->at[i]);
             memmove(&ep->at[i], &ep->at[i + 1], (--ep->nat - i) * sizeof(XMLAtt *));
             return;
         }
@@ -688,8 +793,8 @@ void rmXMLAtt(XMLEle *ep, const char *name)
 /* change the value of an attribute to str */
 void editXMLAtt(XMLAtt *ap, const char *str)
 {
-    freeString(&ap->valu);
-    appendString(&ap->valu, str);
+    freeString(ap->ce->ar, &ap->valu);
+    appendString(ap->ce->ar, &ap->valu, str);
 }
 
 /* sample print ep to fp
@@ -810,11 +915,12 @@ int sprlXMLEle(XMLEle *ep, int level)
 
 /* return a string with all xml-sensitive characters within the passed string s
  * replaced with their entity sequence equivalents.
- * N.B. caller must use the returned string before calling us again.
+ * N.B. caller must use the returned string before calling us again from the
+ *   same thread.
  */
 char *entityXML(char *s)
 {
-    static char *malbuf;
+    static LILXML_TLS char *malbuf;
     int nmalbuf = 0;
     char *sret = NULL;
     char *ep = NULL;
@@ -916,7 +1022,7 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
         case LOOK4TAG: /* looking for element tag */
             if (isTokenChar(1, c))
             {
-                growString(&lp->ce->tag, c);
+                growString(lp->ce->ar, &lp->ce->tag, c);
                 lp->cs = INTAG;
             }
             else if (!isspace(c))
@@ -928,9 +1034,12 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 
         case INTAG: /* reading tag */
             if (isTokenChar(0, c))
-                growString(&lp->ce->tag, c);
+                growString(lp->ce->ar, &lp->ce->tag, c);
             else if (c == '>')
+            {
+                startXMLEle(lp);
                 lp->cs = LOOK4CON;
+            }
             else if (c == '/')
                 lp->cs = SAWSLASH;
             else
@@ -939,13 +1048,16 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 
         case LOOK4ATTRN: /* looking for attr name, > or / */
             if (c == '>')
+            {
+                startXMLEle(lp);
                 lp->cs = LOOK4CON;
+            }
             else if (c == '/')
                 lp->cs = SAWSLASH;
             else if (isTokenChar(1, c))
             {
                 XMLAtt *ap = growAtt(lp->ce);
-                growString(&ap->name, c);
+                growString(lp->ce->ar, &ap->name, c);
                 lp->cs = INATTRN;
             }
             else if (!isspace(c))
@@ -958,9 +1070,9 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
         case SAWSLASH: /* saw / in element opening */
             if (c == '>')
             {
-                if (!lp->ce->pe)
+                startXMLEle(lp);
+                if (endXMLEle(lp))
                     return (1); /* root has no content */
-                popXMLEle(lp);
                 lp->cs = LOOK4CON;
             }
             else
@@ -972,7 +1084,7 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 
         case INATTRN: /* reading attr name */
             if (isTokenChar(0, c))
-                growString(&lp->ce->at[lp->ce->nat - 1]->name, c);
+                growString(lp->ce->ar, &lp->ce->at[lp->ce->nat - 1]->name, c);
             else if (isspace(c) || c == '=')
                 lp->cs = LOOK4ATTRV;
             else
@@ -998,30 +1110,30 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
         case INATTRV: /* in attr value */
             if (c == '&')
             {
-                newString(&lp->entity);
-                growString(&lp->entity, c);
+                newString(NULL, &lp->entity);
+                growString(NULL, &lp->entity, c);
                 lp->cs = ENTINATTRV;
             }
             else if (c == lp->delim)
                 lp->cs = LOOK4ATTRN;
             else if (!iscntrl(c))
-                growString(&lp->ce->at[lp->ce->nat - 1]->valu, c);
+                growString(lp->ce->ar, &lp->ce->at[lp->ce->nat - 1]->valu, c);
             break;
 
         case ENTINATTRV: /* working on entity in attr valu */
             if (c == ';')
             {
                 /* if find a recongized esp seq, add equiv char else raw seq */
-                growString(&lp->entity, c);
+                growString(NULL, &lp->entity, c);
                 if (decodeEntity(lp->entity.s, &c))
-                    growString(&lp->ce->at[lp->ce->nat - 1]->valu, c);
+                    growString(lp->ce->ar, &lp->ce->at[lp->ce->nat - 1]->valu, c);
                 else
-                    appendString(&lp->ce->at[lp->ce->nat - 1]->valu, lp->entity.s);
-                freeString(&lp->entity);
+                    appendString(lp->ce->ar, &lp->ce->at[lp->ce->nat - 1]->valu, lp->entity.s);
+                freeString(NULL, &lp->entity);
                 lp->cs = INATTRV;
             }
             else
-                growString(&lp->entity, c);
+                growString(NULL, &lp->entity, c);
             break;
 
         case LOOK4CON: /* skipping leading content whitespace*/
@@ -1029,16 +1141,18 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
                 lp->cs = SAWLTINCON;
             else if (!isspace(c))
             {
-                growString(&lp->ce->pcdata, c);
+                /* first content char, which may begin an entity */
                 lp->cs = INCON;
+                sizePCData(lp);
+                return (oneXMLchar(lp, c, ynot));
             }
             break;
 
         case INCON: /* reading content */
             if (c == '&')
             {
-                newString(&lp->entity);
-                growString(&lp->entity, c);
+                newString(NULL, &lp->entity);
+                growString(NULL, &lp->entity, c);
                 lp->cs = ENTINCON;
             }
             else if (c == '<')
@@ -1046,11 +1160,13 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
                 /* chomp trailing whitespace */
                 while (lp->ce->pcdata.sl > 0 && isspace(lp->ce->pcdata.s[lp->ce->pcdata.sl - 1]))
                     lp->ce->pcdata.s[--(lp->ce->pcdata.sl)] = '\0';
+                if (lp->ce->stream)
+                    flushPCData(lp, 1);
                 lp->cs = SAWLTINCON;
             }
             else
             {
-                growString(&lp->ce->pcdata, c);
+                growString(lp->ce->ar, &lp->ce->pcdata, c);
             }
             break;
 
@@ -1058,19 +1174,19 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
             if (c == ';')
             {
                 /* if find a recognized esc seq, add equiv char else raw seq */
-                growString(&lp->entity, c);
+                growString(NULL, &lp->entity, c);
                 if (decodeEntity(lp->entity.s, &c))
-                    growString(&lp->ce->pcdata, c);
+                    growString(lp->ce->ar, &lp->ce->pcdata, c);
                 else
                 {
-                    appendString(&lp->ce->pcdata, lp->entity.s);
+                    appendString(lp->ce->ar, &lp->ce->pcdata, lp->entity.s);
                     lp->ce->pcdata_hasent = 1;
                 }
-                freeString(&lp->entity);
+                freeString(NULL, &lp->entity);
                 lp->cs = INCON;
             }
             else
-                growString(&lp->entity, c);
+                growString(NULL, &lp->entity, c);
             break;
 
         case SAWLTINCON: /* saw < in content */
@@ -1084,7 +1200,7 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
                 pushXMLEle(lp);
                 if (isTokenChar(1, c))
                 {
-                    growString(&lp->ce->tag, c);
+                    growString(lp->ce->ar, &lp->ce->tag, c);
                     lp->cs = INTAG;
                 }
                 else
@@ -1095,7 +1211,7 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
         case LOOK4CLOSETAG: /* looking for closing tag after < */
             if (isTokenChar(1, c))
             {
-                growString(&lp->endtag, c);
+                growString(NULL, &lp->endtag, c);
                 lp->cs = INCLOSETAG;
             }
             else if (!isspace(c))
@@ -1107,7 +1223,7 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 
         case INCLOSETAG: /* reading closing tag */
             if (isTokenChar(0, c))
-                growString(&lp->endtag, c);
+                growString(NULL, &lp->endtag, c);
             else if (c == '>')
             {
                 if (strcmp(lp->ce->tag.s, lp->endtag.s))
@@ -1115,13 +1231,10 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
                     sprintf(ynot, "Line %d: closing tag %s does not match %s", lp->ln, lp->endtag.s, lp->ce->tag.s);
                     return (-1);
                 }
-                else if (lp->ce->pe)
-                {
-                    popXMLEle(lp);
-                    lp->cs = LOOK4CON; /* back to content after nested elem */
-                }
-                else
+                else if (endXMLEle(lp))
                     return (1); /* yes! */
+                else
+                    lp->cs = LOOK4CON; /* back to content after nested elem */
             }
             else if (!isspace(c))
             {
@@ -1137,12 +1250,157 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 /* set up for a fresh start again */
 static void initParser(LilXML *lp)
 {
-    delXMLEle(lp->ce);
-    freeString(&lp->endtag);
+    int arena             = lp->arena;
+    const XMLHandler *sax = lp->sax;
+    void *saxud           = lp->saxud;
+
+    delPartial(lp);
+    freeString(NULL, &lp->endtag);
+    freeString(NULL, &lp->entity);
     memset(lp, 0, sizeof(*lp));
-    newString(&lp->endtag);
-    lp->cs = LOOK4START;
-    lp->ln = 1;
+    newString(NULL, &lp->endtag);
+    lp->cs    = LOOK4START;
+    lp->ln    = 1;
+    lp->arena = arena;
+    lp->sax   = sax;
+    lp->saxud = saxud;
+}
+
+/* delete the whole of any tree lp is part way through */
+static void delPartial(LilXML *lp)
+{
+    XMLEle *root = lp->ce;
+
+    while (root && root->pe)
+        root = root->pe;
+    delXMLEle(root);
+    lp->ce = NULL;
+}
+
+/* called in INCON to append the run of pcdata at s, up to n chars, that
+ * needs no help from oneXMLchar(), ie up to the next '<', '&' or NUL.
+ * return count of chars used, 0 if none.
+ */
+static int scanPCData(LilXML *lp, const char *s, int n)
+{
+    const char *e;
+
+    if ((e = memchr(s, '<', n)))
+        n = e - s;
+    if ((e = memchr(s, '&', n)))
+        n = e - s;
+    if ((e = memchr(s, '\0', n)))
+        n = e - s;
+    if (n == 0)
+        return (0);
+
+    for (e = s; (e = memchr(e, '\n', s + n - e)); e++)
+        lp->ln++;
+    appendStringLen(lp->ce->ar, &lp->ce->pcdata, s, n);
+    lp->lastc = s[n - 1];
+    if (lp->ce->stream)
+        flushPCData(lp, 0);
+
+    return (n);
+}
+
+/* called on entering INCON to make room up front for all the base64 of a
+ * oneBLOB, from enclen or else size, so it is seldom copied as it grows.
+ * the attributes are only a hint from the sender so at most MAXPCHINT is
+ * taken, beyond that the pcdata grows as usual.
+ */
+static void sizePCData(LilXML *lp)
+{
+    XMLEle *ep = lp->ce;
+    XMLAtt *ap;
+    long n;
+    int isenc;
+
+    if (ep->stream || strcmp(ep->tag.s, "oneBLOB"))
+        return;
+    if ((ap = findXMLAtt(ep, "enclen")))
+        isenc = 1;
+    else if ((ap = findXMLAtt(ep, "size")) && !findXMLAtt(ep, "attached"))
+        isenc = 0;
+    else
+        return;
+
+    /* ignore nonsense, then allow for base64 and IDSetBLOB's newlines */
+    n = atol(ap->valu.s);
+    if (n <= 0)
+        return;
+    if (n > MAXPCHINT)
+        n = MAXPCHINT;
+    if (!isenc)
+        n = (n + 2) / 3 * 4;
+    n += n / 72 + 2;
+    if (n > MAXPCHINT)
+        n = MAXPCHINT;
+    if (n > ep->pcdata.sm)
+    {
+        char *s = (char *)xrealloc(ep->ar, ep->pcdata.s, n);
+
+        if (s)
+        {
+            ep->pcdata.s  = s;
+            ep->pcdata.sm = n;
+        }
+    }
+}
+
+/* pass the pcdata collected so far in ce to the sax pcdata handler and
+ * forget it, all of it if all else holding back any trailing whitespace in
+ * case it turns out to be the end.
+ */
+static void flushPCData(LilXML *lp, int all)
+{
+    XMLEle *ep = lp->ce;
+    int n      = ep->pcdata.sl;
+
+    if (!all)
+        while (n > 0 && isspace(ep->pcdata.s[n - 1]))
+            n--;
+    if (n == 0)
+        return;
+
+    if (lp->sax->pcdata)
+        (*lp->sax->pcdata)(lp->saxud, ep, ep->pcdata.s, n);
+    ep->pcdata.sl -= n;
+    memmove(ep->pcdata.s, ep->pcdata.s + n, ep->pcdata.sl + 1);
+}
+
+/* called when ce has its tag and attributes to tell the sax start handler,
+ * if any, which says whether to collect its pcdata or stream it.
+ */
+static void startXMLEle(LilXML *lp)
+{
+    if (lp->sax && lp->sax->start)
+        lp->ce->stream = !(*lp->sax->start)(lp->saxud, lp->ce);
+}
+
+/* called when ce is complete to tell the sax end handler, if any, then move
+ * on to its parent, deleting ce if the handler does not want it.
+ * return 1 if ce was the root, which is then left in ce or NULL if deleted.
+ */
+static int endXMLEle(LilXML *lp)
+{
+    XMLEle *ep = lp->ce;
+    int keep   = !lp->sax || !lp->sax->end || (*lp->sax->end)(lp->saxud, ep);
+
+    if (!ep->pe)
+    {
+        if (!keep)
+        {
+            delXMLEle(ep);
+            lp->ce = NULL;
+        }
+        return (1);
+    }
+
+    popXMLEle(lp);
+    if (!keep)
+        delXMLEle(ep);
+    return (0);
 }
 
 /* start a new XMLEle.
@@ -1152,7 +1410,9 @@ static void initParser(LilXML *lp)
  */
 static void pushXMLEle(LilXML *lp)
 {
-    lp->ce = growEle(lp->ce);
+    Arena *ar = lp->ce ? lp->ce->ar : (lp->arena ? newArena() : NULL);
+
+    lp->ce = growEle(ar, lp->ce);
     resetEndTag(lp);
 }
 
@@ -1165,19 +1425,24 @@ static void popXMLEle(LilXML *lp)
     resetEndTag(lp);
 }
 
-/* return one new XMLEle, added to the given element if given */
-static XMLEle *growEle(XMLEle *pe)
+/* return one new XMLEle in ar, added to the given element if given.
+ * the first element made in a new arena is its root.
+ */
+static XMLEle *growEle(Arena *ar, XMLEle *pe)
 {
-    XMLEle *newe = (XMLEle *)moremem(NULL, sizeof(XMLEle));
+    XMLEle *newe = (XMLEle *)xalloc(ar, sizeof(XMLEle));
 
     memset(newe, 0, sizeof(XMLEle));
-    newString(&newe->tag);
-    newString(&newe->pcdata);
+    newe->ar = ar;
+    if (ar && !ar->root)
+        ar->root = newe;
+    newString(ar, &newe->tag);
+    newString(ar, &newe->pcdata);
     newe->pe = pe;
 
     if (pe)
     {
-        pe->el            = (XMLEle **)moremem(pe->el, (pe->nel + 1) * sizeof(XMLEle *));
+        pe->el            = (XMLEle **)xrealloc(ar, pe->el, (pe->nel + 1) * sizeof(XMLEle *));
         pe->el[pe->nel++] = newe;
     }
 
@@ -1187,34 +1452,34 @@ static XMLEle *growEle(XMLEle *pe)
 /* add room for and return one new XMLAtt to the given element */
 static XMLAtt *growAtt(XMLEle *ep)
 {
-    XMLAtt *newa = (XMLAtt *)moremem(NULL, sizeof(XMLAtt));
+    XMLAtt *newa = (XMLAtt *)xalloc(ep->ar, sizeof(XMLAtt));
 
     memset(newa, 0, sizeof(*newa));
-    newString(&newa->name);
-    newString(&newa->valu);
+    newString(ep->ar, &newa->name);
+    newString(ep->ar, &newa->valu);
     newa->ce = ep;
 
-    ep->at            = (XMLAtt **)moremem(ep->at, (ep->nat + 1) * sizeof(XMLAtt *));
+    ep->at            = (XMLAtt **)xrealloc(ep->ar, ep->at, (ep->nat + 1) * sizeof(XMLAtt *));
     ep->at[ep->nat++] = newa;
 
     return (newa);
 }
 
 /* free a and all it holds */
-static void freeAtt(XMLAtt *a)
+static void freeAtt(Arena *ar, XMLAtt *a)
 {
     if (!a)
         return;
-    freeString(&a->name);
-    freeString(&a->valu);
-    (*myfree)(a);
+    freeString(ar, &a->name);
+    freeString(ar, &a->valu);
+    xfree(ar, a);
 }
 
 /* reset endtag */
 static void resetEndTag(LilXML *lp)
 {
-    freeString(&lp->endtag);
-    newString(&lp->endtag);
+    freeString(NULL, &lp->endtag);
+    newString(NULL, &lp->endtag);
 }
 
 /* 1 if c is a valid token character, else 0.
@@ -1225,25 +1490,25 @@ static int isTokenChar(int start, int c)
     return (isalpha(c) || c == '_' || (!start && isdigit(c)));
 }
 
-/* grow the String storage at *sp to append c */
-static void growString(String *sp, int c)
+/* grow the String storage at *sp in ar to append c */
+static void growString(Arena *ar, String *sp, int c)
 {
     int l = sp->sl + 2; /* need room for '\0' plus c */
 
     if (l > sp->sm)
     {
         if (!sp->s)
-            newString(sp);
+            newString(ar, sp);
         else
-            sp->s = (char *)moremem(sp->s, sp->sm *= 2);
+            sp->s = (char *)xrealloc(ar, sp->s, sp->sm *= 2);
     }
     sp->s[--l] = '\0';
     sp->s[--l] = (char)c;
     sp->sl++;
 }
 
-/* append str to the String storage at *sp */
-static void appendString(String *sp, const char *str)
+/* append str to the String storage at *sp in ar */
+static void appendString(Arena *ar, String *sp, const char *str)
 {
     if (!sp || !str)
         return;
@@ -1254,9 +1519,9 @@ static void appendString(String *sp, const char *str)
     if (l > sp->sm)
     {
         if (!sp->s)
-            newString(sp);
+            newString(ar, sp);
         if (l > sp->sm)
-            sp->s = (char *)moremem(sp->s, (sp->sm = l));
+            sp->s = (char *)xrealloc(ar, sp->s, (sp->sm = l));
     }
     if (sp->s)
     {
@@ -1265,34 +1530,220 @@ static void appendString(String *sp, const char *str)
     }
 }
 
-/* init a String with a malloced string containing just \0 */
-static void newString(String *sp)
+/* append strl chars at str to the String storage at *sp in ar */
+static void appendStringLen(Arena *ar, String *sp, const char *str, int strl)
+{
+    int l = sp->sl + strl + 1; /* need room for '\0' */
+
+    if (l > sp->sm)
+    {
+        sp->sm = sp->sm * 2 > l ? sp->sm * 2 : l;
+        sp->s  = (char *)xrealloc(ar, sp->s, sp->sm);
+    }
+    memcpy(&sp->s[sp->sl], str, strl);
+    sp->sl += strl;
+    sp->s[sp->sl] = '\0';
+}
+
+/* init a String with a string in ar containing just \0 */
+static void newString(Arena *ar, String *sp)
 {
     if (!sp)
         return;
 
-    sp->s  = (char *)moremem(NULL, MINMEM);
+    sp->s  = (char *)xalloc(ar, MINMEM);
     sp->sm = MINMEM;
     *sp->s = '\0';
     sp->sl = 0;
 }
 
-/* free memory used by the given String */
-static void freeString(String *sp)
+/* free memory used by the given String in ar */
+static void freeString(Arena *ar, String *sp)
 {
-    if (sp->s)
-        (*myfree)(sp->s);
+    xfree(ar, sp->s);
     sp->s  = NULL;
     sp->sl = 0;
     sp->sm = 0;
 }
 
+/* free the pcdata of ep, wherever it came from */
+static void freePCData(XMLEle *ep)
+{
+    if (ep->pcdata_own)
+    {
+        free(ep->pcdata.s);
+        ep->pcdata_own = 0;
+        ep->pcdata.s   = NULL;
+        ep->pcdata.sl  = 0;
+        ep->pcdata.sm  = 0;
+    }
+    else
+        freeString(ep->ar, &ep->pcdata);
+}
+
 /* like malloc but knows to use realloc if already started */
 static void *moremem(void *old, int n)
 {
     return (old ? (*myrealloc)(old, n) : (*mymalloc)(n));
 }
 
+/* start a new empty Arena */
+static Arena *newArena(void)
+{
+    ArenaChunk *cp = newChunk(ARENACHUNK);
+    Arena *ar      = (Arena *)cp->buf;
+
+    memset(ar, 0, sizeof(*ar));
+    ar->chunks = cp;
+    cp->used   = ARENARND(sizeof(*ar));
+    return (ar);
+}
+
+/* free ar and all memory allocated from it */
+static void delArena(Arena *ar)
+{
+    ArenaChunk *cp, *next;
+
+    for (cp = ar->chunks; cp; cp = next)
+    {
+        next = cp->next;
+        if (cp->size == ARENACHUNK && !sparechunk)
+            keepSpareChunk(cp);
+        else
+            (*myfree)(cp);
+    }
+}
+
+#if !defined(_MSC_VER)
+/* free the spare chunk of a thread as it exits, given &sparechunk */
+static void freeSpareChunk(void *arg)
+{
+    ArenaChunk **spp = (ArenaChunk **)arg;
+
+    (*myfree)(*spp);
+    *spp = NULL;
+}
+
+/* create the key whose destructor frees each thread's spare chunk */
+static void newSpareKey(void)
+{
+    pthread_key_create(&sparekey, freeSpareChunk);
+}
+#endif
+
+/* keep cp as this thread's spare chunk, arranging to free it at thread exit */
+static void keepSpareChunk(ArenaChunk *cp)
+{
+#if !defined(_MSC_VER)
+    if (!sparekeyset)
+    {
+        pthread_once(&sparekeyonce, newSpareKey);
+        pthread_setspecific(sparekey, &sparechunk);
+        sparekeyset = 1;
+    }
+#endif
+    sparechunk = cp;
+}
+
+/* return an empty chunk with room for size bytes */
+static ArenaChunk *newChunk(size_t size)
+{
+    ArenaChunk *cp;
+
+    if (size == ARENACHUNK && sparechunk)
+    {
+        cp         = sparechunk;
+        sparechunk = NULL;
+    }
+    else
+        cp = (ArenaChunk *)(*mymalloc)(sizeof(ArenaChunk) + size);
+
+    cp->next  = NULL;
+    cp->size  = size;
+    cp->used  = 0;
+    cp->lastp = NULL;
+    return (cp);
+}
+
+/* return n bytes from ar, or from malloc if ar is NULL or sealed or n is big */
+static void *xalloc(Arena *ar, size_t n)
+{
+    size_t need = ARENAHDR + ARENARND(n);
+    ArenaChunk *cp;
+    char *p;
+
+    if (!ar)
+        return ((*mymalloc)(n));
+    if (ar->sealed || n > ARENABIG)
+    {
+        ar->mixed = 1;
+        p = (char *)(*mymalloc)(ARENAHDR + n);
+        if (!p)
+            return (NULL);
+        *(size_t *)p = ARENAMALLOC;
+        return (p + ARENAHDR);
+    }
+
+    cp = ar->chunks;
+    if (cp->used + need > cp->size)
+    {
+        cp         = newChunk(ARENACHUNK);
+        cp->next   = ar->chunks;
+        ar->chunks = cp;
+    }
+
+    p                             = cp->buf + cp->used + ARENAHDR;
+    *(size_t *)(p - ARENAHDR) = n;
+    cp->used += need;
+    cp->lastp = p;
+    return (p);
+}
+
+/* like realloc for memory from xalloc(ar) */
+static void *xrealloc(Arena *ar, void *old, size_t n)
+{
+    ArenaChunk *cp;
+    size_t oldn;
+    char *p;
+
+    if (!old)
+        return (xalloc(ar, n));
+    if (!ar)
+        return ((*myrealloc)(old, n));
+    oldn = *(size_t *)((char *)old - ARENAHDR);
+    if (oldn == ARENAMALLOC)
+    {
+        p = (char *)(*myrealloc)((char *)old - ARENAHDR, ARENAHDR + n);
+        return (p ? p + ARENAHDR : NULL);
+    }
+
+    /* the last allocation can grow in place while there is room */
+    cp = ar->chunks;
+    if (!ar->sealed && n <= ARENABIG && (char *)old == cp->lastp &&
+        (char *)old + ARENARND(n) <= cp->buf + cp->size)
+    {
+        cp->used                             = (char *)old - cp->buf + ARENARND(n);
+        *(size_t *)((char *)old - ARENAHDR) = n;
+        return (old);
+    }
+
+    p = xalloc(ar, n);
+    if (p)
+        memcpy(p, old, oldn < n ? oldn : n);
+    return (p);
+}
+
+/* free p from xalloc(ar), unless it is in one of the chunks of ar */
+static void xfree(Arena *ar, void *p)
+{
+    if (!p)
+        return;
+    if (!ar)
+        (*myfree)(p);
+    else if (*(size_t *)((char *)p - ARENAHDR) == ARENAMALLOC)
+        (*myfree)((char *)p - ARENAHDR);
+}
+
 #if defined(MAIN_TST)
 int main(int ac, char *av[])
 {
@@ -91,6 +91,30 @@ extern LilXML *newLilXML();
 */
 extern void delLilXML(LilXML *lp);
 
+/** \brief Build the trees a lilxml parser returns in arenas.
+    \param lp a pointer to a lilxml parser.
+    \param on if non-zero, each tree parsed from now on is allocated from its own arena, which delXMLEle() frees all at once when given the root. Trees behave the same either way; memory of elements deleted from an arena tree is only reclaimed with its root.
+*/
+extern void useArenaLilXML(LilXML *lp, int on);
+
+/** \brief Event handlers a lilxml parser calls as it goes, see setSAXLilXML(). Any may be NULL. */
+typedef struct
+{
+    /** ep now has its tag and all its attributes, and its parent is parentXMLEle(ep). Return 1 to collect its pcdata in ep as usual, or 0 to have it passed to pcdata() as it arrives instead. NULL acts as 1. */
+    int (*start)(void *ud, XMLEle *ep);
+    /** the next n chars of the pcdata of ep, which are not 0 terminated. Leading and trailing whitespace and entities are handled just as for pcdataXMLEle(). */
+    void (*pcdata)(void *ud, XMLEle *ep, const char *s, int n);
+    /** ep and all its children are complete. Return 1 to keep ep in its tree, or 0 to delete it now. NULL acts as 1. */
+    int (*end)(void *ud, XMLEle *ep);
+} XMLHandler;
+
+/** \brief Have a lilxml parser report each element as it is parsed.
+    \param lp a pointer to a lilxml parser.
+    \param hp handlers to call from now on, or NULL for none. Only trees whose root end() keeps are returned by readXMLEle() and parseXMLChunk(), so a parser whose handlers keep nothing and collect no pcdata runs in constant memory however large the message. Elements of a tree abandoned on error get no end().
+    \param ud passed to each handler.
+*/
+extern void setSAXLilXML(LilXML *lp, const XMLHandler *hp, void *ud);
+
 /** \brief Delete an XML element.
     \return a pointer to the XML Element to be deleted.
 */
@@ -113,6 +137,12 @@ extern XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char errmsg[]);
 */
 extern XMLEle *readXMLEle(LilXML *lp, int c, char errmsg[]);
 
+/** \brief Make a deep copy of an XML element.
+    \param ep a pointer to the XML element to copy.
+    \return A pointer to the new XML element, to be freed with delXMLEle().
+*/
+extern XMLEle *cloneXMLEle(XMLEle *ep);
+
 /* search functions */
 /** \brief Find an XML attribute within an XML element.
     \param e a pointer to the XML element to search.
@@ -209,6 +239,30 @@ extern XMLEle *addXMLEle(XMLEle *parent, const char *tag);
 */
 extern void editXMLEle(XMLEle *ep, const char *pcdata);
 
+/** \brief make room for len bytes of pcdata in the given element, to be filled in by the caller.
+    The pcdata may then hold binary data, so its length must be taken from pcdatalenXMLEle().
+    \param ep pointer to an XML element.
+    \param len number of bytes of pcdata.
+    \return pointer to the pcdata storage, which is len+1 bytes with a trailing \0.
+*/
+extern char *editXMLEleLen(XMLEle *ep, int len);
+
+/** \brief make len bytes already in memory the pcdata of the given element, without copying them.
+    The element then owns the memory and frees it when deleted or edited.
+    \param ep pointer to an XML element.
+    \param pcdata memory from malloc() with room for len+1 bytes, as it is given a trailing \0.
+    \param len number of bytes of pcdata.
+*/
+extern void adoptXMLEleLen(XMLEle *ep, char *pcdata, int len);
+
+/** \brief take the pcdata of the given element, leaving it empty.
+    Storage given by adoptXMLEleLen() is handed back as is, anything else is copied.
+    \param ep pointer to an XML element.
+    \param len set to the number of bytes of pcdata.
+    \return pointer to len+1 bytes from malloc() with a trailing \0 for the caller to free(), or NULL if no memory.
+*/
+extern char *takeXMLEleLen(XMLEle *ep, int *len);
+
 /** \brief Add an XML attribute to an existing XML element.
     \param ep pointer to an XML element
     \param name the name of the XML attribute to add.
@@ -229,7 +283,7 @@ extern void rmXMLAtt(XMLEle *ep, const char *name);
 extern void editXMLAtt(XMLAtt *ap, const char *str);
 
 /** \brief return a string with all xml-sensitive characters within the passed string replaced with their entity sequence equivalents.
-*   N.B. caller must use the returned string before calling us again.
+*   N.B. caller must use the returned string before calling us again from the same thread.
 */
 extern char *entityXML(char *str);
 
@@ -21,8 +21,14 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
 
 #include "base64.h"
 
@@ -73,3 +79,197 @@ TEST(CORE_BASE64, Test_from64tobits_fast)
 
     free(p_outbuf);
 }
+
+// Straightforward reference coder to check the table and SIMD paths against
+static std::string ref_to64(const std::vector<unsigned char> &in)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+
+    for (size_t i = 0; i < in.size(); i += 3)
+    {
+        uint32_t n = in[i] << 16;
+        if (i + 1 < in.size())
+            n |= in[i + 1] << 8;
+        if (i + 2 < in.size())
+            n |= in[i + 2];
+
+        out += digits[(n >> 18) & 0x3f];
+        out += digits[(n >> 12) & 0x3f];
+        out += i + 1 < in.size() ? digits[(n >> 6) & 0x3f] : '=';
+        out += i + 2 < in.size() ? digits[n & 0x3f] : '=';
+    }
+
+    return out;
+}
+
+static std::vector<unsigned char> random_bytes(std::mt19937 &rng, size_t len)
+{
+    std::vector<unsigned char> v(len);
+    for (auto &c : v)
+        c = rng() & 0xff;
+    return v;
+}
+
+// Split into lines the way IDSetBLOB writes them
+static std::string wrap72(const std::string &in, const char *eol = "\n")
+{
+    std::string out;
+    for (size_t i = 0; i < in.size(); i += 72)
+        out += in.substr(i, 72) + eol;
+    return out;
+}
+
+static std::vector<unsigned char> decode(const std::string &in)
+{
+    std::vector<unsigned char> out(3 * in.size() / 4 + 3);
+    int len = from64tobits_fast((char *)out.data(), in.data(), in.size());
+    out.resize(len < 0 ? 0 : len);
+    return out;
+}
+
+// Each SIMD level this cpu has, from none up, so every path gets checked rather than just the best
+static std::vector<int> simd_levels()
+{
+    std::vector<int> levels;
+    int best = base64SIMDLevel(-1);
+
+    for (int level = 0; level <= best; level++)
+        levels.push_back(level);
+    return levels;
+}
+
+// Restores the best SIMD level when a test is done with it, however it ends
+struct SIMDLevel
+{
+    explicit SIMDLevel(int level) { base64SIMDLevel(level); }
+    ~SIMDLevel() { base64SIMDLevel(-1); }
+};
+
+TEST(CORE_BASE64, Test_known_answers_each_level)
+{
+    static const char *raw[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar", "FOOBARBAZ",
+                                 "The quick brown fox jumps over the lazy dog, twice: the quick brown fox jumps." };
+    static const char *b64[] = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy", "Rk9PQkFSQkFa",
+                                 "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZywgdHdpY2U6IHRoZSBxdWlj"
+                                 "ayBicm93biBmb3gganVtcHMu" };
+
+    for (int level : simd_levels())
+    {
+        SIMDLevel sl(level);
+
+        for (size_t i = 0; i < sizeof(raw) / sizeof(raw[0]); i++)
+        {
+            size_t len = strlen(raw[i]);
+            std::vector<unsigned char> enc(4 * len / 3 + 4);
+
+            int enclen = to64frombits(enc.data(), (const unsigned char *)raw[i], len);
+            ASSERT_EQ(std::string(b64[i]), std::string((char *)enc.data(), enclen)) << "level " << level;
+
+            std::vector<unsigned char> dec = decode(b64[i]);
+            ASSERT_EQ(std::string(raw[i]), std::string(dec.begin(), dec.end())) << "level " << level;
+        }
+    }
+}
+
+TEST(CORE_BASE64, Test_roundtrip_random)
+{
+    for (int level : simd_levels())
+    {
+        SIMDLevel sl(level);
+        std::mt19937 rng(1234);
+
+        // Every length around the 12, 16, 24 and 28 byte SIMD loop limits and their tails
+        for (size_t len = 0; len < 1024; len++)
+        {
+            std::vector<unsigned char> raw = random_bytes(rng, len);
+            std::vector<unsigned char> enc(4 * len / 3 + 4);
+
+            int enclen = to64frombits(enc.data(), raw.data(), len);
+            std::string ref = ref_to64(raw);
+            ASSERT_EQ((int)ref.size(), enclen) << "level " << level << " len " << len;
+            ASSERT_EQ(ref, std::string((char *)enc.data(), enclen)) << "level " << level << " len " << len;
+
+            ASSERT_EQ(raw, decode(ref)) << "level " << level << " len " << len;
+        }
+    }
+}
+
+TEST(CORE_BASE64, Test_from64tobits_fast_newlines)
+{
+    for (int level : simd_levels())
+    {
+        SIMDLevel sl(level);
+        std::mt19937 rng(5678);
+
+        for (size_t len = 0; len < 600; len += 7)
+        {
+            std::vector<unsigned char> raw = random_bytes(rng, len);
+            std::string b64                = ref_to64(raw);
+
+            ASSERT_EQ(raw, decode(wrap72(b64))) << "level " << level << " len " << len;
+            ASSERT_EQ(raw, decode(wrap72(b64, "\r\n"))) << "level " << level << " len " << len;
+
+            // Lines that split quads
+            std::string odd;
+            for (size_t i = 0; i < b64.size(); i += 13)
+                odd += b64.substr(i, 13) + "\n";
+            ASSERT_EQ(raw, decode(odd)) << "level " << level << " len " << len;
+        }
+    }
+}
+
+TEST(CORE_BASE64, Test_from64tobits_fast_invalid)
+{
+    // Characters outside the alphabet must not stop the rest from decoding. Try one in every position of
+    // the first 64 chars, so in each lane of the 16 and 32 byte loads, on short and longer runs.
+    for (int level : simd_levels())
+    {
+        SIMDLevel sl(level);
+        std::mt19937 rng(91011);
+
+        for (size_t len : { 48, 300 })
+        {
+            std::vector<unsigned char> raw = random_bytes(rng, len);
+            std::string good               = ref_to64(raw);
+
+            for (size_t pos = 0; pos < 64; pos++)
+            {
+                std::string b64 = good;
+                b64[pos]        = '*';
+
+                std::vector<unsigned char> out = decode(b64);
+                size_t bad                     = pos / 4 * 3;
+                ASSERT_EQ(raw.size(), out.size()) << "level " << level << " pos " << pos;
+                ASSERT_TRUE(std::equal(raw.begin(), raw.begin() + bad, out.begin()))
+                    << "level " << level << " len " << len << " pos " << pos;
+                ASSERT_TRUE(std::equal(raw.begin() + bad + 3, raw.end(), out.begin() + bad + 3))
+                    << "level " << level << " len " << len << " pos " << pos;
+            }
+        }
+    }
+}
+
+// A benchmark rather than a check, so kept out of the suite.
+// Run it with --gtest_also_run_disabled_tests --gtest_filter=*throughput*
+TEST(CORE_BASE64, DISABLED_Test_throughput)
+{
+    const size_t len = 16 * 1024 * 1024;
+    std::mt19937 rng(4321);
+    std::vector<unsigned char> raw = random_bytes(rng, len);
+    std::vector<unsigned char> enc(4 * len / 3 + 4);
+    std::vector<char> dec(len + 3);
+
+    auto t0    = std::chrono::steady_clock::now();
+    int enclen = to64frombits(enc.data(), raw.data(), len);
+    auto t1    = std::chrono::steady_clock::now();
+    int declen = from64tobits_fast(dec.data(), (char *)enc.data(), enclen);
+    auto t2    = std::chrono::steady_clock::now();
+
+    ASSERT_EQ((int)len, declen);
+    ASSERT_EQ(0, memcmp(raw.data(), dec.data(), len));
+
+    std::chrono::duration<double> te = t1 - t0, td = t2 - t1;
+    std::cout << "encode " << len / te.count() / 1e6 << " MB/s, decode " << len / td.count() / 1e6 << " MB/s"
+              << std::endl;
+}
@@ -0,0 +1,195 @@
+/*******************************************************************************
+ Tests of INDI::BaseClient against a stand in INDI server on the loopback interface.
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base64.h"
+#include "baseclient.h"
+#include "basedevice.h"
+
+// Keeps each BLOB it is sent, by name
+class BLOBClient : public INDI::BaseClient
+{
+  public:
+    std::map<std::string, std::string> blobs;
+    std::mutex lock;
+    std::condition_variable arrived;
+
+    // Wait for n BLOBs, or give up after a while
+    bool waitBLOBs(size_t n)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        return arrived.wait_for(guard, std::chrono::seconds(60), [&]() { return blobs.size() >= n; });
+    }
+
+  protected:
+    void newBLOB(IBLOB *bp) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        blobs[bp->name] = std::string(static_cast<char *>(bp->blob), bp->bloblen);
+        arrived.notify_all();
+    }
+
+    void newDevice(INDI::BaseDevice *) override {}
+    void removeDevice(INDI::BaseDevice *) override {}
+    void newProperty(INDI::Property *) override {}
+    void removeProperty(INDI::Property *) override {}
+    void newSwitch(ISwitchVectorProperty *) override {}
+    void newNumber(INumberVectorProperty *) override {}
+    void newText(ITextVectorProperty *) override {}
+    void newLight(ILightVectorProperty *) override {}
+    void newMessage(INDI::BaseDevice *, int) override {}
+    void serverConnected() override {}
+    void serverDisconnected(int) override {}
+};
+
+// Listens on a free loopback port, then sends whoever connects script and waits for them to go
+class FakeServer
+{
+  public:
+    explicit FakeServer(const std::string &script) : script(script)
+    {
+        struct sockaddr_in sa;
+        socklen_t len = sizeof(sa);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        lsocket            = socket(AF_INET, SOCK_STREAM, 0);
+        if (lsocket < 0 || bind(lsocket, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(lsocket, 1) < 0 ||
+            getsockname(lsocket, (struct sockaddr *)&sa, &len) < 0)
+            return;
+        port   = ntohs(sa.sin_port);
+        thread = std::thread(&FakeServer::serve, this);
+    }
+
+    ~FakeServer()
+    {
+        if (thread.joinable())
+            thread.join();
+        if (lsocket >= 0)
+            close(lsocket);
+    }
+
+    unsigned int port = 0;
+
+  private:
+    void serve()
+    {
+        int fd = accept(lsocket, nullptr, nullptr);
+        if (fd < 0)
+            return;
+
+        // In uneven pieces, so messages and BLOBs are split every which way
+        std::mt19937 rng(7531);
+        for (size_t sent = 0; sent < script.size();)
+        {
+            ssize_t n = write(fd, script.data() + sent, std::min<size_t>(rng() % 70000 + 1, script.size() - sent));
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+
+        char buf[1024];
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        close(fd);
+    }
+
+    std::string script;
+    int lsocket = -1;
+    std::thread thread;
+};
+
+static std::string random_bytes(std::mt19937 &rng, size_t len)
+{
+    std::string s(len, '\0');
+    for (auto &c : s)
+        c = rng() & 0xff;
+    return s;
+}
+
+// A setBLOBVector holding one oneBLOB of bytes in base64, split into lines as IDSetBLOB() does, with the
+// given size and enclen hints as the sender claims them
+static std::string setBLOB(const char *name, const std::string &bytes, const std::string &hints)
+{
+    std::vector<unsigned char> b64(4 * bytes.size() / 3 + 4);
+    int len = to64frombits(b64.data(), reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size());
+    std::string xml = "<setBLOBVector device='Cam' name='CCD1' state='Ok'>\n  <oneBLOB name='" + std::string(name) +
+                      "' format='.fits' " + hints + ">\n";
+
+    for (int i = 0; i < len; i += 72)
+        xml.append(reinterpret_cast<char *>(b64.data()) + i, std::min(72, len - i)).append("\n");
+    return xml + "  </oneBLOB>\n</setBLOBVector>\n";
+}
+
+TEST(CORE_BASECLIENT, Test_base64_blob_hints)
+{
+    // The room taken for a BLOB before its base64 arrives is capped at 4 MB however large the size or enclen
+    // claimed, so BLOBs larger than that, or than claimed, must still arrive whole
+    std::mt19937 rng(2024);
+    std::map<std::string, std::string> sent;
+    sent["big"]   = random_bytes(rng, 5 * 1024 * 1024 + 1);
+    sent["claim"] = random_bytes(rng, 1000);
+    sent["small"] = random_bytes(rng, 100001);
+    sent["plain"] = random_bytes(rng, 3000);
+
+    std::string script = "<defBLOBVector device='Cam' name='CCD1' label='Image' group='Main' state='Idle' perm='ro'>\n"
+                         "  <defBLOB name='big' label='Big'/>\n  <defBLOB name='claim' label='Claim'/>\n"
+                         "  <defBLOB name='small' label='Small'/>\n  <defBLOB name='plain' label='Plain'/>\n"
+                         "</defBLOBVector>\n";
+    script += setBLOB("big", sent["big"], "size='5242881' enclen='" + std::to_string((5242881 + 2) / 3 * 4) + "'");
+    script += setBLOB("claim", sent["claim"], "size='2000000000' enclen='99999999999'");
+    script += setBLOB("small", sent["small"], "size='100001' enclen='8'");
+    script += setBLOB("plain", sent["plain"], "size='3000'");
+
+    FakeServer server(script);
+    ASSERT_NE(0u, server.port);
+
+    BLOBClient client;
+    client.setServer("127.0.0.1", server.port);
+    ASSERT_TRUE(client.connectServer());
+    bool arrived = client.waitBLOBs(sent.size());
+    client.disconnectServer();
+
+    ASSERT_TRUE(arrived);
+    for (auto &blob : sent)
+    {
+        ASSERT_EQ(1u, client.blobs.count(blob.first)) << blob.first;
+        ASSERT_EQ(blob.second.size(), client.blobs[blob.first].size()) << blob.first;
+        ASSERT_TRUE(blob.second == client.blobs[blob.first]) << blob.first;
+    }
+}
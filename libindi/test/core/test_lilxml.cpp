@@ -0,0 +1,440 @@
+/*******************************************************************************
+ Tests of lilxml, the XML parser behind the INDI server, drivers and clients.
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+ .
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+ .
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include <gtest/gtest.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lilxml.h"
+
+// Render a tree in full, so trees from different parses can be compared as strings
+static void dump(XMLEle *ep, std::string &out)
+{
+    out += "<";
+    out += tagXMLEle(ep);
+    for (XMLAtt *ap = nextXMLAtt(ep, 1); ap; ap = nextXMLAtt(ep, 0))
+        out += std::string(" ") + nameXMLAtt(ap) + "=[" + valuXMLAtt(ap) + "]";
+    out += ">[" + std::string(pcdataXMLEle(ep), pcdatalenXMLEle(ep)) + "]";
+    for (XMLEle *cp = nextXMLEle(ep, 1); cp; cp = nextXMLEle(ep, 0))
+        dump(cp, out);
+    out += "</>";
+}
+
+// How many bytes of the document to hand the parser next
+typedef std::function<size_t()> Chunker;
+
+// Parse doc with parseXMLChunk() in pieces sized by next, returning each tree found in order.
+// Bad XML is simply skipped, as parseXMLChunk() only reports the last error in each piece.
+static std::vector<std::string> parse(const std::string &doc, bool arena, Chunker next,
+                                      const XMLHandler *sax = nullptr, void *ud = nullptr)
+{
+    std::vector<std::string> found;
+    std::vector<char> buf(doc.begin(), doc.end());
+    char msg[1024];
+    LilXML *lp = newLilXML();
+
+    useArenaLilXML(lp, arena);
+    setSAXLilXML(lp, sax, ud);
+    for (size_t at = 0; at < buf.size();)
+    {
+        size_t n       = std::min(next(), buf.size() - at);
+        XMLEle **nodes = parseXMLChunk(lp, buf.data() + at, n, msg);
+
+        for (int i = 0; nodes && nodes[i]; i++)
+        {
+            std::string tree;
+            dump(nodes[i], tree);
+            found.push_back(tree);
+            delXMLEle(nodes[i]);
+        }
+        free(nodes);
+        at += n;
+    }
+    delLilXML(lp);
+
+    return found;
+}
+
+// Parse doc with readXMLEle(), as drivers do, one char at a time
+static std::vector<std::string> parseEachChar(const std::string &doc, bool arena)
+{
+    std::vector<std::string> found;
+    char msg[1024];
+    LilXML *lp = newLilXML();
+
+    useArenaLilXML(lp, arena);
+    for (char c : doc)
+    {
+        XMLEle *root = readXMLEle(lp, c, msg);
+
+        if (root)
+        {
+            std::string tree;
+            dump(root, tree);
+            found.push_back(tree);
+            delXMLEle(root);
+        }
+    }
+    delLilXML(lp);
+
+    return found;
+}
+
+// Parse doc whole, then every other way, with and without arenas, and check all agree. Returns the whole parse.
+static std::vector<std::string> parseEveryWay(const std::string &doc)
+{
+    std::vector<std::string> whole = parse(doc, false, [&]() { return doc.size(); });
+
+    for (bool arena : { false, true })
+    {
+        std::mt19937 rng(2468);
+
+        EXPECT_EQ(whole, parse(doc, arena, [&]() { return doc.size(); })) << "whole, arena " << arena;
+        EXPECT_EQ(whole, parse(doc, arena, []() { return 1; })) << "bytes, arena " << arena;
+        EXPECT_EQ(whole, parseEachChar(doc, arena)) << "readXMLEle, arena " << arena;
+
+        // Small documents are also cut in two at every place
+        for (size_t cut = 1; doc.size() <= 2048 && cut < doc.size(); cut++)
+        {
+            bool first = true;
+            EXPECT_EQ(whole, parse(doc, arena, [&]() { return first ? (first = false, cut) : doc.size(); }))
+                << "cut at " << cut << ", arena " << arena;
+        }
+        for (size_t most : { 3, 17, 200 })
+        {
+            for (int run = 0; run < 20; run++)
+                EXPECT_EQ(whole, parse(doc, arena, [&]() { return rng() % most + 1; }))
+                    << "chunks of 1 to " << most << ", arena " << arena << ", run " << run;
+        }
+    }
+
+    return whole;
+}
+
+TEST(CORE_LILXML, Test_tags_attributes_pcdata)
+{
+    const std::string doc = "<defNumberVector device='CCD Simulator' name=\"CCD_EXPOSURE\" state='Idle' perm=\"rw\">\n"
+                            "  <defNumber name='CCD_EXPOSURE_VALUE' format=\"%5.2f\" min='0' max='3600'>\n"
+                            "      1.5\n"
+                            "  </defNumber>\n"
+                            "</defNumberVector>\n";
+
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(1u, trees.size());
+    ASSERT_EQ("<defNumberVector device=[CCD Simulator] name=[CCD_EXPOSURE] state=[Idle] perm=[rw]>[]"
+              "<defNumber name=[CCD_EXPOSURE_VALUE] format=[%5.2f] min=[0] max=[3600]>[1.5]</></>",
+              trees[0]);
+}
+
+TEST(CORE_LILXML, Test_entities)
+{
+    const std::string doc = "<message device='a &amp; b' message=\"&lt;&quot;x&apos;&gt; &bogus;\"/>"
+                            "<oneText name='t'>&lt;b&gt;bold&lt;/b&gt; &amp;&amp; &quot;q&quot; &apos;a&apos; "
+                            "&nbsp; &#65;</oneText>";
+
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(2u, trees.size());
+    ASSERT_EQ("<message device=[a & b] message=[<\"x'> &bogus;]>[]</>", trees[0]);
+    ASSERT_EQ("<oneText name=[t]>[<b>bold</b> && \"q\" 'a' &nbsp; &#65;]</>", trees[1]);
+}
+
+TEST(CORE_LILXML, Test_several_roots)
+{
+    // Self closing elements, text and junk between messages, and a message after one with bad XML
+    const std::string doc = "junk <getProperties version='1.7'/> more junk\n"
+                            "<setSwitchVector device='d' name='s'><oneSwitch name='on'>On</oneSwitch>"
+                            "<oneSwitch name='off'>Off</oneSwitch></setSwitchVector>"
+                            "<a><b></c></a>"
+                            "<delProperty device='d' />";
+
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(3u, trees.size());
+    ASSERT_EQ("<getProperties version=[1.7]>[]</>", trees[0]);
+    ASSERT_EQ("<setSwitchVector device=[d] name=[s]>[]<oneSwitch name=[on]>[On]</><oneSwitch name=[off]>[Off]</></>",
+              trees[1]);
+    ASSERT_EQ("<delProperty device=[d]>[]</>", trees[2]);
+}
+
+TEST(CORE_LILXML, Test_comments_and_declarations)
+{
+    // <! and <? up to the next > are skipped wherever they are, CDATA included as lilxml does not know it
+    const std::string doc = "<?xml version='1.0' encoding='UTF-8'?>\n"
+                            "<!-- first -->\n"
+                            "<newTextVector device='d' name='t'><!-- in an element -->"
+                            "<oneText name='a'>one<!-- c -->two<![CDATA[three]]>four</oneText>"
+                            "<!DOCTYPE junk></newTextVector>";
+
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(1u, trees.size());
+    ASSERT_EQ("<newTextVector device=[d] name=[t]>[]<oneText name=[a]>[onetwofour]</></>", trees[0]);
+}
+
+TEST(CORE_LILXML, Test_entities_across_edges)
+{
+    // Entities next to each other, next to tags and at either end of pcdata, and a lone &
+    const std::string doc = "<a x='&amp;&lt;' y='&gt;'>&amp;&amp;<b>&lt;</b>&gt;x&quot;</a>"
+                            "<c>tail &amp;</c><d>&</d>";
+
+    // The lone & swallows the rest as it waits for a ;
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(2u, trees.size());
+    ASSERT_EQ("<a x=[&<] y=[>]>[&&>x\"]<b>[<]</></>", trees[0]);
+    ASSERT_EQ("<c>[tail &]</>", trees[1]);
+}
+
+// Base64 of len bytes in lines of 72, as IDSetBLOB() writes it
+static std::string blob64(size_t len)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::mt19937 rng(1357);
+    std::string out;
+
+    for (size_t i = 0; i < (len + 2) / 3 * 4; i++)
+    {
+        out += digits[rng() % 64];
+        if (i % 72 == 71)
+            out += '\n';
+    }
+    return out;
+}
+
+TEST(CORE_LILXML, Test_large_pcdata)
+{
+    // Long runs taken by the fast scan, broken by entities, a child and a comment, in pieces every which way
+    std::string run = blob64(60000), body;
+    for (size_t i = 0; i < run.size(); i += 20000)
+        body += run.substr(i, 20000) + "&amp;";
+
+    const std::string doc = "<setBLOBVector device='d' name='b'><oneBLOB name='img' size='60000' format='.fits'>" +
+                            body + "<!-- c -->" + run + "</oneBLOB>" + "<x>" + run + "</x></setBLOBVector>";
+
+    std::string want = body;
+    for (size_t at; (at = want.find("&amp;")) != std::string::npos;)
+        want.replace(at, 5, "&");
+    want += run;
+    while (isspace(want.back()))
+        want.pop_back();
+    std::string x = run;
+    while (isspace(x.back()))
+        x.pop_back();
+
+    std::vector<std::string> trees = parseEveryWay(doc);
+    ASSERT_EQ(1u, trees.size());
+    ASSERT_EQ("<setBLOBVector device=[d] name=[b]>[]<oneBLOB name=[img] size=[60000] format=[.fits]>[" + want +
+                  "]</><x>[" + x + "]</></>",
+              trees[0]);
+}
+
+TEST(CORE_LILXML, Test_blob_size_hints)
+{
+    // The room made up front for a oneBLOB comes from what the sender claims, which must not matter however
+    // wrong: too small, too large, beyond what is ever taken on trust, negative or not a number
+    std::string b64 = blob64(5 * 1024 * 1024);
+    std::string b64end = b64;
+    while (isspace(b64end.back()))
+        b64end.pop_back();
+
+    for (const char *hint : { "size='10'", "enclen='10'", "size='5242880'", "enclen='8388608'", "size='1000000000'",
+                              "enclen='99999999999999999999'", "size='-100'", "enclen='-1'", "size='many'",
+                              "enclen=''", "size='100' attached='true'", "" })
+    {
+        std::string doc = std::string("<setBLOBVector><oneBLOB name='img' ") + hint + ">" + b64 +
+                          "</oneBLOB></setBLOBVector>";
+        std::vector<std::string> want, got;
+
+        for (bool arena : { false, true })
+        {
+            std::mt19937 rng(97531);
+            got = parse(doc, arena, [&]() { return rng() % 100000 + 1; });
+            ASSERT_EQ(1u, got.size()) << hint;
+            if (want.empty())
+                want = got;
+            ASSERT_EQ(want, got) << hint << ", arena " << arena;
+            ASSERT_NE(std::string::npos, got[0].find(">[" + b64end + "]</></>")) << hint;
+        }
+    }
+}
+
+// Each sax event as +tag for start() and -tag for end(), the latter with the pcdata of elements whose tag is
+// stream, which is given to pcdata() rather than kept. Roots are dropped by end() if drop.
+struct SAXLog
+{
+    std::vector<std::string> events;
+    std::string pcdata;
+    const char *stream;
+    bool drop;
+};
+
+static int saxStart(void *ud, XMLEle *ep)
+{
+    SAXLog *log = static_cast<SAXLog *>(ud);
+
+    log->events.push_back(std::string("+") + tagXMLEle(ep));
+    return strcmp(tagXMLEle(ep), log->stream) != 0;
+}
+
+static void saxPCData(void *ud, XMLEle *ep, const char *s, int n)
+{
+    SAXLog *log = static_cast<SAXLog *>(ud);
+
+    EXPECT_STREQ(log->stream, tagXMLEle(ep));
+    log->pcdata.append(s, n);
+}
+
+static int saxEnd(void *ud, XMLEle *ep)
+{
+    SAXLog *log = static_cast<SAXLog *>(ud);
+    std::string event = std::string("-") + tagXMLEle(ep);
+
+    if (!strcmp(tagXMLEle(ep), log->stream))
+    {
+        EXPECT_EQ(0, pcdatalenXMLEle(ep));
+        event += "[" + log->pcdata + "]";
+        log->pcdata.clear();
+    }
+    log->events.push_back(event);
+    return !(log->drop && !parentXMLEle(ep));
+}
+
+// The events a sax parse of the tree at ep should give
+static void saxEvents(XMLEle *ep, const char *stream, std::vector<std::string> &events)
+{
+    events.push_back(std::string("+") + tagXMLEle(ep));
+    for (XMLEle *cp = nextXMLEle(ep, 1); cp; cp = nextXMLEle(ep, 0))
+        saxEvents(cp, stream, events);
+    std::string event = std::string("-") + tagXMLEle(ep);
+    if (!strcmp(tagXMLEle(ep), stream))
+        event += "[" + std::string(pcdataXMLEle(ep), pcdatalenXMLEle(ep)) + "]";
+    events.push_back(event);
+}
+
+TEST(CORE_LILXML, Test_sax_matches_tree)
+{
+    static const XMLHandler handlers = { saxStart, saxPCData, saxEnd };
+    const std::string doc = "<defBLOBVector device='d' name='b'><defBLOB name='img'/></defBLOBVector>\n"
+                            "<setBLOBVector device='d' name='b'>\n"
+                            "  <oneBLOB name='img' size='3000' format='.fits'>\n" +
+                            blob64(3000) + "  </oneBLOB>\n"
+                            "  <oneBLOB name='raw' size='5' format='.txt'> a &lt;&amp;&gt; <!-- c --> b \n"
+                            "  </oneBLOB>\n"
+                            "  <oneBLOB name='none' size='0' format='.txt'/>\n"
+                            "</setBLOBVector>\n"
+                            "<message device='d' message='done'/>";
+
+    // The events expected, from the trees lilxml builds on its own
+    std::vector<std::string> want;
+    std::vector<char> buf(doc.begin(), doc.end());
+    char msg[1024];
+    LilXML *lp     = newLilXML();
+    XMLEle **nodes = parseXMLChunk(lp, buf.data(), buf.size(), msg);
+    for (int i = 0; nodes[i]; i++)
+    {
+        saxEvents(nodes[i], "oneBLOB", want);
+        delXMLEle(nodes[i]);
+    }
+    free(nodes);
+    delLilXML(lp);
+    ASSERT_EQ(14u, want.size());
+    ASSERT_EQ("-oneBLOB[a <&>  b]", want[8]);
+
+    for (bool drop : { false, true })
+    {
+        for (bool arena : { false, true })
+        {
+            std::mt19937 rng(8642);
+            std::vector<Chunker> chunkers = { [&]() { return doc.size(); }, []() { return 1; },
+                                              [&]() { return rng() % 17 + 1; }, [&]() { return rng() % 500 + 1; } };
+
+            for (size_t i = 0; i < chunkers.size(); i++)
+            {
+                SAXLog log = { {}, "", "oneBLOB", drop };
+                std::vector<std::string> trees = parse(doc, arena, chunkers[i], &handlers, &log);
+
+                EXPECT_EQ(want, log.events) << "chunker " << i << ", arena " << arena << ", drop " << drop;
+                EXPECT_EQ(drop ? 0u : 3u, trees.size()) << "chunker " << i << ", arena " << arena;
+            }
+        }
+    }
+}
+
+TEST(CORE_LILXML, Test_adopt_and_take)
+{
+    for (bool arena : { false, true })
+    {
+        std::string doc = "<setBLOBVector><oneBLOB name='a'>QUJD</oneBLOB><oneBLOB name='b'>QUJD</oneBLOB>"
+                          "<oneBLOB name='c'>QUJD</oneBLOB></setBLOBVector>";
+        std::vector<XMLEle *> blobs;
+        XMLEle *root = nullptr;
+        LilXML *lp   = newLilXML();
+        char msg[1024];
+
+        useArenaLilXML(lp, arena);
+        XMLEle **nodes = parseXMLChunk(lp, &doc[0], doc.size(), msg);
+        ASSERT_TRUE(nodes && nodes[0]);
+        root = nodes[0];
+        free(nodes);
+        delLilXML(lp);
+        for (XMLEle *ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+            blobs.push_back(ep);
+        ASSERT_EQ(3u, blobs.size());
+
+        // Bytes adopted are used in place, binary and all, and handed back just the same
+        const int len = 100000;
+        char *bytes   = static_cast<char *>(malloc(len + 1));
+        for (int i = 0; i < len; i++)
+            bytes[i] = i % 251;
+        adoptXMLEleLen(blobs[0], bytes, len);
+        ASSERT_EQ(bytes, pcdataXMLEle(blobs[0]));
+        ASSERT_EQ(len, pcdatalenXMLEle(blobs[0]));
+        ASSERT_EQ('\0', bytes[len]);
+
+        int got     = 0;
+        char *taken = takeXMLEleLen(blobs[0], &got);
+        ASSERT_EQ(bytes, taken);
+        ASSERT_EQ(len, got);
+        ASSERT_EQ(0, pcdatalenXMLEle(blobs[0]));
+        ASSERT_STREQ("", pcdataXMLEle(blobs[0]));
+        for (int i = 0; i < len; i++)
+            ASSERT_EQ(i % 251, static_cast<unsigned char>(taken[i]));
+        free(taken);
+
+        // Parsed pcdata is copied out instead, and the element left empty
+        taken = takeXMLEleLen(blobs[1], &got);
+        ASSERT_NE(nullptr, taken);
+        ASSERT_NE(taken, pcdataXMLEle(blobs[1]));
+        ASSERT_EQ(4, got);
+        ASSERT_STREQ("QUJD", taken);
+        ASSERT_EQ(0, pcdatalenXMLEle(blobs[1]));
+        free(taken);
+
+        // Adopted bytes still held are freed with their element, or when replaced
+        adoptXMLEleLen(blobs[1], static_cast<char *>(malloc(11)), 10);
+        adoptXMLEleLen(blobs[2], static_cast<char *>(malloc(11)), 10);
+        editXMLEle(blobs[1], "edited");
+        ASSERT_STREQ("edited", pcdataXMLEle(blobs[1]));
+        delXMLEle(root);
+    }
+}